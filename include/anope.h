@@ -143,6 +143,12 @@ namespace Anope
 		inline string& append(const string &s) { this->_string.append(s.str()); return *this; }
 		inline string& append(const char *s, size_t n) { this->_string.append(s, n); return *this; }
 
+		/**
+		 * Replaces the string's content with part of another string, reusing the existing storage where possible.
+		 */
+		inline string& assign(const string &s, size_type pos, size_type n = npos) { this->_string.assign(s._string, pos, n); return *this; }
+		inline string& assign(const char *s, size_type n) { this->_string.assign(s, n); return *this; }
+
 		/**
 		 * Resizes the string content to n characters.
 		 */
@@ -312,7 +318,14 @@ namespace Anope
 	{
 		inline size_t operator()(const string &s) const
 		{
-			return TR1NS::hash<std::string>()(s.lower().str());
+			/* FNV-1a over the lowered characters, which avoids building a lowered copy of s */
+			size_t h = 2166136261U;
+			for (string::size_type i = 0; i < s.length(); ++i)
+			{
+				h ^= Anope::tolower(s[i]);
+				h *= 16777619U;
+			}
+			return h;
 		}
 	};
 
@@ -328,7 +341,7 @@ namespace Anope
 	{
 		inline bool operator()(const string &s1, const string &s2) const
 		{
-			return s1.equals_ci(s2);
+			return s1.length() == s2.length() && ci::ci_char_traits::compare(s1.c_str(), s2.c_str(), s1.length()) == 0;
 		}
 	};
 
@@ -358,6 +371,12 @@ namespace Anope
 	 */
 	extern CoreExport time_t CurTime;
 
+	/** Get the current system time with microsecond precision.
+	 * This is used for measuring how long things take, not for timestamps.
+	 * @return The number of microseconds since the epoch
+	 */
+	extern CoreExport uint64_t MicroTime();
+
 	/** The debug level we are running at.
 	 */
 	extern CoreExport int Debug;
@@ -15,12 +15,16 @@
  */
 class CoreExport Base
 {
-	/* References to this base class */
-	std::set<ReferenceBase *> *references;
+	/* References to this base class, linked through the references themselves */
+	ReferenceBase *references;
  public:
 	Base();
+	/* References are to an object, so are not copied with it */
+	Base(const Base &);
 	virtual ~Base();
 
+	Base &operator=(const Base &);
+
 	/** Adds a reference to this object. Eg, when a Reference
 	 * is created referring to this object this is called. It is used to
 	 * cleanup references when this object is destructed.
@@ -32,12 +36,28 @@ class CoreExport Base
 
 class ReferenceBase
 {
+	friend class Base;
+
+	/* The object this is in the reference list of, and the neighbours in that list */
+	Base *owner;
+	ReferenceBase *prev, *next;
  protected:
 	bool invalid;
  public:
-	ReferenceBase() : invalid(false) { }
-	ReferenceBase(const ReferenceBase &other) : invalid(other.invalid) { }
-	virtual ~ReferenceBase() { }
+	ReferenceBase() : owner(NULL), prev(NULL), next(NULL), invalid(false) { }
+	ReferenceBase(const ReferenceBase &other) : owner(NULL), prev(NULL), next(NULL), invalid(other.invalid) { }
+	virtual ~ReferenceBase()
+	{
+		if (this->owner)
+			this->owner->DelReference(this);
+	}
+
+	inline ReferenceBase &operator=(const ReferenceBase &other)
+	{
+		this->invalid = other.invalid;
+		return *this;
+	}
+
 	inline void Invalidate() { this->invalid = true; }
 };
 
@@ -29,9 +29,26 @@ struct ChanUserContainer : public Extensible
 	ChanUserContainer(User *u, Channel *c) : user(u), chan(c) { }
 };
 
+/* Statistics about the joins checked at the end of bursts */
+struct BurstJoinStats
+{
+	/* Number of bursts which had joins to check */
+	unsigned long bursts;
+	/* Number of joins and channels checked */
+	unsigned long joins, channels;
+	/* Total and longest time spent checking the joins of a burst, in microseconds */
+	uint64_t total_time, max_time;
+
+	BurstJoinStats() : bursts(0), joins(0), channels(0), total_time(0), max_time(0) { }
+};
+
 class CoreExport Channel : public Base, public Extensible
 {
 	static std::vector<Channel *> deleting;
+	/* Channels with users in burst_joins */
+	static std::set<Channel *> bursting;
+	/* Users who joined during a burst and have not been checked yet */
+	std::vector<Reference<User> > burst_joins;
 
  public:
 	typedef std::multimap<Anope::string, Anope::string> ModeList;
@@ -305,6 +322,22 @@ class CoreExport Channel : public Base, public Extensible
 	void QueueForDeletion();
 
 	static void DeleteChannels();
+
+	/** Queue a user who joined during a burst to be checked (akicks, status modes, and
+	 * OnJoinChannel) with the other users who joined the channel, once the burst is over
+	 * @param u The user
+	 */
+	void QueueBurstJoin(User *u);
+
+	/** Check the users queued by QueueBurstJoin who are on a server which is about to sync,
+	 * a channel at a time
+	 * @param s The server
+	 * @param links Whether to check the users on servers behind s too
+	 */
+	static void ProcessBurstJoins(Server *s, bool links);
+
+	/* Statistics about the joins checked at the end of bursts */
+	static BurstJoinStats BurstStats;
 };
 
 #endif // CHANNELS_H
@@ -93,6 +93,14 @@ namespace Configuration
 	{
 		/* options:readtimeout */
 		time_t ReadTimeout;
+		/* options:maxevents */
+		unsigned MaxEvents;
+		/* options:edgetriggered */
+		bool EdgeTriggered;
+		/* options:logqueue */
+		unsigned LogQueue;
+		/* options:logfsync, -1 for never and 0 for after every write */
+		time_t LogFsync;
 		/* options:useprivmsg */
 		bool UsePrivmsg;
 		/* If we should default to privmsging clients */
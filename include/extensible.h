@@ -18,12 +18,32 @@ class Extensible;
 
 class CoreExport ExtensibleBase : public Service
 {
- protected:
-	std::map<Extensible *, void *> items;
+	/* Index of this in the table of all extensible items */
+	unsigned slot;
+	/* Bit of Extensible::ext_bits used to store this, or -1 if it is stored in Extensible::ext_values */
+	int bit;
+	/* Number of objects this is set on */
+	size_t count;
 
-	ExtensibleBase(Module *m, const Anope::string &n);
+ protected:
+	/** Constructor
+	 * @param m The module
+	 * @param n The name of this item
+	 * @param flag true if this item has no value, only whether or not it is set
+	 */
+	ExtensibleBase(Module *m, const Anope::string &n, bool flag = false);
 	~ExtensibleBase();
 
+	/* Look up the value of this on an object, and whether it is set at all */
+	void *Find(const Extensible *obj) const;
+	bool IsSet(const Extensible *obj) const;
+	/* Set this on an object which it isn't already set on */
+	void Insert(Extensible *obj, void *value);
+	/* Remove this from an object, returning the value it had */
+	void *Remove(Extensible *obj);
+	/* Unset this from every object it is set on */
+	void UnsetAll();
+
  public:
 	virtual void Unset(Extensible *obj) = 0;
 
@@ -34,11 +54,23 @@ class CoreExport ExtensibleBase : public Service
 
 class CoreExport Extensible
 {
- public:
-	std::set<ExtensibleBase *> extension_items;
+	friend class ExtensibleBase;
 
+	/* All extensible objects, so an item can be unset from them when it goes away */
+	Extensible *ext_prev, *ext_next;
+	/* Items set on this object which have no value and a bit */
+	uint64_t ext_bits;
+	/* Values of the other items set on this object, sorted by slot */
+	std::vector<std::pair<unsigned, void *> > ext_values;
+
+ public:
+	Extensible();
+	/* Extensions belong to an object, so are not copied with it */
+	Extensible(const Extensible &);
 	virtual ~Extensible();
 
+	Extensible &operator=(const Extensible &);
+
 	void UnsetExtensibles();
 
 	template<typename T> T* GetExt(const Anope::string &name) const;
@@ -60,20 +92,11 @@ class BaseExtensibleItem : public ExtensibleBase
 	virtual T *Create(Extensible *) = 0;
 
  public:
-	BaseExtensibleItem(Module *m, const Anope::string &n) : ExtensibleBase(m, n) { }
+	BaseExtensibleItem(Module *m, const Anope::string &n, bool flag = false) : ExtensibleBase(m, n, flag) { }
 
 	~BaseExtensibleItem()
 	{
-		while (!items.empty())
-		{
-			std::map<Extensible *, void *>::iterator it = items.begin();
-			Extensible *obj = it->first;
-			T *value = static_cast<T *>(it->second);
-
-			obj->extension_items.erase(this);
-			items.erase(it);
-			delete value;
-		}
+		this->UnsetAll();
 	}
 
 	T* Set(Extensible *obj, const T &value)
@@ -88,30 +111,24 @@ class BaseExtensibleItem : public ExtensibleBase
 	{
 		T* t = Create(obj);
 		Unset(obj);
-		items[obj] = t;
-		obj->extension_items.insert(this);
+		this->Insert(obj, t);
 		return t;
 	}
 
 	void Unset(Extensible *obj) anope_override
 	{
-		T *value = Get(obj);
-		items.erase(obj);
-		obj->extension_items.erase(this);
+		T *value = static_cast<T *>(this->Remove(obj));
 		delete value;
 	}
 
 	T* Get(const Extensible *obj) const
 	{
-		std::map<Extensible *, void *>::const_iterator it = items.find(const_cast<Extensible *>(obj));
-		if (it != items.end())
-			return static_cast<T *>(it->second);
-		return NULL;
+		return static_cast<T *>(this->Find(obj));
 	}
 
 	bool HasExt(const Extensible *obj) const
 	{
-		return items.find(const_cast<Extensible *>(obj)) != items.end();
+		return this->IsSet(obj);
 	}
 
 	T* Require(Extensible *obj)
@@ -157,7 +174,7 @@ class PrimitiveExtensibleItem<bool> : public BaseExtensibleItem<bool>
 		return NULL;
 	}
  public:
-	PrimitiveExtensibleItem(Module *m, const Anope::string &n) : BaseExtensibleItem<bool>(m, n) { }
+	PrimitiveExtensibleItem(Module *m, const Anope::string &n) : BaseExtensibleItem<bool>(m, n, true) { }
 };
 
 template<typename T>
@@ -41,11 +41,54 @@ enum LogType
 struct LogFile
 {
 	Anope::string filename;
-	std::ofstream stream;
+	/* The open file, or -1 if it could not be opened */
+	int fd;
 
 	LogFile(const Anope::string &name);
 	~LogFile();
 	const Anope::string &GetName() const;
+	bool IsOpen() const;
+};
+
+struct LogWriterStats
+{
+	/* Lines written to log files */
+	unsigned long lines;
+	/* Calls to write(), each of which can contain many lines */
+	unsigned long writes;
+	/* Raw IO and debug lines dropped because the queue was full */
+	unsigned long dropped;
+	/* Times a line had to wait for room in the queue */
+	unsigned long waits;
+};
+
+/* Writes lines to log files. Once started, lines are queued and written out in batches
+ * by a background thread, so the main loop does not wait on disk.
+ */
+class CoreExport LogWriter
+{
+ public:
+	static LogWriterStats Stats;
+
+	/** Allow lines to be written by the background thread, which must not be
+	 * done before forking. Until this is called lines are written directly.
+	 */
+	static void Start();
+
+	/** Write out everything queued and stop the background thread
+	 */
+	static void Stop();
+
+	/** Wait until everything queued has been written out
+	 */
+	static void Flush();
+
+	/** Write a line to a log file
+	 * @param lf The log file
+	 * @param line The line, without a trailing newline
+	 * @param droppable true if the line may be dropped when the queue is full
+	 */
+	static void Write(LogFile *lf, const Anope::string &line, bool droppable);
 };
 
 /* Represents a single log message */
@@ -112,6 +155,15 @@ class CoreExport Log
 /* Configured in the configuration file, actually does the message logging */
 class CoreExport LogInfo
 {
+	/* The type lists with the ~ stripped off, built the first time they are needed */
+	mutable std::vector<std::vector<std::pair<Anope::string, bool> > > compiled;
+	/* Lists which match every category */
+	mutable unsigned match_all;
+	/* Bitmasks of the lists each category has been checked against, and which of those matched */
+	mutable Anope::hash_map<std::pair<unsigned, unsigned> > category_types;
+
+	void Compile() const;
+
  public:
 	BotInfo *bot;
 	std::vector<Anope::string> targets;
@@ -287,6 +287,19 @@ class CoreExport ChannelModeNoone : public ChannelMode
 	bool CanSet(User *u) const anope_override;
 };
 
+/* Statistics about the mode stacker */
+struct ModeStackerStats
+{
+	/* Number of mode changes given to the stacker */
+	unsigned long changes;
+	/* Number of those which were not sent because a later change replaced or undid them */
+	unsigned long coalesced;
+	/* Number of mode lines sent */
+	unsigned long lines;
+
+	ModeStackerStats() : changes(0), coalesced(0), lines(0) { }
+};
+
 /** This is the mode manager
  * It contains functions for adding modes to Anope so Anope can track them
  * and do things such as MLOCK.
@@ -301,6 +314,9 @@ class CoreExport ModeManager
 	static unsigned GenericChannelModes;
 	static unsigned GenericUserModes;
 
+	/* Statistics about the mode stacker */
+	static ModeStackerStats StackerStats;
+
 	/** Add a user mode to Anope
 	 * @param um A UserMode or UserMode derived class
 	 * @return true on success, false on error
@@ -66,5 +66,12 @@ struct BadWords
 	 */
 	virtual void ClearBadWords() = 0;
 
+	/** Find the badword matched by a line of text
+	 * @param buf The text, normalized with Anope::NormalizeBuffer
+	 * @param casesensitive Whether to match case sensitively
+	 * @return The first badword on the list which matches, or NULL
+	 */
+	virtual const BadWord* MatchBadWord(const Anope::string &buf, bool casesensitive) = 0;
+
 	virtual void Check() = 0;
 };
@@ -0,0 +1,65 @@
+/*
+ *
+ * (C) 2003-2020 Anope Team
+ * Contact us at team@anope.org
+ *
+ * Please read COPYING and README for further details.
+ */
+
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <queue>
+
+/** Names of objects which can expire, ordered by when they should next be checked.
+ * The time a name is checked at only needs to be no later than when it can first expire,
+ * so times moving forward do not need to update the queue. A name which is checked early
+ * and doesn't expire is added again with its new time.
+ */
+class ExpiryQueue
+{
+	typedef std::pair<time_t, Anope::string> Entry;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > queue;
+	/* When each name is to be checked. Entries in the queue with a different time are old and are skipped */
+	Anope::hash_map<time_t> times;
+
+ public:
+	/** Check a name at the given time, unless it is already to be checked before then
+	 */
+	void Add(const Anope::string &name, time_t when)
+	{
+		std::pair<Anope::hash_map<time_t>::iterator, bool> it = this->times.insert(std::make_pair(name, when));
+		if (!it.second)
+		{
+			if (it.first->second <= when)
+				return;
+			it.first->second = when;
+		}
+
+		this->queue.push(Entry(when, name));
+	}
+
+	/** Take the next name due to be checked by the given time
+	 * @return false if there are none
+	 */
+	bool Next(time_t now, Anope::string &name)
+	{
+		while (!this->queue.empty() && this->queue.top().first <= now)
+		{
+			Entry e = this->queue.top();
+			this->queue.pop();
+
+			Anope::hash_map<time_t>::iterator it = this->times.find(e.second);
+			if (it == this->times.end() || it->second != e.first)
+				continue;
+
+			this->times.erase(it);
+			name = e.second;
+			return true;
+		}
+
+		return false;
+	}
+};
+
+#endif // EXPIRY_H
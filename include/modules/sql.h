@@ -98,6 +98,10 @@ namespace SQL
 	{
 		Anope::string query;
 		std::map<Anope::string, QueryData> parameters;
+		/* If set, this query only needs to stay in order with queries which have the same key,
+		 * such as ones changing the same row. Queries without a key stay in order with everything.
+		 */
+		Anope::string key;
 
 		Query() { }
 		Query(const Anope::string &q) : query(q) { }
@@ -106,6 +110,7 @@ namespace SQL
 		{
 			this->query = q;
 			this->parameters.clear();
+			this->key.clear();
 			return *this;
 		}
 
@@ -119,13 +124,13 @@ namespace SQL
 			return !(*this == other);
 		}
 
-		template<typename T> void SetValue(const Anope::string &key, const T& value, bool escape = true)
+		template<typename T> void SetValue(const Anope::string &param, const T& value, bool escape = true)
 		{
 			try
 			{
 				Anope::string string_value = stringify(value);
-				this->parameters[key].data = string_value;
-				this->parameters[key].escape = escape;
+				this->parameters[param].data = string_value;
+				this->parameters[param].escape = escape;
 			}
 			catch (const ConvertException &ex) { }
 		}
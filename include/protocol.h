@@ -39,6 +39,9 @@ class CoreExport IRCDProto : public Service
 	virtual void SendNumericInternal(int numeric, const Anope::string &dest, const Anope::string &buf);
 
 	const Anope::string &GetProtocolName();
+	/** Parses a line received from the uplink.
+	 * Existing elements of params are overwritten in place so a caller may reuse the same vector for every line.
+	 */
 	virtual bool Parse(const Anope::string &, Anope::map<Anope::string> &, Anope::string &, Anope::string &, std::vector<Anope::string> &);
 	virtual Anope::string Format(const Anope::string &source, const Anope::string &message);
 
@@ -284,18 +287,20 @@ class CoreExport IRCDMessage : public Service
 	bool HasFlag(IRCDMessageFlag f) const { return flags.count(f); }
 };
 
-/** MessageTokenizer allows tokens in the IRC wire format to be read from a string */
+/** MessageTokenizer allows tokens in the IRC wire format to be read from a string.
+ * Tokens are assigned into the caller's strings so that their storage can be reused between calls.
+ */
 class CoreExport MessageTokenizer
 {
 private:
-	/** The message we are parsing tokens from. */
-	Anope::string message;
+	/** The message we are parsing tokens from. This is not copied and must outlive the tokenizer. */
+	const Anope::string &message;
 
 	/** The current position within the message. */
 	Anope::string::size_type position;
 
  public:
-	/** Create a tokenstream and fill it with the provided data. */
+	/** Create a tokenstream reading from the provided data. */
 	MessageTokenizer(const Anope::string &msg);
 
 	/** Retrieve the next \<middle> token in the message.
@@ -53,6 +53,7 @@ class CoreExport ChannelInfo : public Serializable, public Extensible
 	Serialize::Reference<NickCore> successor;                               /* Who gets the channel if the founder nick is dropped or expires */
 	Serialize::Checker<std::vector<ChanAccess *> > access;			/* List of authorized users */
 	Serialize::Checker<std::vector<AutoKick *> > akick;			/* List of users to kickban */
+	unsigned akick_serial;							/* Changed whenever the akick list changes */
 	Anope::map<int16_t> levels;
 
  public:
@@ -197,6 +198,12 @@ class CoreExport ChannelInfo : public Serializable, public Extensible
 	 */
 	void ClearAkick();
 
+	/** Get a number which changes whenever an entry is added to, removed
+	 * from, or updated on the akick list, for modules caching the list
+	 * @return The akick list serial
+	 */
+	unsigned GetAkickSerial() const;
+
 	/** Get the level entries for the channel.
 	 * @return The levels for the channel.
 	 */
@@ -249,4 +256,41 @@ class CoreExport ChannelInfo : public Serializable, public Extensible
  */
 extern CoreExport bool IsFounder(const User *user, const ChannelInfo *ci);
 
+/** Remembers which access entries matched a user on a channel, so that
+ * ChannelInfo::AccessFor does not have to match the user against the whole
+ * access list every time. Cached access is dropped when the access list changes,
+ * or when the nick, ident, host or account of the user changes.
+ */
+class CoreExport AccessCache
+{
+ public:
+	/* Number of lookups which found cached access, and which didn't */
+	static unsigned long Hits, Misses;
+
+	/** Get the number of users cached across all channels
+	 */
+	static size_t Size();
+
+	/** Drop the cached access on a channel. This must be called whenever
+	 * the access list of the channel changes.
+	 * @param ci The channel
+	 */
+	static void Invalidate(const ChannelInfo *ci);
+
+	/** Drop the cached access of a user on every channel. This must be called
+	 * whenever anything ChanAccess::Matches checks about the user changes.
+	 * @param u The user
+	 */
+	static void Invalidate(const User *u);
+
+	/** Drop the cached access of every user identified to an account
+	 * @param nc The account
+	 */
+	static void Invalidate(const NickCore *nc);
+
+	/** Drop all cached access
+	 */
+	static void Clear();
+};
+
 #endif // REGCHANNEL_H
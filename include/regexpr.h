@@ -39,7 +39,37 @@ class CoreExport RegexProvider : public Service
 {
  public:
 	RegexProvider(Module *o, const Anope::string &n) : Service(o, "Regex", n) { }
+	virtual ~RegexProvider();
 	virtual Regex *Compile(const Anope::string &) = 0;
 };
 
+/** Keeps the most recently used regexes compiled with the configured regex engine,
+ * so that Anope::Match can alternate between several regex masks without
+ * recompiling them each time. The cache is emptied when the regexengine
+ * setting changes or the provider goes away.
+ */
+class CoreExport RegexCache
+{
+ public:
+	/* The most regexes that are kept */
+	static const size_t MaxSize = 128;
+
+	/* Number of lookups which found an already compiled regex, and which didn't */
+	static unsigned long Hits, Misses;
+
+	/** Get a compiled regex, compiling and caching it if needed
+	 * @param expression The expression, without the surrounding //
+	 * @return The regex, or NULL if no regex engine is loaded or the expression is invalid
+	 */
+	static Regex *Get(const Anope::string &expression);
+
+	/** Get the number of regexes cached
+	 */
+	static size_t Size();
+
+	/** Delete every cached regex
+	 */
+	static void Clear();
+};
+
 #endif // REGEXPR_H
@@ -18,10 +18,46 @@
 class CoreExport SocketEngine
 {
 	static const int DefaultSize = 2; // Uplink, mode stacker
+	/* The largest fd kept in SocketsByFD, sockets above it are only in Sockets */
+	static const int MaxTableSize = 1 << 20;
+	/* Sockets indexed by fd */
+	static std::vector<Socket *> SocketsByFD;
  public:
 	/* Map of sockets */
 	static std::map<int, Socket *> Sockets;
 
+	/* Whether the socket engine only reports when a socket becomes ready, so sockets
+	 * with SF_DRAIN must read everything available. Only the epoll engine does this,
+	 * see options:edgetriggered.
+	 */
+	static bool EdgeTriggered;
+
+	/* The most times a draining socket reads before giving the other sockets a turn */
+	static const unsigned DrainReads = 16;
+
+	/** Add a socket to the socket list
+	 * @param s The socket
+	 */
+	static void AddSocket(Socket *s);
+
+	/** Remove a socket from the socket list
+	 * @param s The socket
+	 */
+	static void DelSocket(Socket *s);
+
+	/** Find a socket by its fd
+	 * @param fd The fd
+	 * @return The socket, or NULL
+	 */
+	static inline Socket *FindSocket(int fd)
+	{
+		if (fd >= 0 && static_cast<size_t>(fd) < SocketsByFD.size())
+			return SocketsByFD[fd];
+
+		std::map<int, Socket *>::const_iterator it = Sockets.find(fd);
+		return it != Sockets.end() ? it->second : NULL;
+	}
+
 	/** Called to initialize the socket engine
 	 */
 	static void Init();
@@ -138,6 +138,10 @@ enum SocketFlag
 	SF_CONNECTED,
 	SF_ACCEPTING,
 	SF_ACCEPTED,
+	/* ProcessRead reads until the socket would block if the socket engine is edge triggered */
+	SF_DRAIN,
+	/* ProcessRead stopped before the socket would block, and has to be called again */
+	SF_READ_AGAIN,
 	SF_SIZE
 };
 
@@ -274,13 +278,75 @@ class CoreExport Socket
 	virtual void ProcessError();
 };
 
+/** A contiguous buffer used for socket I/O. Data is appended at the back and
+ * consumed from the front by advancing an offset, so neither extracting lines
+ * nor partial sends have to move or reallocate the data that is still pending.
+ */
+class CoreExport SocketBuffer
+{
+	/* The storage */
+	char *buffer;
+	/* Offset of the first unconsumed byte */
+	size_t head;
+	/* Offset one past the last byte of data */
+	size_t tail;
+	/* Allocated size of buffer */
+	size_t capacity;
+
+	SocketBuffer(const SocketBuffer &);
+	SocketBuffer &operator=(const SocketBuffer &);
+ public:
+	SocketBuffer();
+	~SocketBuffer();
+
+	/** Get the pending data
+	 * @return A pointer to the first unconsumed byte
+	 */
+	inline const char *data() const { return this->buffer + this->head; }
+
+	/** Get the amount of pending data
+	 */
+	inline size_t length() const { return this->tail - this->head; }
+
+	/** Check if there is any pending data
+	 */
+	inline bool empty() const { return this->head == this->tail; }
+
+	/** Get free space at the back of the buffer, so data can be read directly into it.
+	 * This may move the pending data and invalidates any pointer previously returned by data().
+	 * @param sz The amount of space required
+	 * @return A pointer to at least sz bytes of free space
+	 */
+	char *prepare(size_t sz);
+
+	/** Mark data written to the space returned by prepare() as part of the buffer
+	 * @param sz The amount of data written, which must not exceed what was prepared
+	 */
+	void commit(size_t sz);
+
+	/** Append data to the back of the buffer
+	 * @param buf The data
+	 * @param sz The length of the data
+	 */
+	void append(const char *buf, size_t sz);
+
+	/** Remove data from the front of the buffer
+	 * @param sz The amount of data to remove
+	 */
+	void consume(size_t sz);
+
+	/** Remove all data from the buffer and release its memory
+	 */
+	void clear();
+};
+
 class CoreExport BufferedSocket : public virtual Socket
 {
  protected:
 	/* Things read from the socket */
-	Anope::string read_buffer;
+	SocketBuffer read_buffer;
 	/* Things to be written to the socket */
-	Anope::string write_buffer;
+	SocketBuffer write_buffer;
 	/* How much data was received from this socket on this recv() */
 	int recv_len;
 
@@ -325,18 +391,8 @@ class CoreExport BufferedSocket : public virtual Socket
 class CoreExport BinarySocket : public virtual Socket
 {
  protected:
-	struct DataBlock
-	{
-		char *orig;
-		char *buf;
-		size_t len;
-
-		DataBlock(const char *b, size_t l);
-		~DataBlock();
-	};
-
 	/* Data to be written out */
-	std::deque<DataBlock *> write_buffer;
+	SocketBuffer write_buffer;
 
  public:
 	BinarySocket();
@@ -37,6 +37,16 @@ class CoreExport Timer
 	 */
 	bool repeat;
 
+	/** The timers before and after this one in its TimerManager slot
+	 */
+	Timer *wheel_prev, *wheel_next;
+
+	/** The TimerManager slot this timer is in
+	 */
+	unsigned wheel_slot;
+
+	friend class TimerManager;
+
  public:
 	/** Constructor, initializes the triggering time
 	 * @param time_from_now The number of seconds from now to trigger the timer
@@ -101,12 +111,27 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hashed timing wheel: one slot per second, wrapping around
+ * every WheelSize seconds, each slot being a linked list threaded through the
+ * timers themselves. Adding and deleting a timer is constant time, and ticking
+ * only looks at the slots for the seconds which have passed.
  */
 class CoreExport TimerManager
 {
-	/** A list of timers
+	static const unsigned WheelSize = 4096;
+
+	/** The timers, by slot
+	 */
+	static Timer *Wheel[WheelSize];
+
+	/** The last time timers were ticked for
+	 */
+	static time_t WheelTime;
+
+	/** Call the tick of the given slot's timers which are due
 	 */
-	static std::multimap<time_t, Timer *> Timers;
+	static void TickSlot(unsigned slot, time_t ctime);
  public:
 	/** Add a timer to the list
 	 * @param t A Timer derived class to add
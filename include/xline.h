@@ -48,6 +48,34 @@ class CoreExport XLine : public Serializable
 	static Serializable* Unserialize(Serializable *obj, Serialize::Data &data);
 };
 
+/* The part of a user an XLineManager matches its XLines against, used to index them */
+enum XLineIndexField
+{
+	/* XLines can't be indexed and are all checked against every user */
+	XLINE_INDEX_NONE,
+	/* The host of an XLine is matched against the user's host and IP */
+	XLINE_INDEX_HOST,
+	/* The whole mask of an XLine is matched against the user's nick */
+	XLINE_INDEX_NICK,
+	/* The whole mask of an XLine is matched against the user's realname */
+	XLINE_INDEX_REALNAME
+};
+
+/* Statistics about the work done by XLineManager::CheckAllXLines */
+struct XLineCheckStats
+{
+	/* Number of users checked */
+	unsigned long lookups;
+	/* Number of XLines tested against those users */
+	unsigned long checked;
+	/* Total and longest time spent checking a user, in microseconds */
+	uint64_t total_time, max_time;
+
+	XLineCheckStats() : lookups(0), checked(0), total_time(0), max_time(0) { }
+};
+
+class XLineIndex;
+
 /* Managers XLines. There is one XLineManager per type of XLine. */
 class CoreExport XLineManager : public Service
 {
@@ -56,6 +84,13 @@ class CoreExport XLineManager : public Service
 	Serialize::Checker<std::vector<XLine *> > xlines;
 	/* Akills can have the same IDs, sometimes */
 	static Serialize::Checker<std::multimap<Anope::string, XLine *, ci::less> > XLinesByUID;
+	/* Index of the XLines used by CheckAllXLines, built the first time it is needed */
+	XLineIndex *match_index;
+	/* The earliest time an XLine expires, or 0 if none do */
+	time_t next_expire;
+	XLineCheckStats stats;
+
+	void ExpireXLines();
  public:
 	/* List of XLine managers we check users against in XLineManager::CheckAll */
 	static std::list<XLineManager *> XLineManagers;
@@ -114,6 +149,11 @@ class CoreExport XLineManager : public Service
 
 	void RemoveXLine(XLine *);
 
+	/** Update the index of an entry after its mask has changed
+	 * @param x The entry
+	 */
+	void UpdateXLine(XLine *x);
+
 	/** Delete an entry from this XLineManager
 	 * @param x The entry
 	 * @return true if the entry was found and deleted, else false
@@ -152,12 +192,23 @@ class CoreExport XLineManager : public Service
 	 */
 	XLine *CheckAllXLines(User *u);
 
+	/** Get statistics about checking users against this XLineManager
+	 */
+	const XLineCheckStats &GetCheckStats() const;
+
 	/** Check a user against an xline
 	 * @param u The user
 	 * @param x The xline
 	 */
 	virtual bool Check(User *u, const XLine *x) = 0;
 
+	/** Get the part of a user this XLineManager matches XLines against. If this is
+	 * not XLINE_INDEX_NONE, CheckAllXLines only calls Check for the XLines which may
+	 * match the user, so Check must never match a user the field does not match.
+	 * Regex XLines and masks with complex wildcards are always checked.
+	 */
+	virtual XLineIndexField GetIndexField() const;
+
 	/** Called when a user matches a xline in this XLineManager
 	 * @param u The user
 	 * @param x The XLine they match
@@ -27,13 +27,153 @@ struct BadWordImpl : BadWord, Serializable
 	static Serializable* Unserialize(Serializable *obj, Serialize::Data &);
 };
 
+/* Matches text against every badword of a channel in one pass, using the Aho-Corasick algorithm */
+class BadWordMatcher
+{
+	struct Node
+	{
+		/* Child nodes by the next character */
+		std::map<unsigned char, unsigned> next;
+		/* The node for the longest proper suffix of this node which is also in the trie */
+		unsigned fail;
+		/* The nearest node on the fail chain which ends a badword, or 0 for none */
+		unsigned output;
+		/* Indexes of the badwords ending at this node */
+		std::vector<unsigned> ends;
+
+		Node() : fail(0), output(0) { }
+
+		unsigned Next(unsigned char c) const
+		{
+			std::map<unsigned char, unsigned>::const_iterator it = this->next.find(c);
+			return it != this->next.end() ? it->second : 0;
+		}
+	};
+
+	std::vector<Node> nodes;
+	std::vector<const BadWord *> words;
+	bool casesensitive;
+
+	unsigned char Fold(unsigned char c) const
+	{
+		return casesensitive ? c : Anope::tolower(c);
+	}
+
+ public:
+	BadWordMatcher() : casesensitive(false) { }
+
+	bool IsCaseSensitive() const
+	{
+		return casesensitive;
+	}
+
+	void Build(const std::vector<BadWordImpl *> &list, bool cs)
+	{
+		casesensitive = cs;
+		nodes.clear();
+		nodes.push_back(Node());
+		words.assign(list.begin(), list.end());
+
+		for (unsigned i = 0; i < words.size(); ++i)
+		{
+			const Anope::string &word = words[i]->word;
+			if (word.empty())
+				continue;
+
+			unsigned n = 0;
+			for (unsigned j = 0; j < word.length(); ++j)
+			{
+				unsigned char c = Fold(word[j]);
+				unsigned child = nodes[n].Next(c);
+				if (!child)
+				{
+					child = nodes.size();
+					nodes[n].next[c] = child;
+					nodes.push_back(Node());
+				}
+				n = child;
+			}
+			nodes[n].ends.push_back(i);
+		}
+
+		/* Breadth first, so the fail node of each node's parent is already known */
+		std::deque<unsigned> queue;
+		for (std::map<unsigned char, unsigned>::const_iterator it = nodes[0].next.begin(), it_end = nodes[0].next.end(); it != it_end; ++it)
+			queue.push_back(it->second);
+
+		while (!queue.empty())
+		{
+			unsigned n = queue.front();
+			queue.pop_front();
+
+			for (std::map<unsigned char, unsigned>::const_iterator it = nodes[n].next.begin(), it_end = nodes[n].next.end(); it != it_end; ++it)
+			{
+				unsigned child = it->second, f = nodes[n].fail;
+				while (f && !nodes[f].Next(it->first))
+					f = nodes[f].fail;
+
+				Node &c = nodes[child];
+				c.fail = nodes[f].Next(it->first);
+				c.output = nodes[c.fail].ends.empty() ? nodes[c.fail].output : c.fail;
+				queue.push_back(child);
+			}
+		}
+	}
+
+	/** Find the badword matched by text
+	 * @param buf The text
+	 * @return The first badword in the list which matches, or NULL
+	 */
+	const BadWord *Match(const Anope::string &buf) const
+	{
+		Anope::string text;
+		const Anope::string *t = &buf;
+		if (!casesensitive)
+		{
+			text = buf;
+			for (unsigned i = 0; i < text.length(); ++i)
+				text[i] = Anope::tolower(text[i]);
+			t = &text;
+		}
+
+		unsigned best = words.size(), n = 0;
+		for (unsigned i = 0, len = t->length(); i < len && best; ++i)
+		{
+			unsigned char c = (*t)[i];
+			while (n && !nodes[n].Next(c))
+				n = nodes[n].fail;
+			n = nodes[n].Next(c);
+
+			for (unsigned o = nodes[n].ends.empty() ? nodes[n].output : n; o; o = nodes[o].output)
+				for (unsigned j = 0; j < nodes[o].ends.size(); ++j)
+				{
+					unsigned index = nodes[o].ends[j];
+					if (index >= best)
+						continue;
+
+					const BadWord *bw = words[index];
+					size_t start = i + 1 - bw->word.length();
+					bool word_start = !start || (*t)[start - 1] == ' ', word_end = i + 1 == len || (*t)[i + 1] == ' ';
+
+					if (bw->type == BW_ANY || (bw->type == BW_SINGLE && word_start && word_end) || (bw->type == BW_START && word_start) || (bw->type == BW_END && word_end))
+						best = index;
+				}
+		}
+
+		return best < words.size() ? words[best] : NULL;
+	}
+};
+
 struct BadWordsImpl : BadWords
 {
 	Serialize::Reference<ChannelInfo> ci;
 	typedef std::vector<BadWordImpl *> list;
 	Serialize::Checker<list> badwords;
+	/* Compiled from badwords when first needed after they change */
+	BadWordMatcher matcher;
+	bool dirty;
 
-	BadWordsImpl(Extensible *obj) : ci(anope_dynamic_static_cast<ChannelInfo *>(obj)), badwords("BadWord") { }
+	BadWordsImpl(Extensible *obj) : ci(anope_dynamic_static_cast<ChannelInfo *>(obj)), badwords("BadWord"), dirty(true) { }
 
 	~BadWordsImpl();
 
@@ -45,6 +185,7 @@ struct BadWordsImpl : BadWords
 		bw->type = type;
 
 		this->badwords->push_back(bw);
+		this->dirty = true;
 
 		FOREACH_MOD(OnBadWordAdd, (ci, bw));
 
@@ -82,6 +223,17 @@ struct BadWordsImpl : BadWords
 			delete this->badwords->back();
 	}
 
+	const BadWord* MatchBadWord(const Anope::string &buf, bool casesensitive) anope_override
+	{
+		if (this->dirty || this->matcher.IsCaseSensitive() != casesensitive)
+		{
+			this->matcher.Build(*this->badwords, casesensitive);
+			this->dirty = false;
+		}
+
+		return this->matcher.Match(buf);
+	}
+
 	void Check() anope_override
 	{
 		if (this->badwords->empty())
@@ -109,7 +261,10 @@ BadWordImpl::~BadWordImpl()
 		{
 			BadWordsImpl::list::iterator it = std::find(badwords->badwords->begin(), badwords->badwords->end(), this);
 			if (it != badwords->badwords->end())
+			{
 				badwords->badwords->erase(it);
+				badwords->dirty = true;
+			}
 		}
 	}
 }
@@ -140,6 +295,7 @@ Serializable* BadWordImpl::Unserialize(Serializable *obj, Serialize::Data &data)
 	BadWordsImpl *bws = ci->Require<BadWordsImpl>("badwords");
 	if (!obj)
 		bws->badwords->push_back(bw);
+	bws->dirty = true;
 
 	return bw;
 }
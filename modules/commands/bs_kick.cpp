@@ -984,6 +984,81 @@ struct UserData
 	Anope::string lastline;
 };
 
+/* What a message contains, as far as the kickers are concerned */
+struct MessageSummary
+{
+	bool bolds, colors, reverses, italics, underlines;
+	/* Number of upper and lower case letters */
+	int upper, lower;
+	/* The message without control codes, like Anope::NormalizeBuffer */
+	Anope::string stripped;
+
+	/** Summarize a message in a single pass over it
+	 * @param buf The message
+	 * @param strip Whether to build the stripped message
+	 */
+	MessageSummary(const Anope::string &buf, bool strip) : bolds(false), colors(false), reverses(false), italics(false), underlines(false), upper(0), lower(0)
+	{
+		if (strip)
+			stripped.str().reserve(buf.length());
+
+		for (unsigned i = 0, end = buf.length(); i < end; ++i)
+		{
+			unsigned char c = buf[i];
+
+			switch (c)
+			{
+				case 1:
+				case 10:
+				case 13:
+					break;
+				case 2:
+					bolds = true;
+					break;
+				case 3:
+					colors = true;
+
+					/* The foreground and background colors are removed too */
+					if (i + 1 < end && isdigit(buf[i + 1]))
+					{
+						++i;
+
+						if (i + 1 < end && isdigit(buf[i + 1]))
+							++i;
+
+						if (i + 1 < end && buf[i + 1] == ',')
+						{
+							++i;
+
+							if (i + 1 < end && isdigit(buf[i + 1]))
+								++i;
+							if (i + 1 < end && isdigit(buf[i + 1]))
+								++i;
+						}
+					}
+					break;
+				case 22:
+					reverses = true;
+					break;
+				case 29:
+					italics = true;
+					break;
+				case 31:
+					underlines = true;
+					break;
+				default:
+					if (isupper(c))
+						++upper;
+					else if (islower(c))
+						++lower;
+
+					if (strip)
+						stripped += c;
+			}
+		}
+	}
+};
+
 class BanDataPurger : public Timer
 {
  public:
@@ -1259,8 +1334,11 @@ class BSKick : public Module
 		if (realbuf.empty())
 			return;
 
+		/* Scan the message once for everything the kickers look for */
+		MessageSummary summary(realbuf, kd->badwords);
+
 		/* Bolds kicker */
-		if (kd->bolds && realbuf.find(2) != Anope::string::npos)
+		if (kd->bolds && summary.bolds)
 		{
 			check_ban(ci, u, kd, TTB_BOLDS);
 			bot_kick(ci, u, _("Don't use bolds on this channel!"));
@@ -1268,7 +1346,7 @@ class BSKick : public Module
 		}
 
 		/* Color kicker */
-		if (kd->colors && realbuf.find(3) != Anope::string::npos)
+		if (kd->colors && summary.colors)
 		{
 			check_ban(ci, u, kd, TTB_COLORS);
 			bot_kick(ci, u, _("Don't use colors on this channel!"));
@@ -1276,7 +1354,7 @@ class BSKick : public Module
 		}
 
 		/* Reverses kicker */
-		if (kd->reverses && realbuf.find(22) != Anope::string::npos)
+		if (kd->reverses && summary.reverses)
 		{
 			check_ban(ci, u, kd, TTB_REVERSES);
 			bot_kick(ci, u, _("Don't use reverses on this channel!"));
@@ -1284,7 +1362,7 @@ class BSKick : public Module
 		}
 
 		/* Italics kicker */
-		if (kd->italics && realbuf.find(29) != Anope::string::npos)
+		if (kd->italics && summary.italics)
 		{
 			check_ban(ci, u, kd, TTB_ITALICS);
 			bot_kick(ci, u, _("Don't use italics on this channel!"));
@@ -1292,7 +1370,7 @@ class BSKick : public Module
 		}
 
 		/* Underlines kicker */
-		if (kd->underlines && realbuf.find(31) != Anope::string::npos)
+		if (kd->underlines && summary.underlines)
 		{
 			check_ban(ci, u, kd, TTB_UNDERLINES);
 			bot_kick(ci, u, _("Don't use underlines on this channel!"));
@@ -1302,15 +1380,7 @@ class BSKick : public Module
 		/* Caps kicker */
 		if (kd->caps && realbuf.length() >= static_cast<unsigned>(kd->capsmin))
 		{
-			int i = 0, l = 0;
-
-			for (unsigned j = 0, end = realbuf.length(); j < end; ++j)
-			{
-				if (isupper(realbuf[j]))
-					++i;
-				else if (islower(realbuf[j]))
-					++l;
-			}
+			int i = summary.upper, l = summary.lower;
 
 			/* i counts uppercase chars, l counts lowercase chars. Only
 			 * alphabetic chars (so islower || isupper) qualify for the
@@ -1328,88 +1398,23 @@ class BSKick : public Module
 		/* Bad words kicker */
 		if (kd->badwords)
 		{
-			bool mustkick = false;
 			BadWords *badwords = ci->GetExt<BadWords>("badwords");
 
-			/* Normalize the buffer */
-			Anope::string nbuf = Anope::NormalizeBuffer(realbuf);
+			const Anope::string &nbuf = summary.stripped;
 			bool casesensitive = Config->GetModule("botserv")->Get<bool>("casesensitive");
 
 			/* Normalize can return an empty string if this only conains control codes etc */
-			if (badwords && !nbuf.empty())
-				for (unsigned i = 0; i < badwords->GetBadWordCount(); ++i)
-				{
-					const BadWord *bw = badwords->GetBadWord(i);
-
-					if (bw->word.empty())
-						continue; // Shouldn't happen
-
-					if (bw->word.length() > nbuf.length())
-						continue; // This can't ever match
-
-					if (bw->type == BW_ANY && ((casesensitive && nbuf.find(bw->word) != Anope::string::npos) || (!casesensitive && nbuf.find_ci(bw->word) != Anope::string::npos)))
-						mustkick = true;
-					else if (bw->type == BW_SINGLE)
-					{
-						size_t len = bw->word.length();
-
-						if ((casesensitive && bw->word.equals_cs(nbuf)) || (!casesensitive && bw->word.equals_ci(nbuf)))
-							mustkick = true;
-						else if (nbuf.find(' ') == len && ((casesensitive && bw->word.equals_cs(nbuf.substr(0, len))) || (!casesensitive && bw->word.equals_ci(nbuf.substr(0, len)))))
-							mustkick = true;
-						else
-						{
-							if (len < nbuf.length() && nbuf.rfind(' ') == nbuf.length() - len - 1 && ((casesensitive && nbuf.find(bw->word) == nbuf.length() - len) || (!casesensitive && nbuf.find_ci(bw->word) == nbuf.length() - len)))
-								mustkick = true;
-							else
-							{
-								Anope::string wordbuf = " " + bw->word + " ";
-
-								if ((casesensitive && nbuf.find(wordbuf) != Anope::string::npos) || (!casesensitive && nbuf.find_ci(wordbuf) != Anope::string::npos))
-									mustkick = true;
-							}
-						}
-					}
-					else if (bw->type == BW_START)
-					{
-						size_t len = bw->word.length();
-
-						if ((casesensitive && nbuf.substr(0, len).equals_cs(bw->word)) || (!casesensitive && nbuf.substr(0, len).equals_ci(bw->word)))
-							mustkick = true;
-						else
-						{
-							Anope::string wordbuf = " " + bw->word;
-
-							if ((casesensitive && nbuf.find(wordbuf) != Anope::string::npos) || (!casesensitive && nbuf.find_ci(wordbuf) != Anope::string::npos))
-								mustkick = true;
-						}
-					}
-					else if (bw->type == BW_END)
-					{
-						size_t len = bw->word.length();
-
-						if ((casesensitive && nbuf.substr(nbuf.length() - len).equals_cs(bw->word)) || (!casesensitive && nbuf.substr(nbuf.length() - len).equals_ci(bw->word)))
-							mustkick = true;
-						else
-						{
-							Anope::string wordbuf = bw->word + " ";
-
-							if ((casesensitive && nbuf.find(wordbuf) != Anope::string::npos) || (!casesensitive && nbuf.find_ci(wordbuf) != Anope::string::npos))
-								mustkick = true;
-						}
-					}
-
-					if (mustkick)
-					{
-						check_ban(ci, u, kd, TTB_BADWORDS);
-						if (Config->GetModule(me)->Get<bool>("gentlebadwordreason"))
-							bot_kick(ci, u, _("Watch your language!"));
-						else
-							bot_kick(ci, u, _("Don't use the word \"%s\" on this channel!"), bw->word.c_str());
+			const BadWord *bw = badwords && !nbuf.empty() ? badwords->MatchBadWord(nbuf, casesensitive) : NULL;
+			if (bw)
+			{
+				check_ban(ci, u, kd, TTB_BADWORDS);
+				if (Config->GetModule(me)->Get<bool>("gentlebadwordreason"))
+					bot_kick(ci, u, _("Watch your language!"));
+				else
+					bot_kick(ci, u, _("Don't use the word \"%s\" on this channel!"), bw->word.c_str());
 
-						return;
-					}
-				} /* for */
+				return;
+			}
 		} /* if badwords */
 
 		UserData *ud = GetUserData(u, c);
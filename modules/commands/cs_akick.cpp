@@ -528,56 +528,233 @@ class CommandCSAKick : public Command
 	}
 };
 
-class CSAKick : public Module
+/* The akick list of a channel with the masks parsed, indexed by what they match so only
+ * the akicks which may match a user have to be checked against them
+ */
+class AkickIndex
 {
-	CommandCSAKick commandcsakick;
+	typedef std::vector<unsigned> positions;
+
+	/* The akick list serial of the channel when this was built */
+	unsigned serial;
+	bool built;
+	/* The akicks by their position on the list */
+	std::vector<AutoKick *> akicks;
+	/* The parsed masks of the akicks, or NULL for akicks on accounts or channels */
+	std::vector<Entry *> entries;
+	/* The first akick on each account */
+	TR1NS::unordered_map<const NickCore *, unsigned> accounts;
+	/* Akicks on an exact host or IP */
+	Anope::hash_map<positions> hosts;
+	/* Akicks on CIDR ranges, by address family and prefix length, then network */
+	std::map<std::pair<int, unsigned short>, std::map<Anope::string, positions> > ranges;
+	/* Akicks which have to be checked against everyone, in list order */
+	positions others;
+
+	/* The network part of an address as raw bytes */
+	static Anope::string Network(const sockaddrs &addr, unsigned short len)
+	{
+		const char *ip;
+		unsigned short size;
 
- public:
-	CSAKick(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, VENDOR),
-		commandcsakick(this)
+		switch (addr.family())
+		{
+			case AF_INET:
+				ip = reinterpret_cast<const char *>(&addr.sa4.sin_addr);
+				size = 4;
+				break;
+			case AF_INET6:
+				ip = reinterpret_cast<const char *>(&addr.sa6.sin6_addr);
+				size = 16;
+				break;
+			default:
+				return "";
+		}
+
+		if (len > size * 8)
+			len = size * 8;
+
+		Anope::string network(ip, (len + 7) / 8);
+		if (len % 8)
+			network[network.length() - 1] &= ~0U << (8 - len % 8);
+		return network;
+	}
+
+	void Clear()
 	{
+		for (unsigned i = 0; i < entries.size(); ++i)
+			delete entries[i];
+		akicks.clear();
+		entries.clear();
+		accounts.clear();
+		hosts.clear();
+		ranges.clear();
+		others.clear();
 	}
 
-	EventReturn OnCheckKick(User *u, Channel *c, Anope::string &mask, Anope::string &reason) anope_override
+	void Build(ChannelInfo *ci)
 	{
-		if (!c->ci || c->MatchesList(u, "EXCEPT"))
-			return EVENT_CONTINUE;
+		this->Clear();
 
-		for (unsigned j = 0, end = c->ci->GetAkickCount(); j < end; ++j)
+		for (unsigned i = 0, end = ci->GetAkickCount(); i < end; ++i)
 		{
-			AutoKick *autokick = c->ci->GetAkick(j);
-			bool kick = false;
+			akicks.push_back(ci->GetAkick(i));
+			entries.push_back(NULL);
 
+			const AutoKick *autokick = akicks.back();
 			if (autokick->nc)
-				kick = autokick->nc == u->Account();
+			{
+				accounts.insert(std::make_pair(*autokick->nc, i));
+				continue;
+			}
 			else if (IRCD->IsChannelValid(autokick->mask))
 			{
-				Channel *chan = Channel::Find(autokick->mask);
-				kick = chan != NULL && chan->FindUser(u);
+				others.push_back(i);
+				continue;
 			}
-			else
-				kick = Entry("BAN", autokick->mask).Matches(u);
 
-			if (kick)
+			Entry *e = entries.back() = new Entry("BAN", autokick->mask);
+
+			/* Extbans may match users in other ways, so are always checked */
+			if (IRCD->IsExtbanValid(autokick->mask) || e->host.empty() || e->host.find_first_of("*?") != Anope::string::npos)
 			{
-				Log(LOG_DEBUG_2) << u->nick << " matched akick " << (autokick->nc ? autokick->nc->display : autokick->mask);
-				autokick->last_used = Anope::CurTime;
-				if (!autokick->nc && autokick->mask.find('#') == Anope::string::npos)
-					mask = autokick->mask;
-				reason = autokick->reason;
-				if (reason.empty())
-				{
-					reason = Language::Translate(u, Config->GetModule(this)->Get<const Anope::string>("autokickreason").c_str());
-					reason = reason.replace_all_cs("%n", u->nick)
-							.replace_all_cs("%c", c->name);
-				}
-				if (reason.empty())
-					reason = Language::Translate(u, _("User has been banned from the channel"));
-				return EVENT_STOP;
+				others.push_back(i);
+				continue;
+			}
+
+			hosts[e->host].push_back(i);
+
+			if (e->cidr_len)
+			{
+				sockaddrs addr(e->host);
+				ranges[std::make_pair(e->family, e->cidr_len)][Network(addr, e->cidr_len)].push_back(i);
 			}
 		}
 
-		return EVENT_CONTINUE;
+		this->serial = ci->GetAkickSerial();
+		this->built = true;
+	}
+
+	bool Matches(unsigned i, User *u) const
+	{
+		const AutoKick *autokick = akicks[i];
+
+		if (autokick->nc)
+			return autokick->nc == u->Account();
+		else if (!entries[i])
+		{
+			Channel *chan = Channel::Find(autokick->mask);
+			return chan != NULL && chan->FindUser(u);
+		}
+
+		return entries[i]->Matches(u);
+	}
+
+	/* Check the akicks at the given positions before best, setting best to the first match */
+	void Check(const positions &p, User *u, unsigned &best) const
+	{
+		for (unsigned i = 0; i < p.size() && p[i] < best; ++i)
+			if (this->Matches(p[i], u))
+				best = p[i];
+	}
+
+	void CheckHost(const Anope::string &host, User *u, unsigned &best) const
+	{
+		Anope::hash_map<positions>::const_iterator it = hosts.find(host);
+		if (it != hosts.end())
+			this->Check(it->second, u, best);
+	}
+
+ public:
+	AkickIndex(Extensible *) : serial(0), built(false) { }
+
+	~AkickIndex()
+	{
+		this->Clear();
+	}
+
+	/** Find the first akick on a channel matching a user
+	 * @param ci The channel
+	 * @param u The user
+	 * @return The position of the akick on the list, or -1 if none match
+	 */
+	int Find(ChannelInfo *ci, User *u)
+	{
+		if (!this->built || this->serial != ci->GetAkickSerial())
+			this->Build(ci);
+
+		unsigned best = akicks.size();
+
+		if (u->Account())
+		{
+			TR1NS::unordered_map<const NickCore *, unsigned>::const_iterator it = accounts.find(u->Account());
+			if (it != accounts.end() && this->Matches(it->second, u))
+				best = it->second;
+		}
+
+		/* The same hosts Entry::Matches checks */
+		bool full = u->GetDisplayedHost() == u->host;
+
+		this->CheckHost(u->GetDisplayedHost(), u, best);
+		this->CheckHost(u->GetCloakedHost(), u, best);
+		if (full)
+		{
+			this->CheckHost(u->host, u, best);
+			this->CheckHost(u->ip.addr(), u, best);
+
+			for (std::map<std::pair<int, unsigned short>, std::map<Anope::string, positions> >::const_iterator it = ranges.begin(), it_end = ranges.end(); it != it_end; ++it)
+			{
+				if (it->first.first != u->ip.family())
+					continue;
+
+				std::map<Anope::string, positions>::const_iterator it2 = it->second.find(Network(u->ip, it->first.second));
+				if (it2 != it->second.end())
+					this->Check(it2->second, u, best);
+			}
+		}
+
+		this->Check(others, u, best);
+
+		return best < akicks.size() ? static_cast<int>(best) : -1;
+	}
+};
+
+class CSAKick : public Module
+{
+	CommandCSAKick commandcsakick;
+	ExtensibleItem<AkickIndex> akick_index;
+
+ public:
+	CSAKick(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, VENDOR),
+		commandcsakick(this), akick_index(this, "akickindex")
+	{
+	}
+
+	EventReturn OnCheckKick(User *u, Channel *c, Anope::string &mask, Anope::string &reason) anope_override
+	{
+		if (!c->ci || !c->ci->GetAkickCount() || c->MatchesList(u, "EXCEPT"))
+			return EVENT_CONTINUE;
+
+		int j = akick_index.Require(c->ci)->Find(c->ci, u);
+		if (j < 0)
+			return EVENT_CONTINUE;
+
+		AutoKick *autokick = c->ci->GetAkick(j);
+
+		Log(LOG_DEBUG_2) << u->nick << " matched akick " << (autokick->nc ? autokick->nc->display : autokick->mask);
+		autokick->last_used = Anope::CurTime;
+		if (!autokick->nc && autokick->mask.find('#') == Anope::string::npos)
+			mask = autokick->mask;
+		reason = autokick->reason;
+		if (reason.empty())
+		{
+			reason = Language::Translate(u, Config->GetModule(this)->Get<const Anope::string>("autokickreason").c_str());
+			reason = reason.replace_all_cs("%n", u->nick)
+					.replace_all_cs("%c", c->name);
+		}
+		if (reason.empty())
+			reason = Language::Translate(u, _("User has been banned from the channel"));
+		return EVENT_STOP;
 	}
 };
 
@@ -255,6 +255,7 @@ class CommandNSUngroup : public Command
 			std::vector<NickAlias *>::iterator it = std::find(oldcore->aliases->begin(), oldcore->aliases->end(), na);
 			if (it != oldcore->aliases->end())
 				oldcore->aliases->erase(it);
+			AccessCache::Invalidate(oldcore);
 
 			if (na->nick.equals_ci(oldcore->display))
 				oldcore->SetDisplay(oldcore->aliases->front());
@@ -11,7 +11,334 @@
 
 #include "module.h"
 
+#include <deque>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 static unsigned int HARDMAX = 65536;
+/* How much of a file is searched, and how many lines are looked at, between checks for whether to stop */
+static const size_t SEARCH_CHUNK = 1024 * 1024;
+static const unsigned int SEARCH_LINES = 4096;
+
+/* A log file held in memory for searching */
+class LogView
+{
+	const char *data;
+	size_t len;
+	/* If the file could not be mapped it is read in to here instead */
+	std::string copy;
+
+ public:
+	LogView(const Anope::string &filename) : data(NULL), len(0)
+	{
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+#ifndef _WIN32
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED)
+			{
+				data = static_cast<const char *>(map);
+				len = st.st_size;
+			}
+			else
+#endif
+			{
+				char buffer[BUFSIZE];
+				for (int i; (i = read(fd, buffer, sizeof(buffer))) > 0;)
+					copy.append(buffer, i);
+				data = copy.data();
+				len = copy.length();
+			}
+		}
+
+		close(fd);
+	}
+
+	~LogView()
+	{
+#ifndef _WIN32
+		if (data != NULL && copy.empty())
+			munmap(const_cast<char *>(data), len);
+#endif
+	}
+
+	const char *Data() const { return data; }
+	size_t Length() const { return len; }
+};
+
+/* A search through some log files, which can be run on another thread */
+class LogSearch
+{
+	Anope::string search_string;
+	std::vector<Anope::string> files;
+	unsigned int replies;
+	/* Compiled regex for /regex/ searches, may be NULL */
+	Regex *regex;
+	bool wildcard;
+	/* The thread running the search, if any, which may be asked to stop */
+	const Thread *runner;
+
+	/* A literal piece of text every matching line must contain, and the case folding table for it */
+	Anope::string literal;
+	unsigned char fold[256];
+	size_t skip[256];
+
+	/* Find literal in [begin, end) without regard to case, returns NULL if it isn't there */
+	const char *Find(const char *begin, const char *end) const
+	{
+		const size_t len = literal.length();
+		const unsigned char *lit = reinterpret_cast<const unsigned char *>(literal.c_str());
+
+		for (const unsigned char *p = reinterpret_cast<const unsigned char *>(begin); static_cast<size_t>(reinterpret_cast<const unsigned char *>(end) - p) >= len;)
+		{
+			size_t i = len - 1;
+			while (fold[p[i]] == lit[i])
+			{
+				if (i == 0)
+					return reinterpret_cast<const char *>(p);
+				--i;
+			}
+
+			p += skip[p[len - 1]];
+		}
+
+		return NULL;
+	}
+
+	/* Returns false once too many lines have matched */
+	bool AddMatch(const char *begin, const char *end)
+	{
+		if (++found >= HARDMAX)
+			return false;
+
+		matches.push_back(Anope::string(begin, end));
+		if (matches.size() > replies)
+			matches.pop_front();
+		return true;
+	}
+
+	bool Stopping()
+	{
+		if (runner == NULL || !runner->GetExitState())
+			return false;
+
+		stopped = true;
+		return true;
+	}
+
+	/* Find literal from begin onwards a piece at a time, so a long search can be stopped part way through */
+	const char *FindNext(const char *begin, const char *end)
+	{
+		for (const char *from = begin; from < end;)
+		{
+			if (this->Stopping())
+				return NULL;
+
+			const char *to = static_cast<size_t>(end - from) > SEARCH_CHUNK ? from + SEARCH_CHUNK : end;
+			/* Matches starting before to are found in this piece */
+			const char *piece_end = static_cast<size_t>(end - to) > literal.length() - 1 ? to + literal.length() - 1 : end;
+			const char *hit = Find(from, piece_end);
+			if (hit != NULL)
+				return hit;
+			from = to;
+		}
+
+		return NULL;
+	}
+
+	bool SearchFile(const LogView &view)
+	{
+		const char *data = view.Data(), *data_end = data + view.Length();
+		unsigned int lines = 0;
+
+		for (const char *line = data; line < data_end;)
+		{
+			if (++lines % SEARCH_LINES == 0 && this->Stopping())
+				return false;
+
+			/* Skip ahead to the next line that can match */
+			if (!literal.empty())
+			{
+				const char *hit = FindNext(line, data_end);
+				if (hit == NULL)
+					return !stopped;
+				while (hit > line && hit[-1] != '\n')
+					--hit;
+				line = hit;
+			}
+
+			const char *line_end = static_cast<const char *>(memchr(line, '\n', data_end - line));
+			if (line_end == NULL)
+				line_end = data_end;
+
+			bool match = true;
+			if (regex != NULL || wildcard)
+			{
+				Anope::string buf(line, line_end);
+				if (regex != NULL)
+					match = regex->Matches(buf) || Anope::Match(buf, search_string);
+				else
+					match = Anope::Match(buf, "*" + search_string + "*");
+			}
+
+			if (match && !AddMatch(line, line_end))
+				return false;
+
+			line = line_end + 1;
+		}
+
+		return true;
+	}
+
+ public:
+	/* Results, the most recent matches and how many there were in total */
+	std::deque<Anope::string> matches;
+	unsigned int found;
+	/* Whether the search was stopped before it finished */
+	bool stopped;
+
+	LogSearch(const Anope::string &search, const std::vector<Anope::string> &f, unsigned int r, Regex *re) : search_string(search), files(f), replies(r), regex(re), runner(NULL), found(0), stopped(false)
+	{
+		wildcard = search_string.find_first_of("?*") != Anope::string::npos;
+
+		/* Plain searches look for the whole string, wildcards for the longest piece without a wildcard in it */
+		if (regex == NULL)
+		{
+			sepstream sep(search_string, '*');
+			for (Anope::string token; sep.GetToken(token);)
+			{
+				sepstream qsep(token, '?');
+				for (Anope::string piece; qsep.GetToken(piece);)
+					if (piece.length() > literal.length())
+						literal = piece;
+			}
+		}
+
+		for (unsigned i = 0; i < 256; ++i)
+			fold[i] = Anope::tolower(i);
+		for (unsigned i = 0; i < literal.length(); ++i)
+			literal[i] = fold[static_cast<unsigned char>(literal[i])];
+
+		/* Horspool's bad character table, indexed by either case of each character */
+		for (unsigned i = 0; i < 256; ++i)
+			skip[i] = literal.length();
+		for (unsigned i = 0; i + 1 < literal.length(); ++i)
+			for (unsigned j = 0; j < 256; ++j)
+				if (fold[j] == static_cast<unsigned char>(literal[i]))
+					skip[j] = literal.length() - 1 - i;
+	}
+
+	~LogSearch()
+	{
+		delete regex;
+	}
+
+	/** Search the files
+	 * @param t The thread running the search, which is given up if it is asked to exit
+	 */
+	void Search(const Thread *t = NULL)
+	{
+		runner = t;
+
+		for (unsigned i = 0; i < files.size(); ++i)
+		{
+			if (this->Stopping())
+				break;
+
+			LogView view(files[i]);
+			if (!SearchFile(view))
+				break;
+		}
+	}
+
+	void SendResults(CommandSource &source) const
+	{
+		if (stopped)
+		{
+			source.Reply(_("The search for \002%s\002 was stopped before it finished."), search_string.c_str());
+			return;
+		}
+
+		if (!found)
+		{
+			source.Reply(_("No matches for \002%s\002 found."), search_string.c_str());
+			return;
+		}
+
+		if (found >= HARDMAX)
+		{
+			source.Reply(_("Too many results for \002%s\002."), search_string.c_str());
+			return;
+		}
+
+		source.Reply(_("Matches for \002%s\002:"), search_string.c_str());
+		unsigned int count = 0;
+		for (std::deque<Anope::string>::const_iterator it = matches.begin(), it_end = matches.end(); it != it_end; ++it)
+			source.Reply("#%d: %s", ++count, it->c_str());
+		source.Reply(_("Showed %d/%d matches for \002%s\002."), static_cast<int>(matches.size()), found, search_string.c_str());
+	}
+};
+
+/* Runs a search for a user off of the main thread, the results come back through our pipe */
+class LogSearchThread : public Thread
+{
+ public:
+	static std::set<LogSearchThread *> Searches;
+
+	/* Who the results are for, they may have gone by the time the search finishes */
+	Reference<User> user;
+	Reference<BotInfo> service;
+	LogSearch search;
+
+	LogSearchThread(User *u, BotInfo *bi, const Anope::string &search_string, const std::vector<Anope::string> &files, unsigned int replies, Regex *re) : user(u), service(bi), search(search_string, files, replies, re)
+	{
+		Searches.insert(this);
+	}
+
+	~LogSearchThread()
+	{
+		Searches.erase(this);
+	}
+
+	void Run() anope_override
+	{
+		search.Search(this);
+	}
+
+	/* Send the results, once the thread has been joined */
+	void Finish()
+	{
+		if (!user)
+			return;
+
+		CommandSource source(user->nick, user, user->Account(), user, service);
+		search.SendResults(source);
+	}
+
+	void OnNotify() anope_override
+	{
+		Thread::OnNotify();
+		this->Finish();
+	}
+
+	static bool IsSearching(User *u)
+	{
+		for (std::set<LogSearchThread *>::iterator it = Searches.begin(); it != Searches.end(); ++it)
+			if (*(*it)->user == u)
+				return true;
+		return false;
+	}
+};
+std::set<LogSearchThread *> LogSearchThread::Searches;
 
 class CommandOSLogSearch : public Command
 {
@@ -91,65 +418,56 @@ class CommandOSLogSearch : public Command
 
 		Log(LOG_ADMIN, source, this) << "for " << search_string;
 
-		bool wildcard = search_string.find_first_of("?*") != Anope::string::npos;
-		bool regex = search_string.empty() == false && search_string[0] == '/' && search_string[search_string.length() - 1] == '/';
-
-		const Anope::string &logfile_name = Config->GetModule(this->owner)->Get<const Anope::string>("logname");
-		std::vector<Anope::string> matches;
-		for (int d = days - 1; d >= 0; --d)
+		Regex *regex = NULL;
+		if (search_string.length() > 2 && search_string[0] == '/' && search_string[search_string.length() - 1] == '/')
 		{
-			Anope::string lf_name = CreateLogName(logfile_name, Anope::CurTime - (d * 86400));
-			Log(LOG_DEBUG) << "Searching " << lf_name;
-			std::fstream fd(lf_name.c_str(), std::ios_base::in);
-			if (!fd.is_open())
-				continue;
-
-			for (Anope::string buf, token; std::getline(fd, buf.str());)
+			ServiceReference<RegexProvider> provider("Regex", Config->GetBlock("options")->Get<const Anope::string>("regexengine"));
+			if (provider)
 			{
-				bool match = false;
-
-				if (regex)
-					match = Anope::Match(buf, search_string, false, true);
-				else if (wildcard)
-					match = Anope::Match(buf, "*" + search_string + "*");
-				else
-					match = buf.find_ci(search_string) != Anope::string::npos;
-
-				if (match)
+				try
 				{
-					matches.push_back(buf);
-
-					if (matches.size() >= HARDMAX)
-						break;
+					regex = provider->Compile(search_string.substr(1, search_string.length() - 2));
 				}
+				catch (const RegexException &) { }
 			}
-
-			fd.close();
 		}
 
-		unsigned int found = matches.size();
-		if (!found)
+		const Anope::string &logfile_name = Config->GetModule(this->owner)->Get<const Anope::string>("logname");
+		std::vector<Anope::string> files;
+		for (int d = days - 1; d >= 0; --d)
 		{
-			source.Reply(_("No matches for \002%s\002 found."), search_string.c_str());
-			return;
+			Anope::string lf_name = CreateLogName(logfile_name, Anope::CurTime - (d * 86400));
+			Log(LOG_DEBUG) << "Searching " << lf_name;
+			files.push_back(lf_name);
 		}
 
-		if (matches.size() >= HARDMAX)
+		/* Replies to users can be sent later, anything else wants them now */
+		User *u = source.GetUser();
+		if (u != NULL && source.reply == u)
 		{
-			source.Reply(_("Too many results for \002%s\002."), search_string.c_str());
-			return;
-		}
+			if (LogSearchThread::IsSearching(u))
+			{
+				delete regex;
+				source.Reply(_("You already have a log search in progress."));
+				return;
+			}
 
-		if (matches.size() > static_cast<unsigned int>(replies))
-		{
-			matches.erase(matches.begin(), matches.begin() + (matches.size() - static_cast<unsigned int>(replies)));
+			LogSearchThread *t = new LogSearchThread(u, source.service, search_string, files, replies, regex);
+			try
+			{
+				t->Start();
+			}
+			catch (const CoreException &)
+			{
+				delete t;
+				source.Reply(_("Unable to search the logs, please try again later."));
+			}
+			return;
 		}
 
-		source.Reply(_("Matches for \002%s\002:"), search_string.c_str());
-		unsigned int count = 0;
-		for (std::vector<Anope::string>::iterator it = matches.begin(), it_end = matches.end(); it != it_end; ++it)
-			source.Reply("#%d: %s", ++count, it->c_str());
-		source.Reply(_("Showed %d/%d matches for \002%s\002."), matches.size(), found, search_string.c_str());
+		LogSearch search(search_string, files, replies, regex);
+		search.Search();
+		search.SendResults(source);
 	}
 
 	bool OnHelp(CommandSource &source, const Anope::string &subcommand) anope_override
@@ -180,6 +498,28 @@ class OSLogSearch : public Module
 		commandoslogsearch(this)
 	{
 	}
+
+	~OSLogSearch()
+	{
+		while (!LogSearchThread::Searches.empty())
+		{
+			LogSearchThread *t = *LogSearchThread::Searches.begin();
+			t->Join();
+			delete t;
+		}
+	}
+
+	void OnModuleUnload(User *, Module *) anope_override
+	{
+		/* Searches may be using a regex engine, so let them finish before any module goes away */
+		while (!LogSearchThread::Searches.empty())
+		{
+			LogSearchThread *t = *LogSearchThread::Searches.begin();
+			t->Join();
+			t->Finish();
+			delete t;
+		}
+	}
 };
 
 MODULE_INIT(OSLogSearch)
@@ -60,6 +60,16 @@ class CommandOSStats : public Command
 {
 	ServiceReference<XLineManager> akills, snlines, sqlines;
  private:
+	void DoCheckStats(CommandSource &source, const char *listname, XLineManager *xlm)
+	{
+		const XLineCheckStats &stats = xlm->GetCheckStats();
+		if (!stats.lookups)
+			return;
+
+		source.Reply(_("%s checks: \002%lu\002 users, average of \002%lu\002 entries and \002%lu\002 microseconds per user, longest \002%lu\002 microseconds"),
+			listname, stats.lookups, stats.checked / stats.lookups, static_cast<unsigned long>(stats.total_time / stats.lookups), static_cast<unsigned long>(stats.max_time));
+	}
+
 	void DoStatsAkill(CommandSource &source)
 	{
 		int timeout;
@@ -67,6 +77,7 @@ class CommandOSStats : public Command
 		{
 			/* AKILLs */
 			source.Reply(_("Current number of AKILLs: \002%d\002"), akills->GetCount());
+			this->DoCheckStats(source, "AKILL", akills);
 			timeout = Config->GetModule("operserv")->Get<time_t>("autokillexpiry", "30d") + 59;
 			if (timeout >= 172800)
 				source.Reply(_("Default AKILL expiry time: \002%d days\002"), timeout / 86400);
@@ -87,6 +98,7 @@ class CommandOSStats : public Command
 		{
 			/* SNLINEs */
 			source.Reply(_("Current number of SNLINEs: \002%d\002"), snlines->GetCount());
+			this->DoCheckStats(source, "SNLINE", snlines);
 			timeout = Config->GetModule("operserv")->Get<time_t>("snlineexpiry", "30d") + 59;
 			if (timeout >= 172800)
 				source.Reply(_("Default SNLINE expiry time: \002%d days\002"), timeout / 86400);
@@ -107,6 +119,7 @@ class CommandOSStats : public Command
 		{
 			/* SQLINEs */
 			source.Reply(_("Current number of SQLINEs: \002%d\002"), sqlines->GetCount());
+			this->DoCheckStats(source, "SQLINE", sqlines);
 			timeout = Config->GetModule("operserv")->Get<time_t>("sglineexpiry", "30d") + 59;
 			if (timeout >= 172800)
 				source.Reply(_("Default SQLINE expiry time: \002%d days\002"), timeout / 86400);
@@ -153,9 +166,34 @@ class CommandOSStats : public Command
 		source.Reply(_("Uplink server: %s"), Me->GetLinks().front()->GetName().c_str());
 		source.Reply(_("Uplink capab: %s"), buf.c_str());
 		source.Reply(_("Servers found: %d"), stats_count_servers(Me->GetLinks().front()));
+
+		const BurstJoinStats &bstats = Channel::BurstStats;
+		if (bstats.bursts)
+			source.Reply(_("Burst joins: %lu joins to %lu channels checked after %lu bursts, taking %lu ms (longest %lu ms)"), bstats.joins, bstats.channels, bstats.bursts,
+				static_cast<unsigned long>(bstats.total_time / 1000), static_cast<unsigned long>(bstats.max_time / 1000));
+
+		const ModeStackerStats &mstats = ModeManager::StackerStats;
+		if (mstats.changes)
+			source.Reply(_("Mode stacker: %lu mode changes, %lu replaced or undone, sent in %lu lines (%lu lines saved)"), mstats.changes, mstats.coalesced, mstats.lines,
+				mstats.changes > mstats.lines ? mstats.changes - mstats.lines : 0);
+
+		const LogWriterStats &lstats = LogWriter::Stats;
+		if (lstats.lines || lstats.dropped)
+			source.Reply(_("Log writer: %lu lines in %lu writes, %lu dropped, %lu waits for a full queue"), lstats.lines, lstats.writes, lstats.dropped, lstats.waits);
 		return;
 	}
 
+	void DoStatsCache(CommandSource &source)
+	{
+		unsigned long lookups = RegexCache::Hits + RegexCache::Misses;
+		source.Reply(_("Regex cache: %lu entries, %lu hits, %lu misses (%lu%% hit rate)"), static_cast<unsigned long>(RegexCache::Size()),
+			RegexCache::Hits, RegexCache::Misses, lookups ? RegexCache::Hits * 100 / lookups : 0);
+
+		lookups = AccessCache::Hits + AccessCache::Misses;
+		source.Reply(_("Channel access cache: %lu entries, %lu hits, %lu misses (%lu%% hit rate)"), static_cast<unsigned long>(AccessCache::Size()),
+			AccessCache::Hits, AccessCache::Misses, lookups ? AccessCache::Hits * 100 / lookups : 0);
+	}
+
 	template<typename T> void GetHashStats(const T& map, size_t& entries, size_t& buckets, size_t& max_chain)
 	{
 		entries = map.size(), buckets = map.bucket_count(), max_chain = 0;
@@ -201,7 +239,7 @@ class CommandOSStats : public Command
 		akills("XLineManager", "xlinemanager/sgline"), snlines("XLineManager", "xlinemanager/snline"), sqlines("XLineManager", "xlinemanager/sqline")
 	{
 		this->SetDesc(_("Show status of Services and network"));
-		this->SetSyntax("[AKILL | HASH | UPLINK | UPTIME | ALL | RESET]");
+		this->SetSyntax("[AKILL | CACHE | HASH | UPLINK | UPTIME | ALL | RESET]");
 	}
 
 	void Execute(CommandSource &source, const std::vector<Anope::string> &params) anope_override
@@ -216,6 +254,9 @@ class CommandOSStats : public Command
 		if (extra.equals_ci("ALL") || extra.equals_ci("AKILL"))
 			this->DoStatsAkill(source);
 
+		if (extra.equals_ci("ALL") || extra.equals_ci("CACHE"))
+			this->DoStatsCache(source);
+
 		if (extra.equals_ci("ALL") || extra.equals_ci("HASH"))
 			this->DoStatsHash(source);
 
@@ -225,7 +266,7 @@ class CommandOSStats : public Command
 		if (extra.empty() || extra.equals_ci("ALL") || extra.equals_ci("UPTIME"))
 			this->DoStatsUptime(source);
 
-		if (!extra.empty() && !extra.equals_ci("ALL") && !extra.equals_ci("AKILL") && !extra.equals_ci("HASH") && !extra.equals_ci("UPLINK") && !extra.equals_ci("UPTIME"))
+		if (!extra.empty() && !extra.equals_ci("ALL") && !extra.equals_ci("AKILL") && !extra.equals_ci("CACHE") && !extra.equals_ci("HASH") && !extra.equals_ci("UPLINK") && !extra.equals_ci("UPTIME"))
 			source.Reply(_("Unknown STATS option: \002%s\002"), extra.c_str());
 	}
 
@@ -238,7 +279,8 @@ class CommandOSStats : public Command
 				"started, and the length of time Services has been running.\n"
 				" \n"
 				"With the \002AKILL\002 option, displays the current size of the\n"
-				"AKILL list and the current default expiry time.\n"
+				"AKILL list and the current default expiry time, along with\n"
+				"how much work checking connecting users against each list takes.\n"
 				" \n"
 				"The \002RESET\002 option currently resets the maximum user count\n"
 				"to the number of users currently present on the network.\n"
@@ -246,6 +288,9 @@ class CommandOSStats : public Command
 				"The \002UPLINK\002 option displays information about the current\n"
 				"server Anope uses as an uplink to the network.\n"
 				" \n"
+				"The \002CACHE\002 option displays how well the caches used to\n"
+				"speed up matching are performing.\n"
+				" \n"
 				"The \002HASH\002 option displays information about the hash maps.\n"
 				" \n"
 				"The \002ALL\002 option displays all of the above statistics."));
@@ -35,44 +35,78 @@ class SaveData : public Serialize::Data
 	}
 };
 
+/* Collects an object's data, to tell whether it has changed since it was last saved */
+class HashData : public Serialize::Data
+{
+ public:
+	Anope::string last;
+	std::stringstream ss;
+
+	std::iostream& operator[](const Anope::string &key) anope_override
+	{
+		if (key != last)
+		{
+			ss << "\n" << key << " ";
+			last = key;
+		}
+
+		return ss;
+	}
+
+	size_t Hash() const anope_override
+	{
+		return Anope::hash_cs()(ss.str());
+	}
+};
+
 class LoadData : public Serialize::Data
 {
  public:
 	std::fstream *fs;
-	unsigned int id;
+	uint64_t id;
 	std::map<Anope::string, Anope::string> data;
 	std::stringstream ss;
 	bool read;
+	/* Whether the object was terminated by END, it may not be if the journal was cut short */
+	bool ended;
 
-	LoadData() : fs(NULL), id(0), read(false) { }
+	LoadData() : fs(NULL), id(0), read(false), ended(false) { }
 
-	std::iostream& operator[](const Anope::string &key) anope_override
+	void Read()
 	{
-		if (!read)
+		if (read)
+			return;
+
+		for (Anope::string token; std::getline(*this->fs, token.str());)
 		{
-			for (Anope::string token; std::getline(*this->fs, token.str());)
+			if (token.find("ID ") == 0)
 			{
-				if (token.find("ID ") == 0)
+				try
 				{
-					try
-					{
-						this->id = convertTo<unsigned int>(token.substr(3));
-					}
-					catch (const ConvertException &) { }
-
-					continue;
+					this->id = convertTo<uint64_t>(token.substr(3));
 				}
-				else if (token.find("DATA ") != 0)
-					break;
+				catch (const ConvertException &) { }
 
-				size_t sp = token.find(' ', 5); // Skip DATA
-				if (sp != Anope::string::npos)
-					data[token.substr(5, sp - 5)] = token.substr(sp + 1);
+				continue;
+			}
+			else if (token.find("DATA ") != 0)
+			{
+				ended = token == "END";
+				break;
 			}
 
-			read = true;
+			size_t sp = token.find(' ', 5); // Skip DATA
+			if (sp != Anope::string::npos)
+				data[token.substr(5, sp - 5)] = token.substr(sp + 1);
 		}
 
+		read = true;
+	}
+
+	std::iostream& operator[](const Anope::string &key) anope_override
+	{
+		this->Read();
+
 		ss.clear();
 		this->ss << this->data[key];
 		return this->ss;
@@ -98,7 +132,7 @@ class LoadData : public Serialize::Data
 	void Reset()
 	{
 		id = 0;
-		read = false;
+		read = ended = false;
 		data.clear();
 	}
 };
@@ -113,6 +147,245 @@ class DBFlatFile : public Module, public Pipe
 
 	int child_pid;
 
+	/* Whether changes are appended to a journal in between full saves */
+	bool journal;
+	/* How often the journal is compacted into a full save */
+	time_t compact_interval;
+	/* When the databases were last fully saved */
+	time_t last_compact;
+	/* Set when objects may be missing from the journal or have no id, so the next save must be a full save */
+	bool need_compact;
+	/* Set while objects are being loaded, so they are not journaled */
+	bool loading;
+	/* Set while looking for changed objects. Serializing an object can queue updates for the objects it refers to */
+	bool finding;
+	/* The module being unloaded. Its objects are destroyed but are still in its database.
+	 * Only valid until the unload is done, which is before the next module is loaded or the next save
+	 */
+	Module *unloading;
+	/* Objects created or updated since the journal was last written */
+	std::set<Serializable *> dirty;
+	/* Type and id of objects deleted since the journal was last written */
+	std::vector<std::pair<Anope::string, uint64_t> > deleted;
+	/* The highest id given to an object of each type */
+	std::map<Anope::string, uint64_t> last_ids;
+	/* Loaded objects by type and id, used while replaying the journal */
+	std::map<Anope::string, std::map<uint64_t, Serializable *> > objects;
+
+	Anope::string GetDatabaseName()
+	{
+		return Anope::DataDir + "/" + Config->GetModule(this)->Get<const Anope::string>("database", "anope.db");
+	}
+
+	void AddLoaded(Serializable *obj, uint64_t id)
+	{
+		if (!id)
+		{
+			need_compact = true;
+			return;
+		}
+
+		const Anope::string &type_name = obj->GetSerializableType()->GetName();
+
+		obj->id = id;
+		objects[type_name][id] = obj;
+
+		uint64_t &last = last_ids[type_name];
+		if (id > last)
+			last = id;
+	}
+
+	/* Give an object an id so the journal can refer to it, returns false if it can't have one yet */
+	bool AssignId(Serializable *obj)
+	{
+		const Anope::string &type_name = obj->GetSerializableType()->GetName();
+		uint64_t &last = last_ids[type_name];
+
+		if (!obj->id)
+		{
+			/* Accounts have their own unique ids, which NickCore keeps separately */
+			if (type_name == "NickCore")
+				obj->id = anope_dynamic_static_cast<NickCore *>(obj)->GetId();
+			else
+				obj->id = last + 1;
+		}
+
+		if (obj->id > last)
+			last = obj->id;
+
+		return obj->id != 0;
+	}
+
+	/* Remember what an object looks like now, returns true if that is different from when it was last saved */
+	static bool Commit(Serializable *obj)
+	{
+		HashData data;
+		obj->Serialize(data);
+
+		if (obj->IsCached(data))
+			return false;
+
+		obj->UpdateCache(data);
+		return true;
+	}
+
+	/* Many changes are made directly to objects without queueing an update, so look
+	 * for anything which is different from when it was last saved
+	 */
+	void FindChanged()
+	{
+		finding = true;
+		const std::list<Serializable *> &items = Serializable::GetItems();
+		for (std::list<Serializable *>::const_iterator it = items.begin(), it_end = items.end(); it != it_end; ++it)
+			if ((*it)->GetSerializableType() && Commit(*it))
+				dirty.insert(*it);
+		finding = false;
+	}
+
+	/* Append the objects changed and deleted since the last call to the journal */
+	void WriteJournal()
+	{
+		if (dirty.empty() && deleted.empty())
+			return;
+
+		const Anope::string &journal_name = this->GetDatabaseName() + ".journal";
+		std::fstream fs(journal_name.c_str(), std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+		if (!fs.is_open())
+		{
+			Log(this) << "Unable to open " << journal_name << " for writing";
+			return;
+		}
+
+		/* Deletions go first, so a deleted object is gone before a new one with the same name is created */
+		for (unsigned i = 0; i < deleted.size(); ++i)
+			fs << "DELETE " << deleted[i].first << " " << deleted[i].second << "\n";
+		deleted.clear();
+
+		std::map<Anope::string, std::vector<Serializable *> > by_type;
+		std::set<Serializable *> changed;
+		changed.swap(dirty);
+		for (std::set<Serializable *>::iterator it = changed.begin(), it_end = changed.end(); it != it_end; ++it)
+			if ((*it)->GetSerializableType())
+				by_type[(*it)->GetSerializableType()->GetName()].push_back(*it);
+
+		/* Write objects in type order, like full saves, so objects referred to are created first when replaying */
+		const std::vector<Anope::string> &type_order = Serialize::Type::GetTypeOrder();
+		SaveData data;
+		data.fs = &fs;
+		for (unsigned i = 0; i < type_order.size(); ++i)
+		{
+			const std::vector<Serializable *> &objs = by_type[type_order[i]];
+
+			for (unsigned j = 0; j < objs.size(); ++j)
+			{
+				Serializable *obj = objs[j];
+
+				if (!this->AssignId(obj))
+				{
+					dirty.insert(obj);
+					continue;
+				}
+
+				fs << "OBJECT " << type_order[i] << "\nID " << obj->id;
+				data.last.clear();
+				obj->Serialize(data);
+				fs << "\nEND\n";
+			}
+		}
+
+		fs.close();
+		if (!fs.good())
+			Log(this) << "Error writing to " << journal_name;
+	}
+
+	/* Move the journal aside before a full save. It is removed when the save succeeds */
+	void RotateJournal()
+	{
+		const Anope::string &journal_name = this->GetDatabaseName() + ".journal", &old_name = journal_name + ".old";
+
+		if (!Anope::IsFile(journal_name))
+			return;
+
+		if (!Anope::IsFile(old_name))
+		{
+			rename(journal_name.c_str(), old_name.c_str());
+			return;
+		}
+
+		/* The last full save failed, so keep everything since the one before it */
+		std::ifstream in(journal_name.c_str(), std::ios_base::in | std::ios_base::binary);
+		std::ofstream out(old_name.c_str(), std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+		out << in.rdbuf();
+		in.close();
+		out.close();
+
+		if (out.good())
+			unlink(journal_name.c_str());
+		else
+			Log(this) << "Unable to append " << journal_name << " to " << old_name;
+	}
+
+	/* Apply a journal to the loaded objects
+	 * @param journal_name The journal file
+	 * @param only If set, only replay objects of this type, else replay objects of all core types
+	 */
+	void ReplayJournal(const Anope::string &journal_name, Serialize::Type *only)
+	{
+		std::fstream fd(journal_name.c_str(), std::ios_base::in | std::ios_base::binary);
+		if (!fd.is_open())
+			return;
+
+		LoadData ld;
+		ld.fs = &fd;
+
+		unsigned replayed = 0;
+		for (Anope::string buf; std::getline(fd, buf.str());)
+		{
+			if (buf.find("DELETE ") == 0)
+			{
+				spacesepstream sep(buf.substr(7));
+				Anope::string type_name, sid;
+				sep.GetToken(type_name);
+				sep.GetToken(sid);
+
+				Serialize::Type *stype = Serialize::Type::Find(type_name);
+				if (!stype || (only ? stype != only : stype->GetOwner() != NULL))
+					continue;
+
+				try
+				{
+					std::map<uint64_t, Serializable *>::iterator it = objects[type_name].find(convertTo<uint64_t>(sid));
+					if (it != objects[type_name].end())
+						delete it->second;
+					++replayed;
+				}
+				catch (const ConvertException &) { }
+			}
+			else if (buf.find("OBJECT ") == 0)
+			{
+				Serialize::Type *stype = Serialize::Type::Find(buf.substr(7));
+
+				ld.Reset();
+				ld.Read();
+
+				/* The last object may have been cut short */
+				if (!ld.ended || !ld.id || !stype || (only ? stype != only : stype->GetOwner() != NULL))
+					continue;
+
+				std::map<uint64_t, Serializable *>::iterator it = objects[stype->GetName()].find(ld.id);
+				Serializable *obj = stype->Unserialize(it != objects[stype->GetName()].end() ? it->second : NULL, ld);
+				if (obj != NULL)
+					this->AddLoaded(obj, ld.id);
+				++replayed;
+			}
+		}
+
+		fd.close();
+
+		if (replayed)
+			Log(LOG_DEBUG) << "db_flatfile: Replayed " << replayed << " changes from " << journal_name;
+	}
+
 	void BackupDatabase()
 	{
 		tm *tm = localtime(&Anope::CurTime);
@@ -172,9 +445,28 @@ class DBFlatFile : public Module, public Pipe
 	}
 
  public:
-	DBFlatFile(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, DATABASE | VENDOR), last_day(0), loaded(false), child_pid(-1)
+	DBFlatFile(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, DATABASE | VENDOR), last_day(0), loaded(false), child_pid(-1),
+		journal(false), compact_interval(0), last_compact(0), need_compact(false), loading(false), finding(false), unloading(NULL)
+	{
+
+	}
+
+	void OnReload(Configuration::Conf *conf) anope_override
 	{
+		Configuration::Block *block = conf->GetModule(this);
 
+		bool use_journal = block->Get<bool>("journal");
+		/* Changes made while the journal was off are not in it */
+		if (use_journal && !this->journal && loaded)
+			need_compact = true;
+		this->journal = use_journal;
+		this->compact_interval = block->Get<time_t>("compactinterval", "1h");
+
+		if (!this->journal)
+		{
+			dirty.clear();
+			deleted.clear();
+		}
 	}
 
 #ifndef _WIN32
@@ -193,6 +485,9 @@ class DBFlatFile : public Module, public Pipe
 			waitpid(child_pid, &status, 0);
 
 			Log(this) << "Done";
+
+			/* Pick up the result now, as we won't get notified */
+			this->OnNotify();
 		}
 	}
 #endif
@@ -224,7 +519,7 @@ class DBFlatFile : public Module, public Pipe
 		const std::vector<Anope::string> &type_order = Serialize::Type::GetTypeOrder();
 		std::set<Anope::string> tried_dbs;
 
-		const Anope::string &db_name = Anope::DataDir + "/" + Config->GetModule(this)->Get<const Anope::string>("database", "anope.db");
+		const Anope::string &db_name = this->GetDatabaseName();
 
 		std::fstream fd(db_name.c_str(), std::ios_base::in | std::ios_base::binary);
 		if (!fd.is_open())
@@ -233,6 +528,8 @@ class DBFlatFile : public Module, public Pipe
 			return EVENT_STOP;
 		}
 
+		loading = true;
+
 		std::map<Anope::string, std::vector<std::streampos> > positions;
 
 		for (Anope::string buf; std::getline(fd, buf.str());)
@@ -257,20 +554,56 @@ class DBFlatFile : public Module, public Pipe
 
 				Serializable *obj = stype->Unserialize(NULL, ld);
 				if (obj != NULL)
-					obj->id = ld.id;
+					this->AddLoaded(obj, ld.id);
 				ld.Reset();
 			}
 		}
 
 		fd.close();
 
+		/* Replay changes made since the last full save. If that save failed, the old journal is needed too */
+		this->ReplayJournal(db_name + ".journal.old", NULL);
+		this->ReplayJournal(db_name + ".journal", NULL);
+		objects.clear();
+
+		if (this->journal)
+		{
+			const std::list<Serializable *> &items = Serializable::GetItems();
+			for (std::list<Serializable *>::const_iterator it = items.begin(), it_end = items.end(); it != it_end; ++it)
+				if ((*it)->GetSerializableType())
+					Commit(*it);
+		}
+
+		loading = false;
 		loaded = true;
+		last_compact = Anope::CurTime;
 		return EVENT_STOP;
 	}
 
 
 	void OnSaveDatabase() anope_override
 	{
+		unloading = NULL;
+
+		/* Only write the journal until it is time to compact it. Changes which are not
+		 * queued as updates only get saved by a full save, so shutting down always does one
+		 */
+		if (this->journal && !need_compact && !Anope::Quitting && (child_pid > -1 || last_compact + compact_interval > Anope::CurTime))
+		{
+			this->FindChanged();
+			this->WriteJournal();
+			return;
+		}
+
+#ifndef _WIN32
+		/* Let a save in progress finish first, so it doesn't overwrite this one */
+		if (Anope::Quitting && child_pid > -1)
+		{
+			this->OnShutdown();
+			child_pid = -1;
+		}
+#endif
+
 		if (child_pid > -1)
 		{
 			Log(this) << "Database save is already in progress!";
@@ -279,6 +612,27 @@ class DBFlatFile : public Module, public Pipe
 
 		BackupDatabase();
 
+		if (this->journal)
+		{
+			/* Objects need ids so the journal can refer to them later, and journal saves
+			 * compare them against how they are now
+			 */
+			const std::list<Serializable *> &items = Serializable::GetItems();
+			for (std::list<Serializable *>::const_iterator it = items.begin(), it_end = items.end(); it != it_end; ++it)
+				if ((*it)->GetSerializableType())
+				{
+					this->AssignId(*it);
+					Commit(*it);
+				}
+		}
+
+		/* Everything is in the full save, start the journal afresh */
+		dirty.clear();
+		deleted.clear();
+		this->RotateJournal();
+		last_compact = Anope::CurTime;
+		need_compact = false;
+
 		int i = -1;
 #ifndef _WIN32
 		if (!Anope::Quitting && Config->GetModule(this)->Get<bool>("fork"))
@@ -339,6 +693,7 @@ class DBFlatFile : public Module, public Pipe
 				*data.fs << "\nEND\n";
 			}
 
+			bool saved = true;
 			for (std::map<Module *, std::fstream *>::iterator it = databases.begin(), it_end = databases.end(); it != it_end; ++it)
 			{
 				std::fstream *f = it->second;
@@ -347,6 +702,7 @@ class DBFlatFile : public Module, public Pipe
 				if (!f->is_open() || !f->good())
 				{
 					this->Write("Unable to write database " + db_name);
+					saved = false;
 
 					f->close();
 
@@ -361,6 +717,10 @@ class DBFlatFile : public Module, public Pipe
 
 				delete f;
 			}
+
+			/* The journal from before this save is no longer needed */
+			if (saved)
+				unlink((this->GetDatabaseName() + ".journal.old").c_str());
 		}
 		catch (...)
 		{
@@ -378,6 +738,9 @@ class DBFlatFile : public Module, public Pipe
 	/* Load just one type. Done if a module is reloaded during runtime */
 	void OnSerializeTypeCreate(Serialize::Type *stype) anope_override
 	{
+		/* A module is being loaded, so any unload is over */
+		unloading = NULL;
+
 		if (!loaded)
 			return;
 
@@ -397,16 +760,85 @@ class DBFlatFile : public Module, public Pipe
 		LoadData ld;
 		ld.fs = &fd;
 
+		loading = true;
+
 		for (Anope::string buf; std::getline(fd, buf.str());)
 		{
 			if (buf == "OBJECT " + stype->GetName())
 			{
-				stype->Unserialize(NULL, ld);
+				Serializable *obj = stype->Unserialize(NULL, ld);
+				if (obj != NULL)
+					this->AddLoaded(obj, ld.id);
 				ld.Reset();
 			}
 		}
 
 		fd.close();
+
+		const Anope::string &journal_name = this->GetDatabaseName() + ".journal";
+		this->ReplayJournal(journal_name + ".old", stype);
+		this->ReplayJournal(journal_name, stype);
+
+		/* If the objects were deleted when the type went away, they are back now */
+		for (unsigned i = deleted.size(); i > 0; --i)
+			if (deleted[i - 1].first == stype->GetName() && objects[stype->GetName()].count(deleted[i - 1].second))
+				deleted.erase(deleted.begin() + i - 1);
+
+		if (this->journal)
+		{
+			std::map<uint64_t, Serializable *> &objs = objects[stype->GetName()];
+			for (std::map<uint64_t, Serializable *>::iterator it = objs.begin(); it != objs.end(); ++it)
+				Commit(it->second);
+		}
+
+		objects.clear();
+		loading = false;
+	}
+
+	void OnModuleLoad(User *, Module *) anope_override
+	{
+		unloading = NULL;
+	}
+
+	void OnModuleUnload(User *, Module *m) anope_override
+	{
+		unloading = m;
+	}
+
+	void OnSerializableConstruct(Serializable *obj) anope_override
+	{
+		if (this->journal && !loading)
+			dirty.insert(obj);
+	}
+
+	void OnSerializableUpdate(Serializable *obj) anope_override
+	{
+		if (this->journal && !loading && !finding)
+			dirty.insert(obj);
+	}
+
+	void OnSerializableDestruct(Serializable *obj) anope_override
+	{
+		Serialize::Type *stype = obj->GetSerializableType();
+		if (!stype)
+			return;
+
+		if (loading)
+		{
+			std::map<uint64_t, Serializable *> &objs = objects[stype->GetName()];
+			std::map<uint64_t, Serializable *>::iterator it = objs.find(obj->id);
+			if (it != objs.end() && it->second == obj)
+				objs.erase(it);
+			return;
+		}
+
+		if (!this->journal)
+			return;
+
+		dirty.erase(obj);
+		/* Objects of a module being unloaded are not deleted, and are loaded again with it */
+		if (obj->id && (!unloading || stype->GetOwner() != unloading))
+			deleted.push_back(std::make_pair(stype->GetName(), obj->id));
 	}
 };
 
@@ -208,7 +208,11 @@ class DBSQL : public Module, public Pipe
 			return;
 		Serialize::Type *s_type = obj->GetSerializableType();
 		if (s_type && obj->id > 0)
-			this->RunBackground("DELETE FROM `" + this->prefix + s_type->GetName() + "` WHERE `id` = " + stringify(obj->id));
+		{
+			Query query("DELETE FROM `" + this->prefix + s_type->GetName() + "` WHERE `id` = " + stringify(obj->id));
+			query.key = this->prefix + s_type->GetName() + ":" + stringify(obj->id);
+			this->RunBackground(query);
+		}
 		this->updated_items.erase(obj);
 	}
 
@@ -842,10 +842,44 @@ char *_crypt_gensalt_blowfish_rn(const char *prefix, unsigned long count,
 #include "module.h"
 #include "modules/encryption.h"
 
-class EBCRYPT : public Module
+/** A password check which is run on one of the hashing threads.
+ * The threads only ever touch the strings in here, the request
+ * itself is only used from the main thread.
+ */
+struct BCryptCheck
+{
+	/* The request being checked, or NULL if its owner has gone away */
+	IdentifyRequest *req;
+	/* The password given and the stored hash to check it against */
+	Anope::string password, hash;
+	/* If not empty, the password is rehashed with this salt once it has been verified */
+	Anope::string salt;
+
+	/* Results */
+	bool success;
+	Anope::string rehashed;
+
+	BCryptCheck(IdentifyRequest *r, const Anope::string &p, const Anope::string &h) : req(r), password(p), hash(h), success(false) { }
+};
+
+class BCryptThread : public Thread
+{
+ public:
+	void Run() anope_override;
+};
+
+class EBCRYPT;
+static EBCRYPT *me;
+
+class EBCRYPT : public Module, public Pipe
 {
 	unsigned int rounds;
 
+	/* The threads used to check passwords */
+	std::vector<BCryptThread *> threads;
+	/* Checks which have been queued and not yet returned, only used by the main thread */
+	std::set<BCryptCheck *> checks;
+
 	Anope::string Salt()
 	{
 		char entropy[16];
@@ -858,14 +892,88 @@ class EBCRYPT : public Module
 		return salt;
 	}
 
-	Anope::string Generate(const Anope::string& data, const Anope::string& salt)
+	unsigned int GetRounds(const Anope::string &hash)
+	{
+		try
+		{
+			size_t roundspos = hash.find('$', 4);
+			if (roundspos == Anope::string::npos)
+				throw ConvertException("Could not find hashrounds");
+
+			return convertTo<unsigned int>(hash.substr(4, roundspos - 4));
+		}
+		catch (const ConvertException &)
+		{
+			Log(this) << "Could not get the round size of a hash. This is probably a bug. Hash: bcrypt:" << hash;
+		}
+
+		return 0;
+	}
+
+	void StartThreads(unsigned int count)
+	{
+		for (unsigned int i = threads.size(); i < count; ++i)
+		{
+			BCryptThread *t = new BCryptThread();
+			t->Start();
+			threads.push_back(t);
+		}
+	}
+
+	void StopThreads()
+	{
+		if (threads.empty())
+			return;
+
+		/* Set the exit state while holding the lock so a thread can't miss its wakeup */
+		this->QueueLock.Lock();
+		for (unsigned int i = 0; i < threads.size(); ++i)
+			threads[i]->SetExitState();
+		for (unsigned int i = 0; i < threads.size(); ++i)
+			this->QueueLock.Wakeup();
+		this->QueueLock.Unlock();
+
+		for (unsigned int i = 0; i < threads.size(); ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+		threads.clear();
+	}
+
+	/** Completes a check on the main thread, once the hash has been verified
+	 */
+	void Finish(BCryptCheck *check)
+	{
+		IdentifyRequest *req = check->req;
+		if (req == NULL || !check->success)
+			return;
+
+		/* The account may have been dropped or its password changed while we were busy */
+		const NickAlias *na = NickAlias::Find(req->GetAccount());
+		if (na == NULL || na->nc->pass != "bcrypt:" + check->hash)
+			return;
+		NickCore *nc = na->nc;
+
+		/* if we are NOT the first module in the list,
+		 * we want to re-encrypt the pass with the new encryption
+		 */
+		if (!check->rehashed.empty() && ModuleManager::FindFirstOf(ENCRYPTION) == this)
+			nc->pass = "bcrypt:" + check->rehashed;
+		else if (ModuleManager::FindFirstOf(ENCRYPTION) != this || !check->salt.empty())
+			Anope::Encrypt(req->GetPassword(), nc->pass);
+		req->Success(this);
+	}
+
+ public:
+	static Anope::string Generate(const Anope::string& data, const Anope::string& salt)
 	{
 		char hash[64];
 		_crypt_blowfish_rn(data.c_str(), salt.c_str(), hash, sizeof(hash));
 		return hash;
 	}
 
-	bool Compare(const Anope::string& string, const Anope::string& hash)
+	static bool Compare(const Anope::string& string, const Anope::string& hash)
 	{
 		Anope::string ret = Generate(string, hash);
 		if (ret.empty())
@@ -874,10 +982,27 @@ class EBCRYPT : public Module
 		return (ret == hash);
 	}
 
- public:
+	/** Verifies the password of a check, and rehashes it if requested. This is safe to call from any thread.
+	 */
+	static void Run(BCryptCheck *check)
+	{
+		check->success = Compare(check->password, check->hash);
+		if (check->success && !check->salt.empty())
+			check->rehashed = Generate(check->password, check->salt);
+	}
+
+	/* Guards Pending and Finished, and is signalled when a check is queued */
+	Condition QueueLock;
+	/* Checks waiting for a thread */
+	std::deque<BCryptCheck *> Pending;
+	/* Checks which are done and waiting to be picked up by the main thread */
+	std::deque<BCryptCheck *> Finished;
+
 	EBCRYPT(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, ENCRYPTION | VENDOR),
 		rounds(10)
 	{
+		me = this;
+
 		// Test a pre-calculated hash
 		bool test = Compare("Test!", "$2a$10$x9AQFAQScY0v9KF2suqkEOepsHFrG.CXHbIXI.1F28SfSUb56A/7K");
 
@@ -888,6 +1013,14 @@ class EBCRYPT : public Module
 			throw ModuleException("BCrypt could not load!");
 	}
 
+	~EBCRYPT()
+	{
+		StopThreads();
+
+		for (std::set<BCryptCheck *>::iterator it = checks.begin(); it != checks.end(); ++it)
+			delete *it;
+	}
+
 	EventReturn OnEncrypt(const Anope::string &src, Anope::string &dest) anope_override
 	{
 		dest = "bcrypt:" + Generate(src, Salt());
@@ -909,29 +1042,62 @@ class EBCRYPT : public Module
 		if (hash_method != "bcrypt")
 			return;
 
-		if (Compare(req->GetPassword(), nc->pass.substr(7)))
+		BCryptCheck *check = new BCryptCheck(req, req->GetPassword(), nc->pass.substr(7));
+
+		/* If we are the primary encryption module but the hash was made with a
+		 * different number of rounds, rehash it once the password is verified
+		 */
+		if (ModuleManager::FindFirstOf(ENCRYPTION) == this)
 		{
-			/* if we are NOT the first module in the list,
-			 * we want to re-encrypt the pass with the new encryption
-			 */
+			unsigned int hashrounds = GetRounds(check->hash);
+			if (hashrounds && hashrounds != rounds)
+				check->salt = Salt();
+		}
 
-			unsigned int hashrounds = 0;
-			try
-			{
-				size_t roundspos = nc->pass.find('$', 11);
-				if (roundspos == Anope::string::npos)
-					throw ConvertException("Could not find hashrounds");
+		if (threads.empty())
+		{
+			Run(check);
+			Finish(check);
+			delete check;
+			return;
+		}
 
-				hashrounds = convertTo<unsigned int>(nc->pass.substr(11, roundspos - 11));
-			}
-			catch (const ConvertException &)
-			{
-				Log(this) << "Could not get the round size of a hash. This is probably a bug. Hash: " << nc->pass;
-			}
+		req->Hold(this);
+		checks.insert(check);
+
+		this->QueueLock.Lock();
+		this->Pending.push_back(check);
+		this->QueueLock.Wakeup();
+		this->QueueLock.Unlock();
+	}
+
+	void OnNotify() anope_override
+	{
+		this->QueueLock.Lock();
+		std::deque<BCryptCheck *> finished;
+		finished.swap(this->Finished);
+		this->QueueLock.Unlock();
 
-			if (ModuleManager::FindFirstOf(ENCRYPTION) != this || (hashrounds && hashrounds != rounds))
-				Anope::Encrypt(req->GetPassword(), nc->pass);
-			req->Success(this);
+		for (std::deque<BCryptCheck *>::iterator it = finished.begin(); it != finished.end(); ++it)
+		{
+			BCryptCheck *check = *it;
+
+			checks.erase(check);
+			Finish(check);
+			if (check->req)
+				check->req->Release(this);
+			delete check;
+		}
+	}
+
+	void OnModuleUnload(User *, Module *m) anope_override
+	{
+		/* Requests are deleted when their owner is unloaded, so forget about them */
+		for (std::set<BCryptCheck *>::iterator it = checks.begin(); it != checks.end(); ++it)
+		{
+			BCryptCheck *check = *it;
+			if (check->req && check->req->GetOwner() == m)
+				check->req = NULL;
 		}
 	}
 
@@ -958,7 +1124,59 @@ class EBCRYPT : public Module
 		{
 			Log(this) << "Are you sure you want to use " << stringify(rounds) << " in your bcrypt settings? This is very CPU intensive! Recommended rounds is 10-12.";
 		}
+
+		unsigned int threadcount = block->Get<unsigned int>("threads", "2");
+		if (threadcount > 64)
+		{
+			threadcount = 64;
+			Log(this) << "The maximum number of threads supported is 64. Using 64.";
+		}
+
+		if (threadcount < threads.size())
+			StopThreads();
+		StartThreads(threadcount);
+
+		if (threads.empty())
+		{
+			/* Nothing is left to run the queued checks, so finish them here */
+			this->QueueLock.Lock();
+			for (std::deque<BCryptCheck *>::iterator it = this->Pending.begin(); it != this->Pending.end(); ++it)
+			{
+				Run(*it);
+				this->Finished.push_back(*it);
+			}
+			this->Pending.clear();
+			this->QueueLock.Unlock();
+
+			this->OnNotify();
+		}
 	}
 };
 
+void BCryptThread::Run()
+{
+	me->QueueLock.Lock();
+
+	while (!this->GetExitState())
+	{
+		if (me->Pending.empty())
+		{
+			me->QueueLock.Wait();
+			continue;
+		}
+
+		BCryptCheck *check = me->Pending.front();
+		me->Pending.pop_front();
+		me->QueueLock.Unlock();
+
+		EBCRYPT::Run(check);
+
+		me->QueueLock.Lock();
+		me->Finished.push_back(check);
+		me->Notify();
+	}
+
+	me->QueueLock.Unlock();
+}
+
 MODULE_INIT(EBCRYPT)
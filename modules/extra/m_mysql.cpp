@@ -17,17 +17,25 @@
 #else
 # include <mysql/mysql.h>
 #endif
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 using namespace SQL;
 
 /** Non blocking threaded MySQL API, based loosely from InspIRCd's m_mysql.cpp
  *
- * This module spawns a single thread that is used to execute blocking MySQL queries.
- * When a module requests a query to be executed it is added to a list for the thread
- * (which never stops looping and sleeing) to pick up and execute, the result of which
- * is inserted in to another queue to be picked up by the main thread. The main thread
- * uses Pipe to become notified through the socket engine when there are results waiting
- * to be sent back to the modules requesting the query
+ * This module spawns a pool of threads that are used to execute blocking MySQL queries,
+ * each on its own connection. When a module requests a query to be executed it is added
+ * to a queue for the threads to pick up and execute, the result of which is inserted in
+ * to another queue to be picked up by the main thread. The main thread uses Pipe to become
+ * notified through the socket engine when there are results waiting to be sent back to
+ * the modules requesting the query.
+ *
+ * Queries on a database are started in the order they were queued. Queries with a key only
+ * have to wait for earlier queries with the same key and for those without a key, so writes
+ * to different rows can run at the same time. Queries without a key wait for everything
+ * queued before them, although SELECTs can run at the same time as each other.
  */
 
 class MySQLService;
@@ -42,8 +50,12 @@ struct QueryRequest
 	Interface *sqlinterface;
 	/* The actual query */
 	Query query;
+	/* Whether this only reads from the database */
+	bool read;
+	/* The id of the row if this is an insert from BuildInsert, which can be combined with others */
+	unsigned int insert_id;
 
-	QueryRequest(MySQLService *s, Interface *i, const Query &q) : service(s), sqlinterface(i), query(q) { }
+	QueryRequest(MySQLService *s, Interface *i, const Query &q);
 };
 
 /** A query result */
@@ -54,7 +66,7 @@ struct QueryResult
 	/* The result */
 	Result result;
 
-	QueryResult(Interface *i, Result &r) : sqlinterface(i), result(r) { }
+	QueryResult(Interface *i, const Result &r) : sqlinterface(i), result(r) { }
 };
 
 /** A MySQL result
@@ -105,10 +117,111 @@ class MySQLResult : public Result
 	}
 };
 
-/** A MySQL connection, there can be multiple
+
+/** How long queries on a database take, in buckets of <1ms, <10ms, <100ms, <1s and longer,
+ * and how deep its queue has been
+ */
+struct QueryTimes
+{
+	unsigned long reads[5], writes[5];
+	/* Multi-row inserts, and the rows in them */
+	unsigned long inserts, inserted_rows;
+	/* The most queries queued at once */
+	unsigned max_queued;
+
+	QueryTimes()
+	{
+		this->Clear();
+	}
+
+	void Clear()
+	{
+		for (unsigned i = 0; i < 5; ++i)
+			reads[i] = writes[i] = 0;
+		inserts = inserted_rows = 0;
+		max_queued = 0;
+	}
+
+	bool Empty() const
+	{
+		for (unsigned i = 0; i < 5; ++i)
+			if (reads[i] || writes[i])
+				return false;
+		return true;
+	}
+
+	void Add(bool read, long usec)
+	{
+		unsigned bucket = 0;
+		for (long limit = 1000; bucket < 4 && usec >= limit; limit *= 10)
+			++bucket;
+		++(read ? reads : writes)[bucket];
+	}
+
+	static Anope::string Format(const unsigned long (&times)[5])
+	{
+		unsigned long total = 0;
+		for (unsigned i = 0; i < 5; ++i)
+			total += times[i];
+		return stringify(total) + " (" + stringify(times[0]) + " <1ms, " + stringify(times[1]) + " <10ms, " + stringify(times[2]) + " <100ms, "
+			+ stringify(times[3]) + " <1s, " + stringify(times[4]) + " slower)";
+	}
+};
+
+/** A value bound to a prepared statement
+ */
+struct Param
+{
+	enum_field_types kind;
+	Anope::string data;
+	long long number;
+
+	Param() : kind(MYSQL_TYPE_NULL), number(0) { }
+};
+
+/** A connection to a MySQL server, only used by one thread at a time
+ */
+class MySQLConnection
+{
+	MySQLService *service;
+	MYSQL *sql;
+	/* Prepared statements, by their text */
+	std::map<Anope::string, MYSQL_STMT *> statements;
+
+	void ClearStatements();
+
+	/** Prepare a statement, or find it if it has been prepared already.
+	 * Returns NULL if it can't be prepared, in which case it should be run as a normal query.
+	 */
+	MYSQL_STMT *Prepare(const Anope::string &text, size_t params);
+
+	bool Execute(MYSQL_STMT *stmt, const Anope::string &text, const std::vector<Param> &params, unsigned int &id, Anope::string &error);
+
+	Anope::string Escape(const Anope::string &query);
+
+ public:
+	MySQLConnection(MySQLService *s) : service(s), sql(NULL) { }
+
+	~MySQLConnection();
+
+	void Connect();
+
+	bool CheckConnection();
+
+	Anope::string BuildQuery(const Query &q);
+
+	Result RunQuery(const Query &query);
+
+	/** Run inserts from BuildInsert into the same table as one statement, if they can be */
+	void RunInserts(const std::vector<QueryRequest> &batch, std::vector<Result> &results);
+};
+
+/** A MySQL database, there can be multiple
  */
 class MySQLService : public Provider
 {
+	friend class MySQLConnection;
+
 	std::map<Anope::string, std::set<Anope::string> > active_schema;
 
 	Anope::string database;
@@ -117,24 +230,54 @@ class MySQLService : public Provider
 	Anope::string password;
 	int port;
 
-	MYSQL *sql;
+	/* The connection RunQuery uses, locked by Lock */
+	MySQLConnection *conn;
 
-	/** Escape a query.
-	 * Note the mutex must be held!
-	 */
-	Anope::string Escape(const Anope::string &query);
+	/* Connections not being used by a thread, locked by the module's QueueLock */
+	std::vector<MySQLConnection *> connections;
 
  public:
-	/* Locked by the SQL thread when a query is pending on this database,
-	 * prevents us from deleting a connection while a query is executing
-	 * in the thread
-	 */
+	/* Held while RunQuery is using its connection */
 	Mutex Lock;
 
+	/* Everything below is locked by the module's QueueLock */
+
+	/* Queries queued and not yet started */
+	unsigned queued;
+	/* SELECTs without a key running */
+	unsigned reading;
+	/* Whether a query without a key other than a SELECT is running */
+	bool writing;
+	/* Keys of the queries running */
+	std::set<Anope::string> keys;
+
+	QueryTimes times;
+
 	MySQLService(Module *o, const Anope::string &n, const Anope::string &d, const Anope::string &s, const Anope::string &u, const Anope::string &p, int po);
 
 	~MySQLService();
 
+	/* Whether nothing is queued or running on this database */
+	bool Idle() const
+	{
+		return !queued && !reading && !writing && keys.empty();
+	}
+
+	/* Take a connection for a thread to use */
+	MySQLConnection *GetConnection()
+	{
+		if (this->connections.empty())
+			return new MySQLConnection(this);
+		MySQLConnection *c = this->connections.back();
+		this->connections.pop_back();
+		return c;
+	}
+
+	void ReturnConnection(MySQLConnection *c)
+	{
+		this->connections.push_back(c);
+	}
+
 	void Run(Interface *i, const Query &query) anope_override;
 
 	Result RunQuery(const Query &query) anope_override;
@@ -145,22 +288,14 @@ class MySQLService : public Provider
 
 	Query GetTables(const Anope::string &prefix) anope_override;
 
-	void Connect();
-
-	bool CheckConnection();
-
-	Anope::string BuildQuery(const Query &q);
-
 	Anope::string FromUnixtime(time_t);
 };
 
-/** The SQL thread used to execute queries
+/** A thread used to execute queries
  */
-class DispatcherThread : public Thread, public Condition
+class DispatcherThread : public Thread
 {
  public:
-	DispatcherThread() : Thread() { }
-
 	void Run() anope_override;
 };
 
@@ -170,33 +305,113 @@ class ModuleSQL : public Module, public Pipe
 {
 	/* SQL connections */
 	std::map<Anope::string, MySQLService *> MySQLServices;
+
+	/* The threads used to execute queries */
+	std::vector<DispatcherThread *> threads;
+
+	/* Logs how long queries have been taking */
+	class StatsTimer : public Timer
+	{
+	 public:
+		StatsTimer(Module *o) : Timer(o, 900, Anope::CurTime, true) { }
+
+		void Tick(time_t) anope_override
+		{
+			me->LogStats();
+		}
+	} stats_timer;
+
+	void StartThreads(unsigned count)
+	{
+		for (unsigned i = threads.size(); i < count; ++i)
+		{
+			DispatcherThread *t = new DispatcherThread();
+			t->Start();
+			threads.push_back(t);
+		}
+	}
+
+	void StopThreads()
+	{
+		/* Set the exit state while holding the lock so a thread can't miss its wakeup */
+		this->QueueLock.Lock();
+		for (unsigned i = 0; i < threads.size(); ++i)
+			threads[i]->SetExitState();
+		for (unsigned i = 0; i < threads.size(); ++i)
+			this->QueueLock.Wakeup();
+		this->QueueLock.Unlock();
+
+		for (unsigned i = 0; i < threads.size(); ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+		threads.clear();
+	}
+
  public:
+	/* Locks the queues and the state of each database, and is signalled when queries are queued */
+	Condition QueueLock;
+	/* Signalled when a thread has finished running queries */
+	Condition FinishedLock;
+
 	/* Pending query requests */
 	std::deque<QueryRequest> QueryRequests;
 	/* Pending finished requests with results */
 	std::deque<QueryResult> FinishedRequests;
-	/* The thread used to execute queries */
-	DispatcherThread *DThread;
+	/* Queries being run by the threads, which are NULLed if their interface goes away */
+	std::list<Interface *> Running;
 
-	ModuleSQL(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR)
+	ModuleSQL(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR), stats_timer(this)
 	{
 		me = this;
-
-
-		DThread = new DispatcherThread();
-		DThread->Start();
 	}
 
 	~ModuleSQL()
 	{
+		StopThreads();
+
 		for (std::map<Anope::string, MySQLService *>::iterator it = this->MySQLServices.begin(); it != this->MySQLServices.end(); ++it)
 			delete it->second;
 		MySQLServices.clear();
+	}
+
+	/** Wait until no query is running on a database.
+	 * The QueueLock must not be held.
+	 * @param include_queued true to also wait for queued queries
+	 */
+	void WaitFor(MySQLService *service, bool include_queued)
+	{
+		this->FinishedLock.Lock();
+		for (;;)
+		{
+			this->QueueLock.Lock();
+			bool done = include_queued ? service->Idle() : (!service->reading && !service->writing && service->keys.empty());
+			this->QueueLock.Unlock();
+
+			if (done)
+				break;
+			this->FinishedLock.Wait();
+		}
+		this->FinishedLock.Unlock();
+	}
+
+	void LogStats()
+	{
+		for (std::map<Anope::string, MySQLService *>::iterator it = this->MySQLServices.begin(); it != this->MySQLServices.end(); ++it)
+		{
+			MySQLService *s = it->second;
+
+			this->QueueLock.Lock();
+			QueryTimes times = s->times;
+			s->times.Clear();
+			unsigned queued = s->queued;
+			this->QueueLock.Unlock();
 
-		DThread->SetExitState();
-		DThread->Wakeup();
-		DThread->Join();
-		delete DThread;
+			if (!times.Empty())
+				Log(LOG_DEBUG) << "MySQL: " << it->first << ": reads: " << QueryTimes::Format(times.reads) << ", writes: " << QueryTimes::Format(times.writes)
+					<< ", " << times.inserted_rows << " rows in " << times.inserts << " multi-row inserts, " << queued << " queued (at most " << times.max_queued << ")";
+		}
 	}
 
 	void OnReload(Configuration::Conf *conf) anope_override
@@ -250,11 +465,18 @@ class ModuleSQL : public Module, public Pipe
 				}
 			}
 		}
+
+		unsigned count = config->Get<unsigned>("threads", "4");
+		if (!count)
+			count = 1;
+		if (count < threads.size())
+			StopThreads();
+		StartThreads(count);
 	}
 
 	void OnModuleUnload(User *, Module *m) anope_override
 	{
-		this->DThread->Lock();
+		this->QueueLock.Lock();
 
 		for (unsigned i = this->QueryRequests.size(); i > 0; --i)
 		{
@@ -262,35 +484,39 @@ class ModuleSQL : public Module, public Pipe
 
 			if (r.sqlinterface && r.sqlinterface->owner == m)
 			{
-				if (i == 1)
-				{
-					r.service->Lock.Lock();
-					r.service->Lock.Unlock();
-				}
-
+				--r.service->queued;
 				this->QueryRequests.erase(this->QueryRequests.begin() + i - 1);
 			}
 		}
 
-		this->DThread->Unlock();
+		for (std::list<Interface *>::iterator it = this->Running.begin(); it != this->Running.end(); ++it)
+			if (*it && (*it)->owner == m)
+				*it = NULL;
+
+		for (unsigned i = this->FinishedRequests.size(); i > 0; --i)
+		{
+			QueryResult &r = this->FinishedRequests[i - 1];
+
+			if (r.sqlinterface && r.sqlinterface->owner == m)
+				this->FinishedRequests.erase(this->FinishedRequests.begin() + i - 1);
+		}
+
+		this->QueueLock.Unlock();
 
 		this->OnNotify();
 	}
 
 	void OnNotify() anope_override
 	{
-		this->DThread->Lock();
-		std::deque<QueryResult> finishedRequests = this->FinishedRequests;
-		this->FinishedRequests.clear();
-		this->DThread->Unlock();
+		this->QueueLock.Lock();
+		std::deque<QueryResult> finishedRequests;
+		finishedRequests.swap(this->FinishedRequests);
+		this->QueueLock.Unlock();
 
 		for (std::deque<QueryResult>::const_iterator it = finishedRequests.begin(), it_end = finishedRequests.end(); it != it_end; ++it)
 		{
 			const QueryResult &qr = *it;
 
-			if (!qr.sqlinterface)
-				throw SQL::Exception("NULL qr.sqlinterface in MySQLPipe::OnNotify() ?");
-
 			if (qr.result.GetError().empty())
 				qr.sqlinterface->OnResult(qr.result);
 			else
@@ -299,19 +525,49 @@ class ModuleSQL : public Module, public Pipe
 	}
 };
 
+/* The first word of a query */
+static Anope::string FirstWord(const Anope::string &query)
+{
+	size_t start = query.find_first_not_of(" \t\r\n(");
+	if (start == Anope::string::npos)
+		return "";
+	size_t end = query.find_first_of(" \t\r\n(", start);
+	return query.substr(start, end == Anope::string::npos ? end : end - start);
+}
+
+QueryRequest::QueryRequest(MySQLService *s, Interface *i, const Query &q) : service(s), sqlinterface(i), query(q), insert_id(0)
+{
+	read = FirstWord(q.query).equals_ci("SELECT");
+
+	std::map<Anope::string, QueryData>::const_iterator it = q.parameters.find("_id");
+	if (!q.key.empty() && it != q.parameters.end() && !q.query.find("INSERT INTO ") && q.query.find(") ON DUPLICATE KEY UPDATE ") != Anope::string::npos)
+	{
+		try
+		{
+			insert_id = convertTo<unsigned int>(it->second.data);
+		}
+		catch (const ConvertException &) { }
+	}
+}
+
 MySQLService::MySQLService(Module *o, const Anope::string &n, const Anope::string &d, const Anope::string &s, const Anope::string &u, const Anope::string &p, int po)
-: Provider(o, n), database(d), server(s), user(u), password(p), port(po), sql(NULL)
+: Provider(o, n), database(d), server(s), user(u), password(p), port(po), conn(NULL), queued(0), reading(0), writing(false)
 {
-	Connect();
+	this->conn = new MySQLConnection(this);
+	try
+	{
+		this->conn->Connect();
+	}
+	catch (const SQL::Exception &)
+	{
+		delete this->conn;
+		throw;
+	}
 }
 
 MySQLService::~MySQLService()
 {
-	me->DThread->Lock();
-	this->Lock.Lock();
-	mysql_close(this->sql);
-	this->sql = NULL;
-
+	me->QueueLock.Lock();
 	for (unsigned i = me->QueryRequests.size(); i > 0; --i)
 	{
 		QueryRequest &r = me->QueryRequests[i - 1];
@@ -319,51 +575,59 @@ MySQLService::~MySQLService()
 		if (r.service == this)
 		{
 			if (r.sqlinterface)
-				r.sqlinterface->OnError(Result(0, r.query, "SQL Interface is going away"));
+				me->FinishedRequests.push_back(QueryResult(r.sqlinterface, Result(0, r.query, "", "SQL Interface is going away")));
 			me->QueryRequests.erase(me->QueryRequests.begin() + i - 1);
 		}
 	}
+	this->queued = 0;
+	me->QueueLock.Unlock();
+
+	me->WaitFor(this, false);
+	me->OnNotify();
+
+	this->Lock.Lock();
+	delete this->conn;
+	this->conn = NULL;
 	this->Lock.Unlock();
-	me->DThread->Unlock();
+
+	for (unsigned i = 0; i < this->connections.size(); ++i)
+		delete this->connections[i];
 }
 
 void MySQLService::Run(Interface *i, const Query &query)
 {
-	me->DThread->Lock();
+	me->QueueLock.Lock();
 	me->QueryRequests.push_back(QueryRequest(this, i, query));
-	me->DThread->Unlock();
-	me->DThread->Wakeup();
+	if (++this->queued > this->times.max_queued)
+		this->times.max_queued = this->queued;
+	me->QueueLock.Unlock();
+	me->QueueLock.Wakeup();
+}
+
+static long Elapsed(const struct timeval &start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec);
 }
 
 Result MySQLService::RunQuery(const Query &query)
 {
-	this->Lock.Lock();
+	/* Queries are run in the order they are given, so let everything before this finish first */
+	me->WaitFor(this, true);
 
-	Anope::string real_query = this->BuildQuery(query);
+	struct timeval start;
+	gettimeofday(&start, NULL);
 
-	if (this->CheckConnection() && !mysql_real_query(this->sql, real_query.c_str(), real_query.length()))
-	{
-		MYSQL_RES *res = mysql_store_result(this->sql);
-		unsigned int id = mysql_insert_id(this->sql);
-
-		/* because we enabled CLIENT_MULTI_RESULTS in our options
-		 * a multiple statement or a procedure call can return
-		 * multiple result sets.
-		 * we must process them all before the next query.
-		 */
+	this->Lock.Lock();
+	Result r = this->conn->RunQuery(query);
+	this->Lock.Unlock();
 
-		while (!mysql_next_result(this->sql))
-			mysql_free_result(mysql_store_result(this->sql));
+	me->QueueLock.Lock();
+	this->times.Add(FirstWord(query.query).equals_ci("SELECT"), Elapsed(start));
+	me->QueueLock.Unlock();
 
-		this->Lock.Unlock();
-		return MySQLResult(id, query, real_query, res);
-	}
-	else
-	{
-		Anope::string error = mysql_error(this->sql);
-		this->Lock.Unlock();
-		return MySQLResult(query, real_query, error);
-	}
+	return r;
 }
 
 std::vector<Query> MySQLService::CreateTable(const Anope::string &table, const Data &data)
@@ -433,7 +697,7 @@ Query MySQLService::BuildInsert(const Anope::string &table, unsigned int id, Dat
 	Anope::string query_text = "INSERT INTO `" + table + "` (`id`";
 	for (Data::Map::const_iterator it = data.data.begin(), it_end = data.data.end(); it != it_end; ++it)
 		query_text += ",`" + it->first + "`";
-	query_text += ") VALUES (" + stringify(id);
+	query_text += ") VALUES (@_id@";
 	for (Data::Map::const_iterator it = data.data.begin(), it_end = data.data.end(); it != it_end; ++it)
 		query_text += ",@" + it->first + "@";
 	query_text += ") ON DUPLICATE KEY UPDATE ";
@@ -456,6 +720,11 @@ Query MySQLService::BuildInsert(const Anope::string &table, unsigned int id, Dat
 
 		query.SetValue(it->first, buf, escape);
 	}
+	query.SetValue("_id", id, false);
+
+	/* Writes to existing rows only need to stay in order with other writes to the same row */
+	if (id > 0)
+		query.key = table + ":" + stringify(id);
 
 	return query;
 }
@@ -465,23 +734,37 @@ Query MySQLService::GetTables(const Anope::string &prefix)
 	return Query("SHOW TABLES LIKE '" + prefix + "%';");
 }
 
-void MySQLService::Connect()
+Anope::string MySQLService::FromUnixtime(time_t t)
+{
+	return "FROM_UNIXTIME(" + stringify(t) + ")";
+}
+
+MySQLConnection::~MySQLConnection()
+{
+	this->ClearStatements();
+	if (this->sql)
+		mysql_close(this->sql);
+}
+
+void MySQLConnection::Connect()
 {
-	this->sql = mysql_init(this->sql);
+	this->ClearStatements();
+	if (this->sql)
+		mysql_close(this->sql);
+	this->sql = mysql_init(NULL);
 
 	const unsigned int timeout = 1;
 	mysql_options(this->sql, MYSQL_OPT_CONNECT_TIMEOUT, reinterpret_cast<const char *>(&timeout));
 
-	bool connect = mysql_real_connect(this->sql, this->server.c_str(), this->user.c_str(), this->password.c_str(), this->database.c_str(), this->port, NULL, CLIENT_MULTI_RESULTS);
+	bool connect = mysql_real_connect(this->sql, service->server.c_str(), service->user.c_str(), service->password.c_str(), service->database.c_str(), service->port, NULL, CLIENT_MULTI_RESULTS);
 
 	if (!connect)
-		throw SQL::Exception("Unable to connect to MySQL service " + this->name + ": " + mysql_error(this->sql));
+		throw SQL::Exception("Unable to connect to MySQL service " + service->name + ": " + mysql_error(this->sql));
 
-	Log(LOG_DEBUG) << "Successfully connected to MySQL service " << this->name << " at " << this->server << ":" << this->port;
+	Log(LOG_DEBUG) << "Successfully connected to MySQL service " << service->name << " at " << service->server << ":" << service->port;
 }
 
-
-bool MySQLService::CheckConnection()
+bool MySQLConnection::CheckConnection()
 {
 	if (!this->sql || mysql_ping(this->sql))
 	{
@@ -498,14 +781,149 @@ bool MySQLService::CheckConnection()
 	return true;
 }
 
-Anope::string MySQLService::Escape(const Anope::string &query)
+void MySQLConnection::ClearStatements()
+{
+	for (std::map<Anope::string, MYSQL_STMT *>::iterator it = this->statements.begin(); it != this->statements.end(); ++it)
+		mysql_stmt_close(it->second);
+	this->statements.clear();
+}
+
+/* Parse a number which can be bound as an integer */
+static bool ParseNumber(const Anope::string &str, long long &number)
+{
+	size_t i = !str.empty() && str[0] == '-' ? 1 : 0;
+	if (str.length() <= i || str.length() - i > 18)
+		return false;
+
+	number = 0;
+	for (; i < str.length(); ++i)
+	{
+		if (!isdigit(str[i]))
+			return false;
+		number = number * 10 + (str[i] - '0');
+	}
+	if (str[0] == '-')
+		number = -number;
+	return true;
+}
+
+/** Replace the parameters of a query which can be bound to a statement with placeholders, and inline the rest.
+ * Escaped values are bound as strings, and unescaped NULLs and numbers as themselves.
+ */
+static void BindParams(const Query &q, Anope::string &text, std::vector<Param> &params)
+{
+	for (size_t pos = 0, len = q.query.length(); pos < len;)
+	{
+		size_t at = q.query.find('@', pos);
+		size_t end = at == Anope::string::npos ? Anope::string::npos : q.query.find('@', at + 1);
+		if (end == Anope::string::npos)
+		{
+			text += q.query.substr(pos);
+			break;
+		}
+
+		std::map<Anope::string, QueryData>::const_iterator it = q.parameters.find(q.query.substr(at + 1, end - at - 1));
+		if (it == q.parameters.end())
+		{
+			text += q.query.substr(pos, at + 1 - pos);
+			pos = at + 1;
+			continue;
+		}
+
+		text += q.query.substr(pos, at - pos);
+		pos = end + 1;
+
+		const QueryData &qd = it->second;
+		Param p;
+		if (qd.escape)
+		{
+			p.kind = MYSQL_TYPE_STRING;
+			p.data = qd.data;
+		}
+		else if (qd.data.equals_ci("NULL"))
+			p.kind = MYSQL_TYPE_NULL;
+		else if (ParseNumber(qd.data, p.number))
+			p.kind = MYSQL_TYPE_LONGLONG;
+		else
+		{
+			text += qd.data;
+			continue;
+		}
+
+		text += "?";
+		params.push_back(p);
+	}
+}
+
+MYSQL_STMT *MySQLConnection::Prepare(const Anope::string &text, size_t params)
+{
+	std::map<Anope::string, MYSQL_STMT *>::iterator it = this->statements.find(text);
+	if (it != this->statements.end())
+		return it->second;
+
+	MYSQL_STMT *stmt = mysql_stmt_init(this->sql);
+	if (stmt == NULL)
+		return NULL;
+
+	/* The query may have a literal ? somewhere, or be something which can't be prepared */
+	if (mysql_stmt_prepare(stmt, text.c_str(), text.length()) || mysql_stmt_param_count(stmt) != params)
+	{
+		mysql_stmt_close(stmt);
+		return NULL;
+	}
+
+	if (this->statements.size() >= 64)
+		this->ClearStatements();
+	this->statements[text] = stmt;
+	return stmt;
+}
+
+bool MySQLConnection::Execute(MYSQL_STMT *stmt, const Anope::string &text, const std::vector<Param> &params, unsigned int &id, Anope::string &error)
+{
+	std::vector<MYSQL_BIND> binds(params.size());
+	std::vector<unsigned long> lengths(params.size());
+	if (!binds.empty())
+		memset(&binds[0], 0, binds.size() * sizeof(MYSQL_BIND));
+
+	for (unsigned i = 0; i < params.size(); ++i)
+	{
+		const Param &p = params[i];
+		MYSQL_BIND &b = binds[i];
+
+		b.buffer_type = p.kind;
+		if (p.kind == MYSQL_TYPE_STRING)
+		{
+			lengths[i] = p.data.length();
+			b.buffer = const_cast<char *>(p.data.c_str());
+			b.buffer_length = lengths[i];
+			b.length = &lengths[i];
+		}
+		else if (p.kind == MYSQL_TYPE_LONGLONG)
+			b.buffer = const_cast<long long *>(&p.number);
+	}
+
+	if (mysql_stmt_bind_param(stmt, binds.empty() ? NULL : &binds[0]) || mysql_stmt_execute(stmt))
+	{
+		error = mysql_stmt_error(stmt);
+
+		/* The statement may not be valid any more, so prepare it again next time */
+		this->statements.erase(text);
+		mysql_stmt_close(stmt);
+		return false;
+	}
+
+	id = mysql_stmt_insert_id(stmt);
+	return true;
+}
+
+Anope::string MySQLConnection::Escape(const Anope::string &query)
 {
 	std::vector<char> buffer(query.length() * 2 + 1);
 	mysql_real_escape_string(this->sql, &buffer[0], query.c_str(), query.length());
 	return &buffer[0];
 }
 
-Anope::string MySQLService::BuildQuery(const Query &q)
+Anope::string MySQLConnection::BuildQuery(const Query &q)
 {
 	Anope::string real_query = q.query;
 
@@ -515,41 +933,255 @@ Anope::string MySQLService::BuildQuery(const Query &q)
 	return real_query;
 }
 
-Anope::string MySQLService::FromUnixtime(time_t t)
+Result MySQLConnection::RunQuery(const Query &query)
 {
-	return "FROM_UNIXTIME(" + stringify(t) + ")";
+	if (!this->CheckConnection())
+		return MySQLResult(query, query.query, mysql_error(this->sql));
+
+	Anope::string real_query = this->BuildQuery(query);
+
+	/* Writes with parameters are run as prepared statements, which are kept to be run again */
+	const Anope::string &command = FirstWord(query.query);
+	if (!query.parameters.empty() && (command.equals_ci("INSERT") || command.equals_ci("REPLACE") || command.equals_ci("UPDATE") || command.equals_ci("DELETE")))
+	{
+		Anope::string text;
+		std::vector<Param> params;
+		BindParams(query, text, params);
+
+		MYSQL_STMT *stmt = params.empty() ? NULL : this->Prepare(text, params.size());
+		if (stmt != NULL)
+		{
+			unsigned int id = 0;
+			Anope::string error;
+			if (!this->Execute(stmt, text, params, id, error))
+				return MySQLResult(query, real_query, error);
+			return MySQLResult(id, query, real_query, NULL);
+		}
+	}
+
+	if (!mysql_real_query(this->sql, real_query.c_str(), real_query.length()))
+	{
+		MYSQL_RES *res = mysql_store_result(this->sql);
+		unsigned int id = mysql_insert_id(this->sql);
+
+		/* because we enabled CLIENT_MULTI_RESULTS in our options
+		 * a multiple statement or a procedure call can return
+		 * multiple result sets.
+		 * we must process them all before the next query.
+		 */
+
+		while (!mysql_next_result(this->sql))
+			mysql_free_result(mysql_store_result(this->sql));
+
+		return MySQLResult(id, query, real_query, res);
+	}
+	else
+		return MySQLResult(query, real_query, mysql_error(this->sql));
+}
+
+void MySQLConnection::RunInserts(const std::vector<QueryRequest> &batch, std::vector<Result> &results)
+{
+	/* Each insert is INSERT INTO ... VALUES (...) ON DUPLICATE KEY UPDATE ..., which can be
+	 * combined into one if they all have the same columns
+	 */
+	Anope::string text, first, update;
+	std::vector<Param> params;
+	bool combine = batch.size() > 1 && this->CheckConnection();
+
+	for (unsigned i = 0; combine && i < batch.size(); ++i)
+	{
+		Anope::string row;
+		BindParams(batch[i].query, row, params);
+
+		size_t values = row.find(" VALUES ("), end = row.find(") ON DUPLICATE KEY UPDATE ");
+		if (i == 0)
+		{
+			first = row;
+			text = row.substr(0, end + 1);
+			update = row.substr(end + 1);
+			combine = values != Anope::string::npos && end != Anope::string::npos && values < end;
+		}
+		else if (row == first)
+			text += "," + row.substr(values + 8, end + 1 - values - 8);
+		else
+			combine = false;
+	}
+
+	MYSQL_STMT *stmt = combine ? this->Prepare(text + update, params.size()) : NULL;
+	if (stmt != NULL)
+	{
+		unsigned int id;
+		Anope::string error;
+		if (this->Execute(stmt, text + update, params, id, error))
+		{
+			for (unsigned i = 0; i < batch.size(); ++i)
+				results.push_back(MySQLResult(batch[i].insert_id, batch[i].query, this->BuildQuery(batch[i].query), NULL));
+			return;
+		}
+	}
+
+	/* Run them one at a time, so only the rows with errors fail */
+	for (unsigned i = 0; i < batch.size(); ++i)
+		results.push_back(this->RunQuery(batch[i].query));
 }
 
+/** What is queued ahead of a query on a database while looking for one to start
+ */
+struct Ahead
+{
+	/* Queries without a key other than SELECTs */
+	bool writes;
+	/* SELECTs without a key */
+	bool reads;
+	/* Keys of queries */
+	std::set<Anope::string> keys;
+
+	Ahead() : writes(false), reads(false) { }
+
+	void Add(const QueryRequest &r)
+	{
+		if (!r.query.key.empty())
+			keys.insert(r.query.key);
+		else if (r.read)
+			reads = true;
+		else
+			writes = true;
+	}
+
+	/* Whether a query can start now, with this ahead of it */
+	bool CanStart(const QueryRequest &r) const
+	{
+		const MySQLService *s = r.service;
+
+		if (!r.query.key.empty())
+			return !writes && !reads && !keys.count(r.query.key) && !s->writing && !s->reading && !s->keys.count(r.query.key);
+		else if (r.read)
+			return !writes && keys.empty() && !s->writing && s->keys.empty();
+		else
+			return !writes && !reads && keys.empty() && !s->writing && !s->reading && s->keys.empty();
+	}
+};
+
 void DispatcherThread::Run()
 {
-	this->Lock();
+	me->QueueLock.Lock();
 
 	while (!this->GetExitState())
 	{
-		if (!me->QueryRequests.empty())
+		/* Find the first query which can run now without overtaking one it has to stay in order with */
+		std::map<MySQLService *, Ahead> ahead;
+		std::deque<QueryRequest>::iterator it = me->QueryRequests.begin();
+		for (; it != me->QueryRequests.end(); ++it)
+		{
+			Ahead &a = ahead[it->service];
+			if (a.CanStart(*it))
+				break;
+			a.Add(*it);
+		}
+
+		if (it == me->QueryRequests.end())
 		{
-			QueryRequest &r = me->QueryRequests.front();
-			this->Unlock();
+			me->QueueLock.Wait();
+			continue;
+		}
+
+		MySQLService *service = it->service;
+		Ahead &a = ahead[service];
+		std::vector<QueryRequest> batch;
 
-			Result sresult = r.service->RunQuery(r.query);
+		batch.push_back(*it);
+		it = me->QueryRequests.erase(it);
 
-			this->Lock();
-			if (!me->QueryRequests.empty() && me->QueryRequests.front().query == r.query)
+		/* Take inserts into the same table queued after this one too, which can be run as one */
+		if (batch[0].insert_id)
+		{
+			a.Add(batch[0]);
+
+			while (it != me->QueryRequests.end() && batch.size() < 50 && !a.writes && !a.reads)
 			{
-				if (r.sqlinterface)
-					me->FinishedRequests.push_back(QueryResult(r.sqlinterface, sresult));
-				me->QueryRequests.pop_front();
+				if (it->service == service && it->insert_id && it->query.query == batch[0].query.query && !a.keys.count(it->query.key) && !service->keys.count(it->query.key))
+				{
+					a.Add(*it);
+					batch.push_back(*it);
+					it = me->QueryRequests.erase(it);
+				}
+				else
+				{
+					if (it->service == service)
+						a.Add(*it);
+					++it;
+				}
 			}
 		}
+
+		const QueryRequest &r = batch[0];
+		if (!r.query.key.empty())
+			for (unsigned i = 0; i < batch.size(); ++i)
+				service->keys.insert(batch[i].query.key);
+		else if (r.read)
+			++service->reading;
 		else
+			service->writing = true;
+		service->queued -= batch.size();
+
+		std::vector<std::list<Interface *>::iterator> running;
+		for (unsigned i = 0; i < batch.size(); ++i)
+			running.push_back(me->Running.insert(me->Running.end(), batch[i].sqlinterface));
+
+		MySQLConnection *conn = service->GetConnection();
+
+		/* Another thread may be able to run what is left */
+		if (!me->QueryRequests.empty())
+			me->QueueLock.Wakeup();
+		me->QueueLock.Unlock();
+
+		struct timeval start;
+		gettimeofday(&start, NULL);
+
+		std::vector<Result> results;
+		if (batch.size() > 1)
+			conn->RunInserts(batch, results);
+		else
+			results.push_back(conn->RunQuery(r.query));
+
+		long elapsed = Elapsed(start);
+
+		me->QueueLock.Lock();
+
+		service->ReturnConnection(conn);
+		service->times.Add(r.read, elapsed);
+		if (batch.size() > 1)
+		{
+			++service->times.inserts;
+			service->times.inserted_rows += batch.size();
+		}
+
+		if (!r.query.key.empty())
+			for (unsigned i = 0; i < batch.size(); ++i)
+				service->keys.erase(batch[i].query.key);
+		else if (r.read)
+			--service->reading;
+		else
+			service->writing = false;
+
+		for (unsigned i = 0; i < batch.size(); ++i)
 		{
-			if (!me->FinishedRequests.empty())
-				me->Notify();
-			this->Wait();
+			Interface *iface = *running[i];
+			me->Running.erase(running[i]);
+			if (iface)
+				me->FinishedRequests.push_back(QueryResult(iface, results[i]));
 		}
+		me->Notify();
+
+		/* Let the main thread know, if it is waiting for these to finish */
+		me->QueueLock.Unlock();
+		me->FinishedLock.Lock();
+		me->FinishedLock.Wakeup();
+		me->FinishedLock.Unlock();
+		me->QueueLock.Lock();
 	}
 
-	this->Unlock();
+	me->QueueLock.Unlock();
 }
 
 MODULE_INIT(ModuleSQL)
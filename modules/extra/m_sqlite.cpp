@@ -12,11 +12,54 @@
 #include "module.h"
 #include "modules/sql.h"
 #include <sqlite3.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 using namespace SQL;
 
 /* SQLite3 API, based from InspIRCd */
 
+/** Threaded SQLite API
+ *
+ * Queries given to Run() are queued and executed by a pool of threads, and the results are
+ * sent back to the main thread through our Pipe, like m_mysql. Each database has one
+ * connection which all writes go through, and opens more read only connections as needed
+ * so reads can run at the same time as each other. Queries on a database are started in
+ * the order they were queued, reads only run while nothing is writing to the database and
+ * writes only run on their own. Consecutive writes to a database are run together in one
+ * transaction.
+ */
+
+class SQLiteService;
+
+/** A query request
+ */
+struct QueryRequest
+{
+	/* The database */
+	SQLiteService *service;
+	/* The interface to use once we have the result to send the data back */
+	Interface *sqlinterface;
+	/* The actual query */
+	Query query;
+	/* Whether this only reads from the database */
+	bool read;
+
+	QueryRequest(SQLiteService *s, Interface *i, const Query &q);
+};
+
+/** A query result */
+struct QueryResult
+{
+	/* The interface to send the data back on */
+	Interface *sqlinterface;
+	/* The result */
+	Result result;
+
+	QueryResult(Interface *i, const Result &r) : sqlinterface(i), result(r) { }
+};
+
 /** A SQLite result
  */
 class SQLiteResult : public Result
@@ -36,6 +79,109 @@ class SQLiteResult : public Result
 	}
 };
 
+/** How long queries on a database take, in buckets of <1ms, <10ms, <100ms, <1s and longer
+ */
+struct QueryTimes
+{
+	unsigned long reads[5], writes[5];
+	unsigned long transactions;
+
+	QueryTimes()
+	{
+		this->Clear();
+	}
+
+	void Clear()
+	{
+		for (unsigned i = 0; i < 5; ++i)
+			reads[i] = writes[i] = 0;
+		transactions = 0;
+	}
+
+	bool Empty() const
+	{
+		for (unsigned i = 0; i < 5; ++i)
+			if (reads[i] || writes[i])
+				return false;
+		return true;
+	}
+
+	void Add(bool read, long usec)
+	{
+		unsigned bucket = 0;
+		for (long limit = 1000; bucket < 4 && usec >= limit; limit *= 10)
+			++bucket;
+		++(read ? reads : writes)[bucket];
+	}
+
+	static Anope::string Format(const unsigned long (&times)[5])
+	{
+		unsigned long total = 0;
+		for (unsigned i = 0; i < 5; ++i)
+			total += times[i];
+		return stringify(total) + " (" + stringify(times[0]) + " <1ms, " + stringify(times[1]) + " <10ms, " + stringify(times[2]) + " <100ms, "
+			+ stringify(times[3]) + " <1s, " + stringify(times[4]) + " slower)";
+	}
+};
+
+/** A connection to a SQLite database, only used by one thread at a time
+ */
+class SQLiteConnection
+{
+	sqlite3 *sql;
+	/* Statements which take parameters, by their text */
+	std::map<Anope::string, sqlite3_stmt *> statements;
+
+ public:
+	SQLiteConnection(const Anope::string &database, bool readonly) : sql(NULL)
+	{
+		int db = sqlite3_open_v2(database.c_str(), &this->sql, readonly ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE), 0);
+		if (db != SQLITE_OK)
+		{
+			Anope::string exstr = "Unable to open SQLite database " + database;
+			if (this->sql)
+			{
+				exstr += ": ";
+				exstr += sqlite3_errmsg(this->sql);
+				sqlite3_close(this->sql);
+			}
+			throw SQL::Exception(exstr);
+		}
+
+		sqlite3_busy_timeout(this->sql, 1000);
+
+		/* Lets readers carry on while the database is being written to */
+		if (!readonly)
+			sqlite3_exec(this->sql, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+	}
+
+	~SQLiteConnection()
+	{
+		this->ClearStatements();
+		sqlite3_interrupt(this->sql);
+		sqlite3_close(this->sql);
+	}
+
+	void ClearStatements()
+	{
+		for (std::map<Anope::string, sqlite3_stmt *>::iterator it = this->statements.begin(); it != this->statements.end(); ++it)
+			sqlite3_finalize(it->second);
+		this->statements.clear();
+	}
+
+	bool Exec(const char *query)
+	{
+		return sqlite3_exec(this->sql, query, NULL, NULL, NULL) == SQLITE_OK;
+	}
+
+	bool InTransaction()
+	{
+		return !sqlite3_get_autocommit(this->sql);
+	}
+
+	Result RunQuery(SQLiteService *service, const Query &query);
+};
+
 /** A SQLite database, there can be multiple
  */
 class SQLiteService : public Provider
@@ -44,15 +190,57 @@ class SQLiteService : public Provider
 
 	Anope::string database;
 
-	sqlite3 *sql;
+	/* Everything below is locked by the module's QueueLock */
 
-	Anope::string Escape(const Anope::string &query);
+	/* The connection writes go through */
+	SQLiteConnection *writer;
+	/* Read only connections not in use */
+	std::vector<SQLiteConnection *> readers;
 
  public:
+	/* Queries queued and not yet started */
+	unsigned queued;
+	/* Reads running, and whether writes are running */
+	unsigned reading;
+	bool writing;
+
+	QueryTimes times;
+
 	SQLiteService(Module *o, const Anope::string &n, const Anope::string &d);
 
 	~SQLiteService();
 
+	/* Whether nothing is queued or running on this database */
+	bool Idle() const
+	{
+		return !queued && !reading && !writing;
+	}
+
+	SQLiteConnection *GetWriter()
+	{
+		return this->writer;
+	}
+
+	/* Take a read only connection, or NULL if a new one needs to be opened */
+	SQLiteConnection *GetReader()
+	{
+		if (this->readers.empty())
+			return NULL;
+		SQLiteConnection *c = this->readers.back();
+		this->readers.pop_back();
+		return c;
+	}
+
+	void ReturnReader(SQLiteConnection *c)
+	{
+		this->readers.push_back(c);
+	}
+
+	const Anope::string &GetDatabase() const
+	{
+		return this->database;
+	}
+
 	void Run(Interface *i, const Query &query) anope_override;
 
 	Result RunQuery(const Query &query);
@@ -63,27 +251,136 @@ class SQLiteService : public Provider
 
 	Query GetTables(const Anope::string &prefix);
 
+	Anope::string Escape(const Anope::string &query);
+
 	Anope::string BuildQuery(const Query &q);
 
 	Anope::string FromUnixtime(time_t);
 };
 
-class ModuleSQLite : public Module
+/** A thread used to execute queries
+ */
+class DispatcherThread : public Thread
+{
+	/* Run queued writes for a database together in one transaction */
+	void RunWrites(SQLiteConnection *conn, SQLiteService *service, const std::vector<QueryRequest> &batch, std::vector<Result> &results, std::vector<long> &times);
+
+ public:
+	void Run() anope_override;
+};
+
+class ModuleSQLite;
+static ModuleSQLite *me;
+class ModuleSQLite : public Module, public Pipe
 {
 	/* SQL connections */
 	std::map<Anope::string, SQLiteService *> SQLiteServices;
+
+	/* The threads used to execute queries */
+	std::vector<DispatcherThread *> threads;
+
+	/* Logs how long queries have been taking */
+	class StatsTimer : public Timer
+	{
+	 public:
+		StatsTimer(Module *o) : Timer(o, 900, Anope::CurTime, true) { }
+
+		void Tick(time_t) anope_override
+		{
+			me->LogStats();
+		}
+	} stats_timer;
+
+	void StartThreads(unsigned count)
+	{
+		for (unsigned i = threads.size(); i < count; ++i)
+		{
+			DispatcherThread *t = new DispatcherThread();
+			t->Start();
+			threads.push_back(t);
+		}
+	}
+
+	void StopThreads()
+	{
+		/* Set the exit state while holding the lock so a thread can't miss its wakeup */
+		this->QueueLock.Lock();
+		for (unsigned i = 0; i < threads.size(); ++i)
+			threads[i]->SetExitState();
+		for (unsigned i = 0; i < threads.size(); ++i)
+			this->QueueLock.Wakeup();
+		this->QueueLock.Unlock();
+
+		for (unsigned i = 0; i < threads.size(); ++i)
+		{
+			threads[i]->Join();
+			delete threads[i];
+		}
+		threads.clear();
+	}
+
  public:
-	ModuleSQLite(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR)
+	/* Locks the queues and the state of each database, and is signalled when queries are queued */
+	Condition QueueLock;
+	/* Signalled when a thread has finished running queries */
+	Condition FinishedLock;
+
+	/* Pending query requests */
+	std::deque<QueryRequest> QueryRequests;
+	/* Pending finished requests with results */
+	std::deque<QueryResult> FinishedRequests;
+	/* Queries being run by the threads, which are NULLed if their interface goes away */
+	std::list<Interface *> Running;
+
+	ModuleSQLite(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, EXTRA | VENDOR), stats_timer(this)
 	{
+		me = this;
 	}
 
 	~ModuleSQLite()
 	{
+		StopThreads();
+
 		for (std::map<Anope::string, SQLiteService *>::iterator it = this->SQLiteServices.begin(); it != this->SQLiteServices.end(); ++it)
 			delete it->second;
 		SQLiteServices.clear();
 	}
 
+	/** Wait until no query is running on a database, and optionally until none are queued either.
+	 * The QueueLock must not be held.
+	 */
+	void WaitFor(SQLiteService *service, bool include_queued)
+	{
+		this->FinishedLock.Lock();
+		for (;;)
+		{
+			this->QueueLock.Lock();
+			bool done = include_queued ? service->Idle() : (!service->reading && !service->writing);
+			this->QueueLock.Unlock();
+
+			if (done)
+				break;
+			this->FinishedLock.Wait();
+		}
+		this->FinishedLock.Unlock();
+	}
+
+	void LogStats()
+	{
+		for (std::map<Anope::string, SQLiteService *>::iterator it = this->SQLiteServices.begin(); it != this->SQLiteServices.end(); ++it)
+		{
+			SQLiteService *s = it->second;
+
+			this->QueueLock.Lock();
+			QueryTimes times = s->times;
+			s->times.Clear();
+			this->QueueLock.Unlock();
+
+			if (!times.Empty())
+				Log(LOG_DEBUG) << "SQLite: " << it->first << ": reads: " << QueryTimes::Format(times.reads) << ", writes: " << QueryTimes::Format(times.writes) << " in " << times.transactions << " transactions";
+		}
+	}
+
 	void OnReload(Configuration::Conf *conf) anope_override
 	{
 		Configuration::Block *config = conf->GetModule(this);
@@ -130,48 +427,192 @@ class ModuleSQLite : public Module
 				}
 			}
 		}
+
+		unsigned count = config->Get<unsigned>("threads", "2");
+		if (!count)
+			count = 1;
+		if (count < threads.size())
+			StopThreads();
+		StartThreads(count);
+	}
+
+	void OnModuleUnload(User *, Module *m) anope_override
+	{
+		this->QueueLock.Lock();
+
+		for (unsigned i = this->QueryRequests.size(); i > 0; --i)
+		{
+			QueryRequest &r = this->QueryRequests[i - 1];
+
+			if (r.sqlinterface && r.sqlinterface->owner == m)
+			{
+				--r.service->queued;
+				this->QueryRequests.erase(this->QueryRequests.begin() + i - 1);
+			}
+		}
+
+		for (std::list<Interface *>::iterator it = this->Running.begin(); it != this->Running.end(); ++it)
+			if (*it && (*it)->owner == m)
+				*it = NULL;
+
+		for (unsigned i = this->FinishedRequests.size(); i > 0; --i)
+		{
+			QueryResult &r = this->FinishedRequests[i - 1];
+
+			if (r.sqlinterface && r.sqlinterface->owner == m)
+				this->FinishedRequests.erase(this->FinishedRequests.begin() + i - 1);
+		}
+
+		this->QueueLock.Unlock();
+
+		this->OnNotify();
+	}
+
+	void OnNotify() anope_override
+	{
+		this->QueueLock.Lock();
+		std::deque<QueryResult> finishedRequests;
+		finishedRequests.swap(this->FinishedRequests);
+		this->QueueLock.Unlock();
+
+		for (std::deque<QueryResult>::const_iterator it = finishedRequests.begin(), it_end = finishedRequests.end(); it != it_end; ++it)
+		{
+			const QueryResult &qr = *it;
+
+			if (qr.result.GetError().empty())
+				qr.sqlinterface->OnResult(qr.result);
+			else
+				qr.sqlinterface->OnError(qr.result);
+		}
 	}
 };
 
+QueryRequest::QueryRequest(SQLiteService *s, Interface *i, const Query &q) : service(s), sqlinterface(i), query(q)
+{
+	size_t start = q.query.find_first_not_of(" \t\r\n(");
+	read = start != Anope::string::npos && q.query.substr(start, 6).equals_ci("SELECT");
+}
+
 SQLiteService::SQLiteService(Module *o, const Anope::string &n, const Anope::string &d)
-: Provider(o, n), database(d), sql(NULL)
+: Provider(o, n), database(d), writer(NULL), queued(0), reading(0), writing(false)
 {
-	int db = sqlite3_open_v2(database.c_str(), &this->sql, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0);
-	if (db != SQLITE_OK)
+	this->writer = new SQLiteConnection(database, false);
+}
+
+SQLiteService::~SQLiteService()
+{
+	me->QueueLock.Lock();
+	for (unsigned i = me->QueryRequests.size(); i > 0; --i)
 	{
-		Anope::string exstr = "Unable to open SQLite database " + database;
-		if (this->sql)
+		QueryRequest &r = me->QueryRequests[i - 1];
+
+		if (r.service == this)
 		{
-			exstr += ": ";
-			exstr += sqlite3_errmsg(this->sql);
-			sqlite3_close(this->sql);
+			if (r.sqlinterface)
+				me->FinishedRequests.push_back(QueryResult(r.sqlinterface, Result(0, r.query, "", "SQL Interface is going away")));
+			me->QueryRequests.erase(me->QueryRequests.begin() + i - 1);
 		}
-		throw SQL::Exception(exstr);
 	}
+	this->queued = 0;
+	me->QueueLock.Unlock();
+
+	me->WaitFor(this, false);
+	me->OnNotify();
+
+	delete this->writer;
+	for (unsigned i = 0; i < this->readers.size(); ++i)
+		delete this->readers[i];
 }
 
-SQLiteService::~SQLiteService()
+void SQLiteService::Run(Interface *i, const Query &query)
 {
-	sqlite3_interrupt(this->sql);
-	sqlite3_close(this->sql);
+	me->QueueLock.Lock();
+	me->QueryRequests.push_back(QueryRequest(this, i, query));
+	++this->queued;
+	me->QueueLock.Unlock();
+	me->QueueLock.Wakeup();
 }
 
-void SQLiteService::Run(Interface *i, const Query &query)
+static long Elapsed(const struct timeval &start)
 {
-	Result res = this->RunQuery(query);
-	if (!res.GetError().empty())
-		i->OnError(res);
-	else
-		i->OnResult(res);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec);
 }
 
 Result SQLiteService::RunQuery(const Query &query)
 {
-	Anope::string real_query = this->BuildQuery(query);
-	sqlite3_stmt *stmt;
-	int err = sqlite3_prepare_v2(this->sql, real_query.c_str(), real_query.length(), &stmt, NULL);
-	if (err != SQLITE_OK)
-		return SQLiteResult(query, real_query, sqlite3_errmsg(this->sql));
+	/* Queries are run in the order they are given, so let everything before this finish first */
+	me->WaitFor(this, true);
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	Result r = this->writer->RunQuery(this, query);
+
+	me->QueueLock.Lock();
+	this->times.Add(false, Elapsed(start));
+	++this->times.transactions;
+	me->QueueLock.Unlock();
+
+	return r;
+}
+
+Result SQLiteConnection::RunQuery(SQLiteService *service, const Query &query)
+{
+	/* Escaped values are bound to the statement, so statements with them can be reused */
+	Anope::string text;
+	std::vector<const Anope::string *> values;
+
+	for (size_t pos = 0, len = query.query.length(); pos < len;)
+	{
+		size_t at = query.query.find('@', pos);
+		size_t end = at == Anope::string::npos ? Anope::string::npos : query.query.find('@', at + 1);
+		if (end == Anope::string::npos)
+		{
+			text += query.query.substr(pos);
+			break;
+		}
+
+		std::map<Anope::string, QueryData>::const_iterator it = query.parameters.find(query.query.substr(at + 1, end - at - 1));
+		if (it == query.parameters.end())
+		{
+			text += query.query.substr(pos, at + 1 - pos);
+			pos = at + 1;
+			continue;
+		}
+
+		text += query.query.substr(pos, at - pos);
+		if (it->second.escape)
+		{
+			text += "?";
+			values.push_back(&it->second.data);
+		}
+		else
+			text += it->second.data;
+		pos = end + 1;
+	}
+
+	sqlite3_stmt *stmt = NULL;
+	std::map<Anope::string, sqlite3_stmt *>::iterator sit = this->statements.find(text);
+	if (sit != this->statements.end())
+		stmt = sit->second;
+	else
+	{
+		int err = sqlite3_prepare_v2(this->sql, text.c_str(), text.length(), &stmt, NULL);
+		if (err != SQLITE_OK)
+			return SQLiteResult(query, service->BuildQuery(query), sqlite3_errmsg(this->sql));
+
+		if (!values.empty())
+		{
+			if (this->statements.size() >= 128)
+				this->ClearStatements();
+			this->statements[text] = stmt;
+		}
+	}
+
+	for (unsigned i = 0; i < values.size(); ++i)
+		sqlite3_bind_text(stmt, i + 1, values[i]->c_str(), values[i]->length(), SQLITE_TRANSIENT);
 
 	std::vector<Anope::string> columns;
 	int cols = sqlite3_column_count(stmt);
@@ -179,8 +620,9 @@ Result SQLiteService::RunQuery(const Query &query)
 	for (int i = 0; i < cols; ++i)
 		columns[i] = sqlite3_column_name(stmt, i);
 
-	SQLiteResult result(0, query, real_query);
+	SQLiteResult result(0, query, service->BuildQuery(query));
 
+	int err;
 	while ((err = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
 		std::map<Anope::string, Anope::string> items;
@@ -195,10 +637,20 @@ Result SQLiteService::RunQuery(const Query &query)
 
 	result.id = sqlite3_last_insert_rowid(this->sql);
 
-	sqlite3_finalize(stmt);
-
+	Anope::string error;
 	if (err != SQLITE_DONE)
-		return SQLiteResult(query, real_query, sqlite3_errmsg(this->sql));
+		error = sqlite3_errmsg(this->sql);
+
+	if (values.empty())
+		sqlite3_finalize(stmt);
+	else
+	{
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+	}
+
+	if (!error.empty())
+		return SQLiteResult(query, result.finished_query, error);
 
 	return result;
 }
@@ -331,4 +783,156 @@ Anope::string SQLiteService::FromUnixtime(time_t t)
 	return "datetime('" + stringify(t) + "', 'unixepoch')";
 }
 
+void DispatcherThread::RunWrites(SQLiteConnection *conn, SQLiteService *service, const std::vector<QueryRequest> &batch, std::vector<Result> &results, std::vector<long> &times)
+{
+	bool transaction = batch.size() > 1 && conn->Exec("BEGIN");
+
+	for (unsigned i = 0; i < batch.size(); ++i)
+	{
+		struct timeval start;
+		gettimeofday(&start, NULL);
+		results.push_back(conn->RunQuery(service, batch[i].query));
+		times.push_back(Elapsed(start));
+	}
+
+	if (!transaction || (conn->InTransaction() && conn->Exec("COMMIT")))
+		return;
+
+	/* Some errors roll back the whole transaction, so run the queries again on their own */
+	if (conn->InTransaction())
+		conn->Exec("ROLLBACK");
+
+	results.clear();
+	times.clear();
+	for (unsigned i = 0; i < batch.size(); ++i)
+	{
+		struct timeval start;
+		gettimeofday(&start, NULL);
+		results.push_back(conn->RunQuery(service, batch[i].query));
+		times.push_back(Elapsed(start));
+	}
+}
+
+void DispatcherThread::Run()
+{
+	me->QueueLock.Lock();
+
+	while (!this->GetExitState())
+	{
+		/* Find the first query which can run now, without starting any query on a database before one queued ahead of it */
+		std::set<SQLiteService *> blocked;
+		std::deque<QueryRequest>::iterator it = me->QueryRequests.begin();
+		for (; it != me->QueryRequests.end(); ++it)
+		{
+			SQLiteService *s = it->service;
+			if (blocked.count(s))
+				continue;
+			if (it->read ? !s->writing : (!s->writing && !s->reading))
+				break;
+			blocked.insert(s);
+		}
+
+		if (it == me->QueryRequests.end())
+		{
+			me->QueueLock.Wait();
+			continue;
+		}
+
+		SQLiteService *service = it->service;
+		bool read = it->read;
+		std::vector<QueryRequest> batch;
+
+		if (read)
+		{
+			batch.push_back(*it);
+			me->QueryRequests.erase(it);
+			++service->reading;
+		}
+		else
+		{
+			/* Take the writes queued after this one too, up until the next read from the database */
+			while (it != me->QueryRequests.end() && batch.size() < 100)
+			{
+				if (it->service != service)
+					++it;
+				else if (it->read)
+					break;
+				else
+				{
+					batch.push_back(*it);
+					it = me->QueryRequests.erase(it);
+				}
+			}
+			service->writing = true;
+		}
+		service->queued -= batch.size();
+
+		std::vector<std::list<Interface *>::iterator> running;
+		for (unsigned i = 0; i < batch.size(); ++i)
+			running.push_back(me->Running.insert(me->Running.end(), batch[i].sqlinterface));
+
+		SQLiteConnection *conn = read ? service->GetReader() : service->GetWriter();
+
+		/* Another thread may be able to run what is left */
+		if (!me->QueryRequests.empty())
+			me->QueueLock.Wakeup();
+		me->QueueLock.Unlock();
+
+		std::vector<Result> results;
+		std::vector<long> times;
+		if (read)
+		{
+			struct timeval start;
+			gettimeofday(&start, NULL);
+			try
+			{
+				if (conn == NULL)
+					conn = new SQLiteConnection(service->GetDatabase(), true);
+				results.push_back(conn->RunQuery(service, batch[0].query));
+			}
+			catch (const SQL::Exception &ex)
+			{
+				results.push_back(SQLiteResult(batch[0].query, "", ex.GetReason()));
+			}
+			times.push_back(Elapsed(start));
+		}
+		else
+			this->RunWrites(conn, service, batch, results, times);
+
+		me->QueueLock.Lock();
+
+		for (unsigned i = 0; i < times.size(); ++i)
+			service->times.Add(read, times[i]);
+		if (read)
+		{
+			if (conn != NULL)
+				service->ReturnReader(conn);
+			--service->reading;
+		}
+		else
+		{
+			service->writing = false;
+			++service->times.transactions;
+		}
+
+		for (unsigned i = 0; i < batch.size(); ++i)
+		{
+			Interface *iface = *running[i];
+			me->Running.erase(running[i]);
+			if (iface)
+				me->FinishedRequests.push_back(QueryResult(iface, results[i]));
+		}
+		me->Notify();
+
+		/* Let the main thread know, if it is waiting for these to finish */
+		me->QueueLock.Unlock();
+		me->FinishedLock.Lock();
+		me->FinishedLock.Wakeup();
+		me->FinishedLock.Unlock();
+		me->QueueLock.Lock();
+	}
+
+	me->QueueLock.Unlock();
+}
+
 MODULE_INIT(ModuleSQLite)
@@ -26,6 +26,8 @@ static Anope::string GetStatusFromCode(HTTPError err)
 			return "200 OK";
 		case HTTP_FOUND:
 			return "302 Found";
+		case HTTP_NOT_MODIFIED:
+			return "304 Not Modified";
 		case HTTP_BAD_REQUEST:
 			return "400 Bad Request";
 		case HTTP_PAGE_NOT_FOUND:
@@ -55,11 +57,118 @@ class MyHTTPClient : public HTTPClient
 		ACTION_POST
 	} action;
 
-	void Serve()
+	/* Data read from the client, requests are parsed from it starting at read_pos */
+	Anope::string read_buffer;
+	size_t read_pos;
+	/* Whether the connection is kept open after replying to the current request */
+	bool keepalive;
+	/* Whether the current request has been read but not yet replied to */
+	bool pending;
+	/* Whether the connection is closed once everything has been written */
+	bool closing;
+	/* Whether we are in ProcessRequests */
+	bool processing;
+
+	/* How much unparsed input or unsent output we allow before we stop handling
+	 * pipelined requests, and reading from the client, until it catches up
+	 */
+	static const size_t max_buffered = 65536;
+
+	/* Clear the state of the last request to start reading the next one */
+	void Reset()
+	{
+		this->message = HTTPMessage();
+		this->header_done = this->served = false;
+		this->page_name.clear();
+		this->page = NULL;
+		this->ip = this->clientaddr.addr();
+		this->content_length = 0;
+		this->action = ACTION_NONE;
+		this->keepalive = false;
+	}
+
+	void BadRequest(const Anope::string &msg)
+	{
+		this->keepalive = false;
+		this->pending = true;
+		this->SendError(HTTP_BAD_REQUEST, msg);
+	}
+
+	/* Parse what we can of the next request, returns true once it has all been read */
+	bool ParseRequest()
 	{
 		if (this->served)
+			this->Reset();
+
+		while (!this->header_done)
+		{
+			size_t nl = this->read_buffer.find('\n', this->read_pos);
+			if (nl == Anope::string::npos)
+			{
+				if (this->read_buffer.length() - this->read_pos > max_buffered)
+					this->BadRequest("Request header too large");
+				return false;
+			}
+
+			Anope::string token = this->read_buffer.substr(this->read_pos, nl - this->read_pos).trim();
+			this->read_pos = nl + 1;
+
+			if (!token.empty())
+				this->Read(token);
+			/* Blank lines before a request line are ignored */
+			else if (this->action != ACTION_NONE)
+				this->header_done = true;
+
+			if (this->closing)
+				return false;
+		}
+
+		if (this->read_buffer.length() - this->read_pos < this->content_length)
+			return false;
+
+		this->message.content = this->read_buffer.substr(this->read_pos, this->content_length);
+		this->read_pos += this->content_length;
+
+		sepstream sep(this->message.content, '&');
+		Anope::string token;
+
+		while (sep.GetToken(token))
+		{
+			size_t sz = token.find('=');
+			if (sz == Anope::string::npos || !sz || sz + 1 >= token.length())
+				continue;
+			this->message.post_data[token.substr(0, sz)] = HTTPUtils::URLDecode(token.substr(sz + 1));
+			Log(LOG_DEBUG_2) << "HTTP POST from " << this->clientaddr.addr() << ": " << token.substr(0, sz) << ": " << this->message.post_data[token.substr(0, sz)];
+		}
+
+		return true;
+	}
+
+	/* Serve every complete request which has been read, one at a time, in order */
+	void ProcessRequests()
+	{
+		if (this->processing)
 			return;
-		this->served = true;
+		this->processing = true;
+
+		while (!this->pending && !this->closing && this->write_buffer.length() < max_buffered && this->ParseRequest())
+			this->Serve();
+
+		if (this->read_pos)
+		{
+			this->read_buffer.erase(0, this->read_pos);
+			this->read_pos = 0;
+		}
+
+		bool blocked = this->pending || this->write_buffer.length() >= max_buffered;
+		SocketEngine::Change(this, !blocked || this->read_buffer.length() < max_buffered, SF_READABLE);
+
+		this->processing = false;
+	}
+
+	void Serve()
+	{
+		this->served = this->pending = true;
 
 		if (!this->page)
 		{
@@ -87,14 +196,15 @@ class MyHTTPClient : public HTTPClient
 		HTTPReply reply;
 		reply.content_type = this->page->GetContentType();
 
-		if (this->page->OnRequest(this->provider, this->page_name, this, this->message, reply))
+		/* The page may have already replied, or may reply later */
+		if (this->page->OnRequest(this->provider, this->page_name, this, this->message, reply) && this->pending)
 			this->SendReply(&reply);
 	}
 
  public:
-	time_t created;
+	time_t last_activity;
 
-	MyHTTPClient(HTTPProvider *l, int f, const sockaddrs &a) : Socket(f, l->IsIPv6()), HTTPClient(l, f, a), provider(l), header_done(false), served(false), ip(a.addr()), content_length(0), action(ACTION_NONE), created(Anope::CurTime)
+	MyHTTPClient(HTTPProvider *l, int f, const sockaddrs &a) : Socket(f, l->IsIPv6()), HTTPClient(l, f, a), provider(l), header_done(false), served(false), ip(a.addr()), content_length(0), action(ACTION_NONE), read_pos(0), keepalive(false), pending(false), closing(false), processing(false), last_activity(Anope::CurTime)
 	{
 		Log(LOG_DEBUG, "httpd") << "Accepted connection " << f << " from " << a.addr();
 	}
@@ -104,10 +214,21 @@ class MyHTTPClient : public HTTPClient
 		Log(LOG_DEBUG, "httpd") << "Closing connection " << this->GetFD() << " from " << this->ip;
 	}
 
-	/* Close connection once all data is written */
+	/* Close connection once all data is written if it is not being kept alive,
+	 * otherwise go on to any requests which were held back while writing
+	 */
 	bool ProcessWrite() anope_override
 	{
-		return !BinarySocket::ProcessWrite() || this->write_buffer.empty() ? false : true;
+		if (!BinarySocket::ProcessWrite())
+			return false;
+
+		if (this->write_buffer.empty() && this->closing)
+			return false;
+
+		if (!this->closing && this->write_buffer.length() < max_buffered)
+			this->ProcessRequests();
+
+		return true;
 	}
 
 	const Anope::string GetIP() anope_override
@@ -117,39 +238,9 @@ class MyHTTPClient : public HTTPClient
 
 	bool Read(const char *buffer, size_t l) anope_override
 	{
-		message.content.append(buffer, l);
-
-		for (size_t nl; !this->header_done && (nl = message.content.find('\n')) != Anope::string::npos;)
-		{
-			Anope::string token = message.content.substr(0, nl).trim();
-			message.content = message.content.substr(nl + 1);
-
-			if (token.empty())
-				this->header_done = true;
-			else
-				this->Read(token);
-		}
-
-		if (!this->header_done)
-			return true;
-
-		if (this->message.content.length() >= this->content_length)
-		{
-			sepstream sep(this->message.content, '&');
-			Anope::string token;
-
-			while (sep.GetToken(token))
-			{
-				size_t sz = token.find('=');
-				if (sz == Anope::string::npos || !sz || sz + 1 >= token.length())
-					continue;
-				this->message.post_data[token.substr(0, sz)] = HTTPUtils::URLDecode(token.substr(sz + 1));
-				Log(LOG_DEBUG_2) << "HTTP POST from " << this->clientaddr.addr() << ": " << token.substr(0, sz) << ": " << this->message.post_data[token.substr(0, sz)];
-			}
-
-			this->Serve();
-		}
-
+		this->last_activity = Anope::CurTime;
+		this->read_buffer.append(buffer, l);
+		this->ProcessRequests();
 		return true;
 	}
 
@@ -164,13 +255,13 @@ class MyHTTPClient : public HTTPClient
 
 			if (params.empty() || (params[0] != "GET" && params[0] != "POST"))
 			{
-				this->SendError(HTTP_BAD_REQUEST, "Unknown operation");
+				this->BadRequest("Unknown operation");
 				return true;
 			}
 
 			if (params.size() != 3)
 			{
-				this->SendError(HTTP_BAD_REQUEST, "Invalid parameters");
+				this->BadRequest("Invalid parameters");
 				return true;
 			}
 
@@ -179,6 +270,9 @@ class MyHTTPClient : public HTTPClient
 			else if (params[0] == "POST")
 				this->action = ACTION_POST;
 
+			/* HTTP/1.1 connections are persistent unless either side says otherwise */
+			this->keepalive = params[2] == "HTTP/1.1";
+
 			Anope::string targ = params[1];
 			size_t q = targ.find('?');
 			if (q != Anope::string::npos)
@@ -227,7 +321,18 @@ class MyHTTPClient : public HTTPClient
 		{
 			size_t sz = buf.find(':');
 			if (sz + 2 < buf.length())
+			{
 				this->message.headers[buf.substr(0, sz)] = buf.substr(sz + 2);
+
+				if (buf.substr(0, sz).equals_ci("Connection"))
+				{
+					const Anope::string &value = buf.substr(sz + 2);
+					if (value.find_ci("close") != Anope::string::npos)
+						this->keepalive = false;
+					else if (value.find_ci("keep-alive") != Anope::string::npos)
+						this->keepalive = true;
+				}
+			}
 		}
 
 		return true;
@@ -246,14 +351,25 @@ class MyHTTPClient : public HTTPClient
 
 	void SendReply(HTTPReply *msg) anope_override
 	{
+		/* Each request gets one reply */
+		if (!this->pending)
+		{
+			Log(LOG_DEBUG, "httpd") << "m_httpd: Dropping reply to connection " << this->GetFD() << " which has no request";
+			return;
+		}
+
 		this->WriteClient("HTTP/1.1 " + GetStatusFromCode(msg->error));
 		this->WriteClient("Date: " + BuildDate());
 		this->WriteClient("Server: Anope-" + Anope::VersionShort());
-		if (msg->content_type.empty())
-			this->WriteClient("Content-Type: text/html");
-		else
-			this->WriteClient("Content-Type: " + msg->content_type);
-		this->WriteClient("Content-Length: " + stringify(msg->length));
+		/* A 304 reply has no body, so describes none */
+		if (msg->error != HTTP_NOT_MODIFIED)
+		{
+			if (msg->content_type.empty())
+				this->WriteClient("Content-Type: text/html");
+			else
+				this->WriteClient("Content-Type: " + msg->content_type);
+			this->WriteClient("Content-Length: " + stringify(msg->length));
+		}
 
 		for (unsigned i = 0; i < msg->cookies.size(); ++i)
 		{
@@ -271,7 +387,7 @@ class MyHTTPClient : public HTTPClient
 		for (map::iterator it = msg->headers.begin(), it_end = msg->headers.end(); it != it_end; ++it)
 			this->WriteClient(it->first + ": " + it->second);
 
-		this->WriteClient("Connection: Close");
+		this->WriteClient(this->keepalive ? "Connection: Keep-Alive" : "Connection: Close");
 		this->WriteClient("");
 
 		for (unsigned i = 0; i < msg->out.size(); ++i)
@@ -284,6 +400,14 @@ class MyHTTPClient : public HTTPClient
 		}
 
 		msg->out.clear();
+
+		this->pending = false;
+		this->last_activity = Anope::CurTime;
+		if (!this->keepalive)
+			this->closing = true;
+		else
+			/* Go on to the next pipelined request, if this reply came later */
+			this->ProcessRequests();
 	}
 };
 
@@ -298,14 +422,18 @@ class MyHTTPProvider : public HTTPProvider, public Timer
 
 	void Tick(time_t) anope_override
 	{
-		while (!this->clients.empty())
+		/* Clients are kept alive between requests, so are not in the order they time out */
+		for (std::list<Reference<MyHTTPClient> >::iterator it = this->clients.begin(); it != this->clients.end();)
 		{
-			Reference<MyHTTPClient>& c = this->clients.front();
-			if (c && c->created + this->timeout >= Anope::CurTime)
-				break;
+			Reference<MyHTTPClient>& c = *it;
+			if (c && c->last_activity + this->timeout >= Anope::CurTime)
+			{
+				++it;
+				continue;
+			}
 
 			delete c;
-			this->clients.pop_front();
+			it = this->clients.erase(it);
 		}
 	}
 
@@ -11,6 +11,7 @@
 
 #include "module.h"
 #include "modules/cs_mode.h"
+#include "modules/expiry.h"
 
 inline static Anope::string BotModes()
 {
@@ -27,9 +28,30 @@ class ChanServCore : public Module, public ChanServService
 	ExtensibleRef<bool> persist;
 	bool always_lower;
 
+	/* Channels by when they can next expire */
+	ExpiryQueue expiry;
+	/* Whether every channel has been added to the expiry queue, and the expiry time they were added with */
+	bool expiry_built;
+	time_t expiry_expire;
+	/* Channels registered since, which are added on the next expire tick */
+	std::set<Serializable *> expiry_pending;
+
+	/** Add a channel to the expiry queue, to be checked when it can next expire but not before earliest
+	 */
+	void ScheduleExpire(ChannelInfo *ci, time_t earliest)
+	{
+		time_t when = ci->last_used + this->expiry_expire;
+
+		/* cs_suspend lifts suspensions which have run out when channels are checked, so check these every time */
+		if (ci->HasExt("CS_SUSPENDED"))
+			when = earliest;
+
+		this->expiry.Add(ci->name, std::max(when, earliest));
+	}
+
  public:
 	ChanServCore(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, PSEUDOCLIENT | VENDOR),
-		ChanServService(this), inhabit(this, "inhabit"), persist("PERSIST"), always_lower(false)
+		ChanServService(this), inhabit(this, "inhabit"), persist("PERSIST"), always_lower(false), expiry_built(false), expiry_expire(0)
 	{
 	}
 
@@ -330,6 +352,23 @@ class ChanServCore : public Module, public ChanServService
 			l->bi = ChanServ;
 	}
 
+	void OnSerializableConstruct(Serializable *obj) anope_override
+	{
+		if (this->expiry_built && obj->GetSerializableType() && obj->GetSerializableType()->GetName() == "ChannelInfo")
+			this->expiry_pending.insert(obj);
+	}
+
+	void OnSerializableDestruct(Serializable *obj) anope_override
+	{
+		if (!this->expiry_pending.empty())
+			this->expiry_pending.erase(obj);
+	}
+
+	void OnChanSuspend(ChannelInfo *ci) anope_override
+	{
+		this->ScheduleExpire(ci, Anope::CurTime);
+	}
+
 	void OnExpireTick() anope_override
 	{
 		time_t chanserv_expire = Config->GetModule(this)->Get<time_t>("expire", "14d");
@@ -337,10 +376,29 @@ class ChanServCore : public Module, public ChanServService
 		if (!chanserv_expire || Anope::NoExpire || Anope::ReadOnly)
 			return;
 
-		for (registered_channel_map::const_iterator it = RegisteredChannelList->begin(), it_end = RegisteredChannelList->end(); it != it_end; )
+		/* Channels already queued stay where they are, which is early enough even if the expiry time was lowered */
+		if (!this->expiry_built || chanserv_expire != this->expiry_expire)
 		{
-			ChannelInfo *ci = it->second;
-			++it;
+			this->expiry_built = true;
+			this->expiry_expire = chanserv_expire;
+			this->expiry_pending.clear();
+
+			for (registered_channel_map::const_iterator it = RegisteredChannelList->begin(), it_end = RegisteredChannelList->end(); it != it_end; ++it)
+				this->ScheduleExpire(it->second, Anope::CurTime);
+		}
+		else
+		{
+			for (std::set<Serializable *>::iterator it = this->expiry_pending.begin(), it_end = this->expiry_pending.end(); it != it_end; ++it)
+				this->ScheduleExpire(anope_dynamic_static_cast<ChannelInfo *>(*it), Anope::CurTime);
+			this->expiry_pending.clear();
+		}
+
+		Anope::string chan;
+		while (this->expiry.Next(Anope::CurTime, chan))
+		{
+			ChannelInfo *ci = ChannelInfo::Find(chan);
+			if (!ci)
+				continue;
 
 			bool expire = false;
 
@@ -365,6 +423,8 @@ class ChanServCore : public Module, public ChanServService
 				FOREACH_MOD(OnChanExpire, (ci));
 				delete ci;
 			}
+			else
+				this->ScheduleExpire(ci, Anope::CurTime + 1);
 		}
 	}
 
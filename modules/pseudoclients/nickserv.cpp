@@ -10,6 +10,7 @@
  */
 
 #include "module.h"
+#include "modules/expiry.h"
 
 class NickServCollide;
 static std::set<NickServCollide *> collides;
@@ -116,6 +117,32 @@ class NickServCore : public Module, public NickServService
 	std::vector<Anope::string> defaults;
 	ExtensibleItem<bool> held, collided;
 
+	/* Nicks by when they can next expire */
+	ExpiryQueue expiry;
+	/* Whether every nick has been added to the expiry queue, and the expiry settings they were added with */
+	bool expiry_built;
+	time_t expiry_expire, expiry_unconfirmed;
+	/* Nicks created since, which are added on the next expire tick */
+	std::set<Serializable *> expiry_pending;
+
+	/** Add a nick to the expiry queue, to be checked when it can next expire but not before earliest
+	 */
+	void ScheduleExpire(NickAlias *na, time_t earliest)
+	{
+		time_t when = 0;
+		if (this->expiry_expire)
+			when = na->last_seen + this->expiry_expire;
+		if (this->expiry_unconfirmed && na->nc->HasExt("UNCONFIRMED") && (!when || na->time_registered + this->expiry_unconfirmed < when))
+			when = na->time_registered + this->expiry_unconfirmed;
+
+		/* ns_suspend lifts suspensions which have run out when nicks are checked, so check these every time */
+		if (na->nc->HasExt("NS_SUSPENDED"))
+			when = earliest;
+
+		if (when)
+			this->expiry.Add(na->nick, std::max(when, earliest));
+	}
+
 	void OnCancel(User *u, NickAlias *na)
 	{
 		if (collided.HasExt(na))
@@ -133,7 +160,8 @@ class NickServCore : public Module, public NickServService
 
  public:
 	NickServCore(const Anope::string &modname, const Anope::string &creator) : Module(modname, creator, PSEUDOCLIENT | VENDOR),
-		NickServService(this), held(this, "HELD"), collided(this, "COLLIDED")
+		NickServService(this), held(this, "HELD"), collided(this, "COLLIDED"),
+		expiry_built(false), expiry_expire(0), expiry_unconfirmed(0)
 	{
 	}
 
@@ -516,21 +544,68 @@ class NickServCore : public Module, public NickServService
 		}
 	}
 
+	void OnSerializableConstruct(Serializable *obj) anope_override
+	{
+		if (this->expiry_built && obj->GetSerializableType() && obj->GetSerializableType()->GetName() == "NickAlias")
+			this->expiry_pending.insert(obj);
+	}
+
+	void OnSerializableDestruct(Serializable *obj) anope_override
+	{
+		if (!this->expiry_pending.empty())
+			this->expiry_pending.erase(obj);
+	}
+
+	void OnNickSuspend(NickAlias *na) anope_override
+	{
+		for (unsigned i = 0; i < na->nc->aliases->size(); ++i)
+			this->ScheduleExpire(na->nc->aliases->at(i), Anope::CurTime);
+	}
+
 	void OnExpireTick() anope_override
 	{
 		if (Anope::NoExpire || Anope::ReadOnly)
 			return;
 
 		time_t nickserv_expire = Config->GetModule(this)->Get<time_t>("expire", "21d");
+		time_t unconfirmed_expire = Config->GetModule("ns_register")->Get<time_t>("unconfirmedexpire", "1d");
 
-		for (nickalias_map::const_iterator it = NickAliasList->begin(), it_end = NickAliasList->end(); it != it_end; )
+		/* Nicks in use are seen now, so last_seen is current even if the user never quits normally */
+		for (user_map::const_iterator it = UserListByNick.begin(), it_end = UserListByNick.end(); it != it_end; ++it)
 		{
-			NickAlias *na = it->second;
-			++it;
+			User *u = it->second;
+			if (!u->IsIdentified(true) && !u->IsRecognized())
+				continue;
 
-			User *u = User::Find(na->nick, true);
-			if (u && (u->IsIdentified(true) || u->IsRecognized()))
+			NickAlias *na = NickAlias::Find(u->nick);
+			if (na)
 				na->last_seen = Anope::CurTime;
+		}
+
+		/* Nicks already queued stay where they are, which is early enough even if the expiry times were lowered */
+		if (!this->expiry_built || nickserv_expire != this->expiry_expire || unconfirmed_expire != this->expiry_unconfirmed)
+		{
+			this->expiry_built = true;
+			this->expiry_expire = nickserv_expire;
+			this->expiry_unconfirmed = unconfirmed_expire;
+			this->expiry_pending.clear();
+
+			for (nickalias_map::const_iterator it = NickAliasList->begin(), it_end = NickAliasList->end(); it != it_end; ++it)
+				this->ScheduleExpire(it->second, Anope::CurTime);
+		}
+		else
+		{
+			for (std::set<Serializable *>::iterator it = this->expiry_pending.begin(), it_end = this->expiry_pending.end(); it != it_end; ++it)
+				this->ScheduleExpire(anope_dynamic_static_cast<NickAlias *>(*it), Anope::CurTime);
+			this->expiry_pending.clear();
+		}
+
+		Anope::string nick;
+		while (this->expiry.Next(Anope::CurTime, nick))
+		{
+			NickAlias *na = NickAlias::Find(nick);
+			if (!na)
+				continue;
 
 			bool expire = false;
 
@@ -545,6 +620,8 @@ class NickServCore : public Module, public NickServService
 				FOREACH_MOD(OnNickExpire, (na));
 				delete na;
 			}
+			else
+				this->ScheduleExpire(na, Anope::CurTime + 1);
 		}
 	}
 
@@ -61,6 +61,11 @@ class SGLineManager : public XLineManager
 
 		return false;
 	}
+
+	XLineIndexField GetIndexField() const anope_override
+	{
+		return XLINE_INDEX_HOST;
+	}
 };
 
 class SQLineManager : public XLineManager
@@ -120,6 +125,11 @@ class SQLineManager : public XLineManager
 		return Anope::Match(u->nick, x->mask);
 	}
 
+	XLineIndexField GetIndexField() const anope_override
+	{
+		return XLINE_INDEX_NICK;
+	}
+
 	XLine *CheckChannel(Channel *c)
 	{
 		for (std::vector<XLine *>::const_iterator it = this->GetList().begin(), it_end = this->GetList().end(); it != it_end; ++it)
@@ -180,6 +190,11 @@ class SNLineManager : public XLineManager
 			return x->regex->Matches(u->realname);
 		return Anope::Match(u->realname, x->mask, false, true);
 	}
+
+	XLineIndexField GetIndexField() const anope_override
+	{
+		return XLINE_INDEX_REALNAME;
+	}
 };
 
 class OperServCore : public Module
@@ -13,16 +13,122 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+static const Anope::string *FindHeader(const HTTPMessage &message, const Anope::string &hname)
+{
+	for (std::map<Anope::string, Anope::string>::const_iterator it = message.headers.begin(), it_end = message.headers.end(); it != it_end; ++it)
+		if (it->first.equals_ci(hname))
+			return &it->second;
+	return NULL;
+}
+
+static bool AcceptsGzip(const HTTPMessage &message)
+{
+	const Anope::string *accept = FindHeader(message, "Accept-Encoding");
+	if (accept == NULL)
+		return false;
+
+	commasepstream sep(*accept);
+	for (Anope::string token; sep.GetToken(token);)
+	{
+		token.trim();
+
+		Anope::string params;
+		size_t semi = token.find(';');
+		if (semi != Anope::string::npos)
+		{
+			params = token.substr(semi + 1).trim();
+			token = token.substr(0, semi).trim();
+		}
+
+		if (token.equals_ci("gzip") || token == "*")
+			return params.replace_all_cs(" ", "") != "q=0";
+	}
+
+	return false;
+}
+
+/* Whether the client already has the current version of a file */
+static bool NotModified(const HTTPMessage &message, const Anope::string &etag, const Anope::string &last_modified)
+{
+	/* If-None-Match takes precedence over If-Modified-Since */
+	const Anope::string *inm = FindHeader(message, "If-None-Match");
+	if (inm != NULL)
+	{
+		commasepstream sep(*inm);
+		for (Anope::string token; sep.GetToken(token);)
+		{
+			token.trim();
+			if (token.find("W/") == 0)
+				token = token.substr(2);
+			if (token == etag || token == "*")
+				return true;
+		}
+		return false;
+	}
+
+	const Anope::string *ims = FindHeader(message, "If-Modified-Since");
+	return ims != NULL && *ims == last_modified;
+}
+
+bool StaticFileServer::CachedFile::Refresh(const Anope::string &p)
+{
+	if (p != this->path)
+	{
+		this->path = p;
+		this->loaded = false;
+	}
+
+	struct stat st;
+	if (stat(this->path.c_str(), &st) < 0)
+	{
+		this->loaded = false;
+		this->content.clear();
+		return false;
+	}
+
+	if (this->loaded && this->mtime == st.st_mtime && this->size == st.st_size)
+		return true;
+
+	int fd = open(this->path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		this->loaded = false;
+		this->content.clear();
+		return false;
+	}
+
+	this->content.clear();
+
+	int i;
+	char buffer[BUFSIZE];
+	while ((i = read(fd, buffer, sizeof(buffer))) > 0)
+		this->content.append(buffer, i);
+
+	close(fd);
+
+	char timebuf[64];
+	strftime(timebuf, sizeof(timebuf), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&st.st_mtime));
+
+	this->loaded = true;
+	this->mtime = st.st_mtime;
+	this->size = st.st_size;
+	this->etag = "\"" + stringify(this->content.length()) + "-" + stringify(this->mtime) + "\"";
+	this->last_modified = timebuf;
+
+	return true;
+}
+
 StaticFileServer::StaticFileServer(const Anope::string &f_n, const Anope::string &u, const Anope::string &c_t) : HTTPPage(u, c_t), file_name(f_n)
 {
 }
 
 bool StaticFileServer::OnRequest(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply)
 {
-	int fd = open((template_base + "/" + this->file_name).c_str(), O_RDONLY);
-	if (fd < 0)
+	const Anope::string &path = template_base + "/" + this->file_name;
+
+	if (!this->file.Refresh(path))
 	{
-		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << (template_base + "/" + this->file_name) << "): " << strerror(errno);
+		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << this->file.path << "): " << strerror(errno);
 
 		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
 		return true;
@@ -31,11 +137,28 @@ bool StaticFileServer::OnRequest(HTTPProvider *server, const Anope::string &page
 	reply.content_type = this->GetContentType();
 	reply.headers["Cache-Control"] = "public";
 
-	int i;
-	char buffer[BUFSIZE];
-	while ((i = read(fd, buffer, sizeof(buffer))) > 0)
-		reply.Write(buffer, i);
+	/* A compressed copy older than the file is out of date, so is not used */
+	const CachedFile *f = &this->file;
+	if (this->gzip_file.Refresh(path + ".gz") && this->gzip_file.mtime >= this->file.mtime)
+	{
+		reply.headers["Vary"] = "Accept-Encoding";
 
-	close(fd);
+		if (AcceptsGzip(message))
+		{
+			f = &this->gzip_file;
+			reply.headers["Content-Encoding"] = "gzip";
+		}
+	}
+
+	reply.headers["ETag"] = f->etag;
+	reply.headers["Last-Modified"] = f->last_modified;
+
+	if (NotModified(message, f->etag, f->last_modified))
+	{
+		reply.error = HTTP_NOT_MODIFIED;
+		return true;
+	}
+
+	reply.Write(f->content);
 	return true;
 }
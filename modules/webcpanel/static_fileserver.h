@@ -10,7 +10,30 @@
 /* A basic file server. Used for serving static content on disk. */
 class StaticFileServer : public HTTPPage
 {
+	/* A copy of a file on disk, which is read again when the file changes */
+	struct CachedFile
+	{
+		Anope::string path;
+		bool loaded;
+		time_t mtime;
+		off_t size;
+		Anope::string content;
+		/* Validators sent with the file */
+		Anope::string etag, last_modified;
+
+		CachedFile() : loaded(false), mtime(0), size(0) { }
+
+		/** Check the file on disk, and read it again if it has changed
+		 * @param p The path to the file
+		 * @return false if the file can not be read, with errno set
+		 */
+		bool Refresh(const Anope::string &p);
+	};
+
 	Anope::string file_name;
+	CachedFile file;
+	/* A gzip compressed copy of the file, file_name.gz, served to clients which accept it */
+	CachedFile gzip_file;
  public:
 	StaticFileServer(const Anope::string &f_n, const Anope::string &u, const Anope::string &c_t);
 
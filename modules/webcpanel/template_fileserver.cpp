@@ -86,46 +86,83 @@ static Anope::string FindReplacement(const TemplateFileServer::Replacements &r,
 	return "";
 }
 
-TemplateFileServer::TemplateFileServer(const Anope::string &f_n) : file_name(f_n)
-{
-}
-
-void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply, Replacements &r)
+/* A piece of a compiled template */
+struct TemplateNode
 {
-	int fd = open((template_base + "/" + this->file_name).c_str(), O_RDONLY);
-	if (fd < 0)
+	enum Type
 	{
-		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << (template_base + "/" + this->file_name) << "): " << strerror(errno);
+		/* Text copied to the page as is */
+		TEXT,
+		/* The name of a replacement which is escaped and copied to the page */
+		VARIABLE,
+		/* IF a EQ b, args are a and b */
+		IF_EQ,
+		/* IF EXISTS a, args is a */
+		IF_EXISTS,
+		ELSE,
+		END_IF,
+		/* FOR a,b IN c,d, args are a and b, values are c and d */
+		FOR,
+		END_FOR,
+		/* INCLUDE file, text is the file */
+		INCLUDE
+	} type;
+
+	Anope::string text;
+	std::vector<Anope::string> args, values;
+
+	TemplateNode(Type t, const Anope::string &tx = "") : type(t), text(tx) { }
+};
 
-		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
-		return;
-	}
+/* A template file parsed into nodes, which is reused until the file changes */
+struct CompiledTemplate
+{
+	time_t mtime;
+	off_t size;
+	std::vector<TemplateNode> nodes;
 
-	Anope::string buf;
+	CompiledTemplate() : mtime(0), size(0) { }
 
-	int i;
-	char buffer[BUFSIZE];
-	while ((i = read(fd, buffer, sizeof(buffer) - 1)) > 0)
+	void AddText(const char *text, size_t len)
 	{
-		buffer[i] = 0;
-		buf += buffer;
+		if (!len)
+			return;
+		if (nodes.empty() || nodes.back().type != TemplateNode::TEXT)
+			nodes.push_back(TemplateNode(TemplateNode::TEXT));
+		nodes.back().text.append(text, len);
 	}
 
-	close(fd);
-
-	Anope::string finished;
-
-	bool escaped = false;
-	for (unsigned j = 0; j < buf.length(); ++j)
+	void Compile(const Anope::string &file_name, const Anope::string &buf)
 	{
-		if (buf[j] == '\\' && j + 1 < buf.length() && (buf[j + 1] == '{' || buf[j + 1] == '}'))
-			escaped = true;
-		else if (buf[j] == '{' && !escaped)
+		nodes.clear();
+
+		for (size_t j = 0, len = buf.length(); j < len;)
 		{
-			size_t f = buf.substr(j).find('}');
-			if (f == Anope::string::npos)
+			size_t brace = buf.find_first_of("\\{", j);
+			if (brace == Anope::string::npos)
+			{
+				AddText(buf.c_str() + j, len - j);
 				break;
-			const Anope::string &content = buf.substr(j + 1, f - 1);
+			}
+
+			AddText(buf.c_str() + j, brace - j);
+			j = brace;
+
+			if (buf[j] == '\\')
+			{
+				/* An escaped brace is copied without the backslash */
+				if (j + 1 < len && (buf[j + 1] == '{' || buf[j + 1] == '}'))
+					++j;
+				AddText(buf.c_str() + j, 1);
+				++j;
+				continue;
+			}
+
+			size_t end = buf.find('}', j);
+			if (end == Anope::string::npos)
+				break;
+			const Anope::string &content = buf.substr(j + 1, end - j - 1);
+			j = end + 1;
 
 			if (content.find("IF ") == 0)
 			{
@@ -134,49 +171,28 @@ void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_n
 
 				if (tokens.size() == 4 && tokens[1] == "EQ")
 				{
-					Anope::string first = FindReplacement(r, tokens[2]), second = FindReplacement(r, tokens[3]);
-					if (first.empty())
-						first = tokens[2];
-					if (second.empty())
-						second = tokens[3];
-
-					bool stackok = IfStack.empty() || IfStack.top();
-					IfStack.push(stackok && first == second);
+					nodes.push_back(TemplateNode(TemplateNode::IF_EQ));
+					nodes.back().args.assign(tokens.begin() + 2, tokens.end());
 				}
 				else if (tokens.size() == 3 && tokens[1] == "EXISTS")
 				{
-					bool stackok = IfStack.empty() || IfStack.top();
-					IfStack.push(stackok && r.count(tokens[2]) > 0);
+					nodes.push_back(TemplateNode(TemplateNode::IF_EXISTS));
+					nodes.back().args.push_back(tokens[2]);
 				}
 				else
-					Log() << "Invalid IF in web template " << this->file_name;
+					Log() << "Invalid IF in web template " << file_name;
 			}
 			else if (content == "ELSE")
-			{
-				if (IfStack.empty())
-					Log() << "Invalid ELSE with no stack in web template" << this->file_name;
-				else
-				{
-					bool old = IfStack.top();
-					IfStack.pop(); // Pop off previous if()
-					bool stackok = IfStack.empty() || IfStack.top();
-					IfStack.push(stackok && !old); // Push back the opposite of what was popped
-				}
-			}
+				nodes.push_back(TemplateNode(TemplateNode::ELSE));
 			else if (content == "END IF")
-			{
-				if (IfStack.empty())
-					Log() << "END IF with empty stack?";
-				else
-					IfStack.pop();
-			}
+				nodes.push_back(TemplateNode(TemplateNode::END_IF));
 			else if (content.find("FOR ") == 0)
 			{
 				std::vector<Anope::string> tokens;
 				spacesepstream(content).GetTokens(tokens);
 
 				if (tokens.size() != 4 || tokens[2] != "IN")
-					Log() << "Invalid FOR in web template " << this->file_name;
+					Log() << "Invalid FOR in web template " << file_name;
 				else
 				{
 					std::vector<Anope::string> temp_variables, real_variables;
@@ -184,83 +200,181 @@ void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_n
 					commasepstream(tokens[3]).GetTokens(real_variables);
 
 					if (temp_variables.size() != real_variables.size())
-						Log() << "Invalid FOR in web template " << this->file_name << " variable mismatch";
-					else
-						ForLoop::Stack.push_back(ForLoop(j + f, r, temp_variables, real_variables));
-				}
-			}
-			else if (content == "END FOR")
-			{
-				if (ForLoop::Stack.empty())
-					Log() << "END FOR with empty stack?";
-				else
-				{
-					ForLoop &fl = ForLoop::Stack.back();
-					if (fl.finished(r))
-						ForLoop::Stack.pop_back();
+						Log() << "Invalid FOR in web template " << file_name << " variable mismatch";
 					else
 					{
-						fl.increment(r);
-						if (fl.finished(r))
-							ForLoop::Stack.pop_back();
-						else
-						{
-							j = fl.start; // Move pointer back to start of the loop
-							continue; // To prevent skipping over this block which doesn't exist anymore
-						}
+						nodes.push_back(TemplateNode(TemplateNode::FOR));
+						nodes.back().args = temp_variables;
+						nodes.back().values = real_variables;
 					}
 				}
 			}
+			else if (content == "END FOR")
+				nodes.push_back(TemplateNode(TemplateNode::END_FOR));
 			else if (content.find("INCLUDE ") == 0)
 			{
 				std::vector<Anope::string> tokens;
 				spacesepstream(content).GetTokens(tokens);
 
 				if (tokens.size() != 2)
-					Log() << "Invalid INCLUDE in web template " << this->file_name;
+					Log() << "Invalid INCLUDE in web template " << file_name;
 				else
-				{
-					if (!finished.empty())
-					{
-						reply.Write(finished); // Write out what we have currently so we insert this files contents here
-						finished.clear();
-					}
-
-					TemplateFileServer tfs(tokens[1]);
-					tfs.Serve(server, page_name, client, message, reply, r);
-				}
+					nodes.push_back(TemplateNode(TemplateNode::INCLUDE, tokens[1]));
 			}
 			else
+				nodes.push_back(TemplateNode(TemplateNode::VARIABLE, content));
+		}
+	}
+};
+
+/* Compiled templates by path */
+static std::map<Anope::string, CompiledTemplate> Templates;
+
+/* Find the compiled template for a file, compiling it if it is new or has changed since */
+static const CompiledTemplate *GetTemplate(const Anope::string &file_name, const Anope::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0)
+	{
+		Templates.erase(path);
+		return NULL;
+	}
+
+	CompiledTemplate &t = Templates[path];
+	if (!t.nodes.empty() && t.mtime == st.st_mtime && t.size == st.st_size)
+		return &t;
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		Templates.erase(path);
+		return NULL;
+	}
+
+	Anope::string buf;
+
+	int i;
+	char buffer[BUFSIZE];
+	while ((i = read(fd, buffer, sizeof(buffer))) > 0)
+		buf.append(buffer, i);
+
+	close(fd);
+
+	t.mtime = st.st_mtime;
+	t.size = st.st_size;
+	t.Compile(file_name, buf);
+	return &t;
+}
+
+static void Render(const Anope::string &file_name, HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply, TemplateFileServer::Replacements &r, Anope::string &finished)
+{
+	const Anope::string &path = template_base + "/" + file_name;
+
+	const CompiledTemplate *t = GetTemplate(file_name, path);
+	if (t == NULL)
+	{
+		Log(LOG_NORMAL, "httpd") << "Error serving file " << page_name << " (" << path << "): " << strerror(errno);
+
+		client->SendError(HTTP_PAGE_NOT_FOUND, "Page not found");
+		return;
+	}
+
+	const std::vector<TemplateNode> &nodes = t->nodes;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		const TemplateNode &node = nodes[i];
+
+		switch (node.type)
+		{
+			case TemplateNode::TEXT:
+			case TemplateNode::VARIABLE:
 			{
 				// If the if stack is empty or we are in a true statement
 				bool ifok = IfStack.empty() || IfStack.top();
 				bool forok = ForLoop::Stack.empty() || !ForLoop::Stack.back().finished(r);
 
-				if (ifok && forok)
-				{
-					Anope::string replacement = FindReplacement(r, content.substr(0, f - 1));
+				if (!ifok || !forok)
+					break;
 
+				if (node.type == TemplateNode::TEXT)
+					finished += node.text;
+				else
 					// htmlescape all text replaced onto the page
-					replacement = HTTPUtils::Escape(replacement);
-
-					finished += replacement;
-				}
+					finished += HTTPUtils::Escape(FindReplacement(r, node.text));
+				break;
 			}
-
-			j += f; // Skip over this whole block
+			case TemplateNode::IF_EQ:
+			{
+				Anope::string first = FindReplacement(r, node.args[0]), second = FindReplacement(r, node.args[1]);
+				if (first.empty())
+					first = node.args[0];
+				if (second.empty())
+					second = node.args[1];
+
+				bool stackok = IfStack.empty() || IfStack.top();
+				IfStack.push(stackok && first == second);
+				break;
+			}
+			case TemplateNode::IF_EXISTS:
+			{
+				bool stackok = IfStack.empty() || IfStack.top();
+				IfStack.push(stackok && r.count(node.args[0]) > 0);
+				break;
+			}
+			case TemplateNode::ELSE:
+				if (IfStack.empty())
+					Log() << "Invalid ELSE with no stack in web template" << file_name;
+				else
+				{
+					bool old = IfStack.top();
+					IfStack.pop(); // Pop off previous if()
+					bool stackok = IfStack.empty() || IfStack.top();
+					IfStack.push(stackok && !old); // Push back the opposite of what was popped
+				}
+				break;
+			case TemplateNode::END_IF:
+				if (IfStack.empty())
+					Log() << "END IF with empty stack?";
+				else
+					IfStack.pop();
+				break;
+			case TemplateNode::FOR:
+				ForLoop::Stack.push_back(ForLoop(i, r, node.args, node.values));
+				break;
+			case TemplateNode::END_FOR:
+				if (ForLoop::Stack.empty())
+					Log() << "END FOR with empty stack?";
+				else
+				{
+					ForLoop &fl = ForLoop::Stack.back();
+					if (fl.finished(r))
+						ForLoop::Stack.pop_back();
+					else
+					{
+						fl.increment(r);
+						if (fl.finished(r))
+							ForLoop::Stack.pop_back();
+						else
+							i = fl.start; // Move back to the start of the loop
+					}
+				}
+				break;
+			case TemplateNode::INCLUDE:
+				Render(node.text, server, page_name, client, message, reply, r, finished);
+				break;
 		}
-		else
-		{
-			escaped = false;
+	}
+}
 
-			// If the if stack is empty or we are in a true statement
-			bool ifok = IfStack.empty() || IfStack.top();
-			bool forok = ForLoop::Stack.empty() || !ForLoop::Stack.back().finished(r);
+TemplateFileServer::TemplateFileServer(const Anope::string &f_n) : file_name(f_n)
+{
+}
 
-			if (ifok && forok)
-				finished += buf[j];
-		}
-	}
+void TemplateFileServer::Serve(HTTPProvider *server, const Anope::string &page_name, HTTPClient *client, HTTPMessage &message, HTTPReply &reply, Replacements &r)
+{
+	Anope::string finished;
+
+	Render(this->file_name, server, page_name, client, message, reply, r, finished);
 
 	if (!finished.empty())
 		reply.Write(finished);
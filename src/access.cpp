@@ -149,6 +149,7 @@ ChanAccess::~ChanAccess()
 		std::vector<ChanAccess *>::iterator it = std::find(this->ci->access->begin(), this->ci->access->end(), this);
 		if (it != this->ci->access->end())
 			this->ci->access->erase(it);
+		AccessCache::Invalidate(this->ci);
 
 		if (*nc != NULL)
 			nc->RemoveChannelReference(this->ci);
@@ -172,6 +173,10 @@ void ChanAccess::SetMask(const Anope::string &m, ChannelInfo *c)
 			targc->RemoveChannelReference(this->ci->name);
 	}
 
+	if (this->ci)
+		AccessCache::Invalidate(this->ci);
+	AccessCache::Invalidate(c);
+
 	ci = c;
 	mask.clear();
 	nc = NULL;
@@ -12,37 +12,58 @@
 
 std::map<Anope::string, std::map<Anope::string, Service *> > Service::Services;
 std::map<Anope::string, std::map<Anope::string, Anope::string> > Service::Aliases;
+unsigned Service::Generation = 0;
 
 Base::Base() : references(NULL)
 {
 }
 
+Base::Base(const Base &) : references(NULL)
+{
+}
+
 Base::~Base()
 {
-	if (this->references != NULL)
+	for (ReferenceBase *r = this->references, *next; r != NULL; r = next)
 	{
-		for (std::set<ReferenceBase *>::iterator it = this->references->begin(), it_end = this->references->end(); it != it_end; ++it)
-			(*it)->Invalidate();
-		delete this->references;
+		next = r->next;
+		r->owner = NULL;
+		r->prev = r->next = NULL;
+		r->Invalidate();
 	}
 }
 
+Base &Base::operator=(const Base &)
+{
+	return *this;
+}
+
 void Base::AddReference(ReferenceBase *r)
 {
-	if (this->references == NULL)
-		this->references = new std::set<ReferenceBase *>();
-	this->references->insert(r);
+	/* A reference is only ever in one list */
+	if (r->owner != NULL)
+		r->owner->DelReference(r);
+
+	r->owner = this;
+	r->prev = NULL;
+	r->next = this->references;
+	if (this->references != NULL)
+		this->references->prev = r;
+	this->references = r;
 }
 
 void Base::DelReference(ReferenceBase *r)
 {
-	if (this->references != NULL)
-	{
-		this->references->erase(r);
-		if (this->references->empty())
-		{
-			delete this->references;
-			this->references = NULL;
-		}
-	}
+	if (r->owner != this)
+		return;
+
+	if (r->prev != NULL)
+		r->prev->next = r->next;
+	else
+		this->references = r->next;
+	if (r->next != NULL)
+		r->next->prev = r->prev;
+
+	r->owner = NULL;
+	r->prev = r->next = NULL;
 }
@@ -27,6 +27,8 @@
 
 channel_map ChannelList;
 std::vector<Channel *> Channel::deleting;
+std::set<Channel *> Channel::bursting;
+BurstJoinStats Channel::BurstStats;
 
 Channel::Channel(const Anope::string &nname, time_t ts)
 {
@@ -64,6 +66,7 @@ Channel::~Channel()
 	if (this->ci)
 		this->ci->c = NULL;
 
+	bursting.erase(this);
 	ChannelList.erase(this->name);
 }
 
@@ -959,3 +962,83 @@ void Channel::DeleteChannels()
 	}
 	deleting.clear();
 }
+
+void Channel::QueueBurstJoin(User *u)
+{
+	this->burst_joins.push_back(u);
+	bursting.insert(this);
+}
+
+void Channel::ProcessBurstJoins(Server *s, bool links)
+{
+	if (bursting.empty())
+		return;
+
+	uint64_t start = Anope::MicroTime();
+	unsigned long joins = 0, channels = 0;
+
+	/* Kicking users or modules can delete channels, which removes them from bursting */
+	std::vector<Channel *> chans(bursting.begin(), bursting.end());
+	for (unsigned i = 0; i < chans.size(); ++i)
+	{
+		Channel *c = chans[i];
+		if (!bursting.count(c))
+			continue;
+
+		std::vector<Reference<User> > users;
+		users.swap(c->burst_joins);
+
+		bool checked = false;
+		for (unsigned j = 0; j < users.size(); ++j)
+		{
+			User *u = users[j];
+			if (u == NULL)
+				continue;
+
+			Server *serv = u->server;
+			while (links && serv && serv != s)
+				serv = serv->GetUplink();
+			if (serv != s)
+			{
+				c->burst_joins.push_back(u);
+				continue;
+			}
+
+			/* The user may have left since */
+			if (!c->FindUser(u))
+				continue;
+
+			++joins;
+			checked = true;
+
+			/* Check if the user is allowed to join */
+			if (c->CheckKick(u))
+				continue;
+
+			/* Set whatever modes the user should have, and remove any that
+			 * they aren't allowed to have (secureops etc).
+			 */
+			c->SetCorrectModes(u, true);
+
+			FOREACH_MOD(OnJoinChannel, (u, c));
+		}
+
+		if (checked)
+			++channels;
+		if (c->burst_joins.empty())
+			bursting.erase(c);
+	}
+
+	if (!joins)
+		return;
+
+	uint64_t elapsed = Anope::MicroTime() - start;
+	++BurstStats.bursts;
+	BurstStats.joins += joins;
+	BurstStats.channels += channels;
+	BurstStats.total_time += elapsed;
+	if (elapsed > BurstStats.max_time)
+		BurstStats.max_time = elapsed;
+
+	Log(LOG_DEBUG) << "Checked " << joins << " joins to " << channels << " channels from the burst of " << s->GetName() << " in " << elapsed << " microseconds";
+}
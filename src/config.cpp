@@ -113,7 +113,10 @@ template<typename T> static void ValidateNotZero(const Anope::string &block, con
 Conf::Conf() : Block("")
 {
 	ReadTimeout = 0;
-	UsePrivmsg = DefPrivmsg = false;
+	MaxEvents = 0;
+	LogQueue = 0;
+	LogFsync = -1;
+	UsePrivmsg = DefPrivmsg = EdgeTriggered = false;
 
 	this->LoadConf(ServicesConf);
 
@@ -186,6 +189,22 @@ Conf::Conf() : Block("")
 	}
 
 	this->ReadTimeout = options->Get<time_t>("readtimeout");
+	this->MaxEvents = options->Get<unsigned>("maxevents");
+	this->EdgeTriggered = options->Get<bool>("edgetriggered");
+	this->LogQueue = options->Get<unsigned>("logqueue", "10000");
+	{
+		const Anope::string &logfsync = options->Get<const Anope::string>("logfsync", "never");
+		if (logfsync.equals_ci("never"))
+			this->LogFsync = -1;
+		else if (logfsync.equals_ci("always"))
+			this->LogFsync = 0;
+		else
+		{
+			this->LogFsync = Anope::DoTime(logfsync);
+			if (this->LogFsync <= 0)
+				throw ConfigException("The value for <options:logfsync> must be never, always, or a time period");
+		}
+	}
 	this->UsePrivmsg = options->Get<bool>("useprivmsg");
 	this->UseStrictPrivmsg = options->Get<bool>("usestrictprivmsg");
 	this->StrictPrivmsg = !UseStrictPrivmsg ? "/msg " : "/";
@@ -8,27 +8,153 @@
 
 #include "extensible.h"
 
-static std::set<ExtensibleBase *> extensible_items;
+typedef std::pair<unsigned, void *> ExtensibleValue;
 
-ExtensibleBase::ExtensibleBase(Module *m, const Anope::string &n) : Service(m, "Extensible", n)
+/* Every extensible item by slot, NULL for slots which are free */
+static std::vector<ExtensibleBase *> extensible_items;
+/* The extensible items stored in each bit of Extensible::ext_bits */
+static ExtensibleBase *bit_items[64];
+/* All extensible objects */
+static Extensible *extensibles;
+
+static bool SlotLess(const ExtensibleValue &a, const ExtensibleValue &b)
+{
+	return a.first < b.first;
+}
+
+ExtensibleBase::ExtensibleBase(Module *m, const Anope::string &n, bool flag) : Service(m, "Extensible", n), bit(-1), count(0)
 {
-	extensible_items.insert(this);
+	this->slot = std::find(extensible_items.begin(), extensible_items.end(), static_cast<ExtensibleBase *>(NULL)) - extensible_items.begin();
+	if (this->slot == extensible_items.size())
+		extensible_items.push_back(this);
+	else
+		extensible_items[this->slot] = this;
+
+	if (flag)
+		for (int i = 0; i < 64; ++i)
+			if (bit_items[i] == NULL)
+			{
+				bit_items[i] = this;
+				this->bit = i;
+				break;
+			}
 }
 
 ExtensibleBase::~ExtensibleBase()
 {
-	extensible_items.erase(this);
+	extensible_items[this->slot] = NULL;
+	if (this->bit >= 0)
+		bit_items[this->bit] = NULL;
+}
+
+void *ExtensibleBase::Find(const Extensible *obj) const
+{
+	if (this->bit >= 0)
+		return NULL;
+
+	const ExtensibleValue key(this->slot, NULL);
+	std::vector<ExtensibleValue>::const_iterator it = std::lower_bound(obj->ext_values.begin(), obj->ext_values.end(), key, SlotLess);
+	if (it != obj->ext_values.end() && it->first == this->slot)
+		return it->second;
+	return NULL;
+}
+
+bool ExtensibleBase::IsSet(const Extensible *obj) const
+{
+	if (this->bit >= 0)
+		return obj->ext_bits & (static_cast<uint64_t>(1) << this->bit);
+
+	const ExtensibleValue key(this->slot, NULL);
+	std::vector<ExtensibleValue>::const_iterator it = std::lower_bound(obj->ext_values.begin(), obj->ext_values.end(), key, SlotLess);
+	return it != obj->ext_values.end() && it->first == this->slot;
+}
+
+void ExtensibleBase::Insert(Extensible *obj, void *value)
+{
+	if (this->bit >= 0)
+		obj->ext_bits |= static_cast<uint64_t>(1) << this->bit;
+	else
+	{
+		const ExtensibleValue key(this->slot, value);
+		obj->ext_values.insert(std::lower_bound(obj->ext_values.begin(), obj->ext_values.end(), key, SlotLess), key);
+	}
+
+	++this->count;
+}
+
+void *ExtensibleBase::Remove(Extensible *obj)
+{
+	if (this->bit >= 0)
+	{
+		uint64_t mask = static_cast<uint64_t>(1) << this->bit;
+		if (!(obj->ext_bits & mask))
+			return NULL;
+
+		obj->ext_bits &= ~mask;
+		--this->count;
+		return NULL;
+	}
+
+	const ExtensibleValue key(this->slot, NULL);
+	std::vector<ExtensibleValue>::iterator it = std::lower_bound(obj->ext_values.begin(), obj->ext_values.end(), key, SlotLess);
+	if (it == obj->ext_values.end() || it->first != this->slot)
+		return NULL;
+
+	void *value = it->second;
+	obj->ext_values.erase(it);
+	--this->count;
+	return value;
+}
+
+void ExtensibleBase::UnsetAll()
+{
+	for (Extensible *e = extensibles, *next; e != NULL && this->count; e = next)
+	{
+		next = e->ext_next;
+		if (this->IsSet(e))
+			this->Unset(e);
+	}
+}
+
+Extensible::Extensible() : ext_prev(NULL), ext_next(extensibles), ext_bits(0)
+{
+	if (extensibles)
+		extensibles->ext_prev = this;
+	extensibles = this;
+}
+
+Extensible::Extensible(const Extensible &) : ext_prev(NULL), ext_next(extensibles), ext_bits(0)
+{
+	if (extensibles)
+		extensibles->ext_prev = this;
+	extensibles = this;
 }
 
 Extensible::~Extensible()
 {
 	UnsetExtensibles();
+
+	if (this->ext_prev)
+		this->ext_prev->ext_next = this->ext_next;
+	else
+		extensibles = this->ext_next;
+	if (this->ext_next)
+		this->ext_next->ext_prev = this->ext_prev;
+}
+
+Extensible &Extensible::operator=(const Extensible &)
+{
+	return *this;
 }
 
 void Extensible::UnsetExtensibles()
 {
-	while (!extension_items.empty())
-		(*extension_items.begin())->Unset(this);
+	for (int i = 0; this->ext_bits && i < 64; ++i)
+		if (this->ext_bits & (static_cast<uint64_t>(1) << i))
+			bit_items[i]->Unset(this);
+
+	while (!this->ext_values.empty())
+		extensible_items[this->ext_values.back().first]->Unset(this);
 }
 
 bool Extensible::HasExt(const Anope::string &name) const
@@ -43,19 +169,21 @@ bool Extensible::HasExt(const Anope::string &name) const
 
 void Extensible::ExtensibleSerialize(const Extensible *e, const Serializable *s, Serialize::Data &data)
 {
-	for (std::set<ExtensibleBase *>::iterator it = e->extension_items.begin(); it != e->extension_items.end(); ++it)
-	{
-		ExtensibleBase *eb = *it;
-		eb->ExtensibleSerialize(e, s, data);
-	}
+	for (int i = 0; e->ext_bits && i < 64; ++i)
+		if (e->ext_bits & (static_cast<uint64_t>(1) << i))
+			bit_items[i]->ExtensibleSerialize(e, s, data);
+
+	for (unsigned i = 0; i < e->ext_values.size(); ++i)
+		extensible_items[e->ext_values[i].first]->ExtensibleSerialize(e, s, data);
 }
 
 void Extensible::ExtensibleUnserialize(Extensible *e, Serializable *s, Serialize::Data &data)
 {
-	for (std::set<ExtensibleBase *>::iterator it = extensible_items.begin(); it != extensible_items.end(); ++it)
+	for (unsigned i = 0; i < extensible_items.size(); ++i)
 	{
-		ExtensibleBase *eb = *it;
-		eb->ExtensibleUnserialize(e, s, data);
+		ExtensibleBase *eb = extensible_items[i];
+		if (eb != NULL)
+			eb->ExtensibleUnserialize(e, s, data);
 	}
 }
 
@@ -480,6 +480,9 @@ void Anope::Init(int ac, char **av)
 	/* Initialize the socket engine. Note that some engines can not survive a fork(), so this must be here. */
 	SocketEngine::Init();
 
+	/* Threads do not survive a fork() either, so log files can only be written in the background from here */
+	LogWriter::Start();
+
 	/* Read configuration file; exit if there are problems. */
 	try
 	{
@@ -20,6 +20,10 @@
 #include "servers.h"
 #include "uplink.h"
 #include "protocol.h"
+#include "threadengine.h"
+
+#include <deque>
+#include <fcntl.h>
 
 #ifndef _WIN32
 #include <sys/time.h>
@@ -60,13 +64,15 @@ static inline Anope::string CreateLogName(const Anope::string &file, time_t t =
 	return Anope::LogDir + "/" + file + "." + timestamp;
 }
 
-LogFile::LogFile(const Anope::string &name) : filename(name), stream(name.c_str(), std::ios_base::out | std::ios_base::app)
+LogFile::LogFile(const Anope::string &name) : filename(name)
 {
+	this->fd = open(name.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
 }
 
 LogFile::~LogFile()
 {
-	this->stream.close();
+	if (this->fd >= 0)
+		close(this->fd);
 }
 
 const Anope::string &LogFile::GetName() const
@@ -74,6 +80,255 @@ const Anope::string &LogFile::GetName() const
 	return this->filename;
 }
 
+bool LogFile::IsOpen() const
+{
+	return this->fd >= 0;
+}
+
+LogWriterStats LogWriter::Stats;
+
+namespace
+{
+	struct QueuedLine
+	{
+		LogFile *lf;
+		Anope::string line;
+
+		QueuedLine(LogFile *l, const Anope::string &li) : lf(l), line(li) { }
+	};
+
+	/* Protects everything below, and is signalled both when lines are queued and when a batch has been written */
+	Condition queue_lock;
+	std::deque<QueuedLine> queue;
+	/* Copied from the config by the main thread, as the writer can not read Config */
+	unsigned queue_max;
+	time_t fsync_interval = -1;
+	/* Whether the writer is writing out a batch it took from the queue */
+	bool writing;
+	bool exiting;
+
+	/* Whether lines may be queued, and whether the writer is running */
+	bool allowed, running;
+	pthread_t writer;
+	/* When log files were last synced while writing directly */
+	time_t last_direct_sync;
+
+	void WriteOut(int fd, const char *data, size_t len)
+	{
+		while (len > 0)
+		{
+			int i = write(fd, data, len);
+			if (i <= 0)
+				return;
+			data += i;
+			len -= i;
+		}
+	}
+
+	void Sync(int fd)
+	{
+#ifndef _WIN32
+		fsync(fd);
+#else
+		_commit(fd);
+#endif
+	}
+
+	/* Write a batch of lines with one write() per file */
+	void WriteBatch(std::deque<QueuedLine> &batch, time_t sync, time_t &last_sync)
+	{
+		std::vector<std::pair<LogFile *, Anope::string> > buffers;
+
+		for (unsigned i = 0; i < batch.size(); ++i)
+		{
+			const QueuedLine &ql = batch[i];
+
+			unsigned j = 0;
+			while (j < buffers.size() && buffers[j].first != ql.lf)
+				++j;
+			if (j == buffers.size())
+				buffers.push_back(std::make_pair(ql.lf, ""));
+
+			buffers[j].second += ql.line;
+			buffers[j].second += '\n';
+		}
+
+		time_t now = time(NULL);
+		bool do_sync = sync == 0 || (sync > 0 && now - last_sync >= sync);
+
+		for (unsigned i = 0; i < buffers.size(); ++i)
+		{
+			WriteOut(buffers[i].first->fd, buffers[i].second.c_str(), buffers[i].second.length());
+			if (do_sync)
+				Sync(buffers[i].first->fd);
+		}
+
+		if (do_sync)
+			last_sync = now;
+
+		queue_lock.Lock();
+		LogWriter::Stats.writes += buffers.size();
+		queue_lock.Unlock();
+	}
+
+	void *WriterEntry(void *)
+	{
+		time_t last_sync = time(NULL);
+
+		queue_lock.Lock();
+		for (;;)
+		{
+			while (queue.empty() && !exiting)
+				queue_lock.Wait();
+
+			if (queue.empty())
+				break;
+
+			std::deque<QueuedLine> batch;
+			batch.swap(queue);
+			time_t sync = fsync_interval;
+			writing = true;
+
+			/* There is room in the queue again */
+			queue_lock.Wakeup();
+			queue_lock.Unlock();
+
+			WriteBatch(batch, sync, last_sync);
+
+			queue_lock.Lock();
+			writing = false;
+			queue_lock.Wakeup();
+		}
+		queue_lock.Unlock();
+
+		return NULL;
+	}
+
+	void StopWriter()
+	{
+		queue_lock.Lock();
+		exiting = true;
+		queue_lock.Wakeup();
+		queue_lock.Unlock();
+
+		pthread_join(writer, NULL);
+
+		running = exiting = false;
+	}
+
+#ifndef _WIN32
+	/* Keep queue_lock held over fork() so the child never gets a copy of it locked by another thread */
+	void BeforeFork()
+	{
+		queue_lock.Lock();
+	}
+
+	void AfterForkParent()
+	{
+		queue_lock.Unlock();
+	}
+
+	/* The writer thread does not exist in the child, so it writes directly. The queued lines are written by the parent */
+	void AfterForkChild()
+	{
+		queue.clear();
+		writing = exiting = false;
+		allowed = running = false;
+		queue_lock.Unlock();
+	}
+#endif
+}
+
+void LogWriter::Start()
+{
+	if (allowed)
+		return;
+
+	allowed = true;
+
+	static bool registered = false;
+	if (!registered)
+	{
+		atexit(LogWriter::Stop);
+#ifndef _WIN32
+		pthread_atfork(BeforeFork, AfterForkParent, AfterForkChild);
+#endif
+		registered = true;
+	}
+}
+
+void LogWriter::Stop()
+{
+	if (running)
+		StopWriter();
+	allowed = false;
+}
+
+void LogWriter::Flush()
+{
+	if (!running)
+		return;
+
+	queue_lock.Lock();
+	while (!queue.empty() || writing)
+		queue_lock.Wait();
+	queue_lock.Unlock();
+}
+
+void LogWriter::Write(LogFile *lf, const Anope::string &line, bool droppable)
+{
+	unsigned max = Config ? Config->LogQueue : 0;
+	time_t sync = Config ? Config->LogFsync : -1;
+
+	if (running && !max)
+		StopWriter();
+	else if (allowed && !running && max)
+	{
+		if (pthread_create(&writer, NULL, WriterEntry, NULL))
+			allowed = false;
+		else
+			running = true;
+	}
+
+	++Stats.lines;
+
+	if (!running)
+	{
+		Anope::string l = line + "\n";
+		WriteOut(lf->fd, l.c_str(), l.length());
+		++Stats.writes;
+		if (sync == 0 || (sync > 0 && Anope::CurTime - last_direct_sync >= sync))
+		{
+			Sync(lf->fd);
+			last_direct_sync = Anope::CurTime;
+		}
+		return;
+	}
+
+	queue_lock.Lock();
+	queue_max = max;
+	fsync_interval = sync;
+
+	if (queue.size() >= queue_max)
+	{
+		if (droppable)
+		{
+			--Stats.lines;
+			++Stats.dropped;
+			queue_lock.Unlock();
+			return;
+		}
+
+		++Stats.waits;
+		while (queue.size() >= queue_max)
+			queue_lock.Wait();
+	}
+
+	queue.push_back(QueuedLine(lf, line));
+	queue_lock.Wakeup();
+	queue_lock.Unlock();
+}
+
 Log::Log(LogType t, const Anope::string &cat, BotInfo *b) : bi(b), u(NULL), nc(NULL), c(NULL), source(NULL), chan(NULL), ci(NULL), s(NULL), m(NULL), type(t), category(cat)
 {
 }
@@ -227,39 +482,67 @@ Anope::string Log::BuildPrefix() const
 	return buffer;
 }
 
-LogInfo::LogInfo(int la, bool rio, bool ldebug) : bot(NULL), last_day(0), log_age(la), raw_io(rio), debug(ldebug)
+LogInfo::LogInfo(int la, bool rio, bool ldebug) : match_all(0), bot(NULL), last_day(0), log_age(la), raw_io(rio), debug(ldebug)
 {
 }
 
 LogInfo::~LogInfo()
 {
+	/* Lines for these files may still be queued */
+	if (!this->logfiles.empty())
+		LogWriter::Flush();
+
 	for (unsigned i = 0; i < this->logfiles.size(); ++i)
 		delete this->logfiles[i];
 	this->logfiles.clear();
 }
 
+void LogInfo::Compile() const
+{
+	const std::vector<Anope::string> *lists[] = { &this->admin, &this->override, &this->commands, &this->servers, &this->channels, &this->users, &this->normal };
+
+	this->compiled.resize(sizeof(lists) / sizeof(*lists));
+	for (unsigned i = 0; i < this->compiled.size(); ++i)
+	{
+		const std::vector<Anope::string> &list = *lists[i];
+
+		for (unsigned j = 0; j < list.size(); ++j)
+		{
+			const Anope::string &cat = list[j];
+			if (cat[0] == '~')
+				this->compiled[i].push_back(std::make_pair(cat.substr(1), true));
+			else
+				this->compiled[i].push_back(std::make_pair(cat, false));
+		}
+
+		/* The first match wins, so a leading * matches everything */
+		if (!list.empty() && list[0] == "*")
+			this->match_all |= 1U << i;
+	}
+}
+
 bool LogInfo::HasType(LogType ltype, const Anope::string &type) const
 {
-	const std::vector<Anope::string> *list = NULL;
+	unsigned list;
 	switch (ltype)
 	{
 		case LOG_ADMIN:
-			list = &this->admin;
+			list = 0;
 			break;
 		case LOG_OVERRIDE:
-			list = &this->override;
+			list = 1;
 			break;
 		case LOG_COMMAND:
-			list = &this->commands;
+			list = 2;
 			break;
 		case LOG_SERVER:
-			list = &this->servers;
+			list = 3;
 			break;
 		case LOG_CHANNEL:
-			list = &this->channels;
+			list = 4;
 			break;
 		case LOG_USER:
-			list = &this->users;
+			list = 5;
 			break;
 		case LOG_TERMINAL:
 			return true;
@@ -270,37 +553,52 @@ bool LogInfo::HasType(LogType ltype, const Anope::string &type) const
 		case LOG_DEBUG_2:
 		case LOG_DEBUG_3:
 		case LOG_DEBUG_4:
-			break;
+			return false;
 		case LOG_MODULE:
 		case LOG_NORMAL:
 		default:
-			list = &this->normal;
+			list = 6;
 			break;
 	}
 
-	if (list == NULL)
+	if (this->compiled.empty())
+		this->Compile();
+
+	const unsigned bit = 1U << list;
+	if (this->match_all & bit)
+		return true;
+
+	const std::vector<std::pair<Anope::string, bool> > &patterns = this->compiled[list];
+	if (patterns.empty())
 		return false;
 
-	for (unsigned i = 0; i < list->size(); ++i)
-	{
-		Anope::string cat = list->at(i);
-		bool inverse = false;
-		if (cat[0] == '~')
-		{
-			cat.erase(cat.begin());
-			inverse = true;
-		}
-		if (Anope::Match(type, cat))
+	/* Categories mostly come from a fixed set, so remember what each one matched */
+	if (this->category_types.size() > 1024)
+		this->category_types.clear();
+	std::pair<unsigned, unsigned> &known = this->category_types[type];
+	if (known.first & bit)
+		return known.second & bit;
+
+	bool matched = false;
+	for (unsigned i = 0; i < patterns.size(); ++i)
+		if (Anope::Match(type, patterns[i].first))
 		{
-			return !inverse;
+			matched = !patterns[i].second;
+			break;
 		}
-	}
 
-	return false;
+	known.first |= bit;
+	if (matched)
+		known.second |= bit;
+
+	return matched;
 }
 
 void LogInfo::OpenLogFiles()
 {
+	if (!this->logfiles.empty())
+		LogWriter::Flush();
+
 	for (unsigned i = 0; i < this->logfiles.size(); ++i)
 		delete this->logfiles[i];
 	this->logfiles.clear();
@@ -313,7 +611,7 @@ void LogInfo::OpenLogFiles()
 			continue;
 
 		LogFile *lf = new LogFile(CreateLogName(target));
-		if (!lf->stream.is_open())
+		if (!lf->IsOpen())
 		{
 			Log() << "Unable to open logfile " << lf->GetName();
 			delete lf;
@@ -413,6 +711,6 @@ void LogInfo::ProcessMessage(const Log *l)
 	for (unsigned i = 0; i < this->logfiles.size(); ++i)
 	{
 		LogFile *lf = this->logfiles[i];
-		lf->stream << GetTimeStamp() << " " << buffer << std::endl;
+		LogWriter::Write(lf, GetTimeStamp() + " " + buffer, l->type >= LOG_RAWIO);
 	}
 }
@@ -206,6 +206,9 @@ int main(int ac, char **av, char **envp)
 
 	if (Anope::Restarting)
 	{
+		/* exec() does not run atexit handlers */
+		LogWriter::Stop();
+
 		chdir(BinaryDir.c_str());
 		Anope::string sbin = "./" + Anope::ServicesBin;
 		av[0] = const_cast<char *>(sbin.c_str());
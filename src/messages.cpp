@@ -139,6 +139,13 @@ void Join::SJoin(MessageSource &source, const Anope::string &chan, time_t ts, co
 		/* Add the user to the channel */
 		c->JoinUser(u, keep_their_modes ? &status : NULL);
 
+		/* Users joining in a burst are checked with the rest of the channel once it is over, see Server::Sync */
+		if (!u->server->IsSynced())
+		{
+			c->QueueBurstJoin(u);
+			continue;
+		}
+
 		/* Check if the user is allowed to join */
 		if (c->CheckKick(u))
 			continue;
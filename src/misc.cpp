@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #ifndef _WIN32
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netdb.h>
 #endif
 
@@ -403,39 +404,123 @@ Anope::string Anope::Expires(time_t expires, const NickCore *nc)
 	}
 }
 
-bool Anope::Match(const Anope::string &str, const Anope::string &mask, bool case_sensitive, bool use_regex)
+namespace
 {
-	size_t s = 0, m = 0, str_len = str.length(), mask_len = mask.length();
+	typedef std::list<std::pair<Anope::string, Regex *> > RegexList;
 
-	if (use_regex && mask_len >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/')
+	/* Cached regexes, most recently used first */
+	RegexList regex_list;
+	TR1NS::unordered_map<Anope::string, RegexList::iterator, Anope::hash_cs> regex_map;
+
+	/* What the cached regexes were compiled with */
+	Configuration::Conf *regex_conf = NULL;
+	Anope::string regex_engine;
+	RegexProvider *regex_provider = NULL;
+	unsigned regex_generation = 0;
+	bool regex_resolved = false;
+}
+
+unsigned long RegexCache::Hits = 0, RegexCache::Misses = 0;
+
+RegexProvider::~RegexProvider()
+{
+	if (regex_provider == this)
+		RegexCache::Clear();
+}
+
+Regex *RegexCache::Get(const Anope::string &expression)
+{
+	if (Config != regex_conf)
 	{
-		Anope::string stripped_mask = mask.substr(1, mask_len - 2);
-		// This is often called with the same mask multiple times in a row, so cache it
-		static Regex *r = NULL;
+		regex_conf = Config;
 
-		if (r == NULL || r->GetExpression() != stripped_mask)
+		const Anope::string &engine = Config->GetBlock("options")->Get<const Anope::string>("regexengine");
+		if (engine != regex_engine)
 		{
-			ServiceReference<RegexProvider> provider("Regex", Config->GetBlock("options")->Get<const Anope::string>("regexengine"));
-			if (provider)
-			{
-				try
-				{
-					delete r;
-					r = NULL;
-					// This may throw
-					r = provider->Compile(stripped_mask);
-				}
-				catch (const RegexException &ex)
-				{
-					Log(LOG_DEBUG) << ex.GetReason();
-				}
-			}
-			else
-			{
-				delete r;
-				r = NULL;
-			}
+			Clear();
+			regex_engine = engine;
 		}
+	}
+
+	/* Services are only added and removed when modules load and unload, so only look the provider up again then */
+	if (!regex_resolved || regex_generation != Service::GetGeneration())
+	{
+		RegexProvider *provider = regex_engine.empty() ? NULL : static_cast<RegexProvider *>(Service::FindService("Regex", regex_engine));
+		if (provider != regex_provider)
+			Clear();
+
+		regex_provider = provider;
+		regex_generation = Service::GetGeneration();
+		regex_resolved = true;
+	}
+
+	if (regex_provider == NULL)
+		return NULL;
+
+	TR1NS::unordered_map<Anope::string, RegexList::iterator, Anope::hash_cs>::iterator it = regex_map.find(expression);
+	if (it != regex_map.end())
+	{
+		++Hits;
+		regex_list.splice(regex_list.begin(), regex_list, it->second);
+		return it->second->second;
+	}
+
+	++Misses;
+
+	/* Invalid expressions are cached too, as NULL, so they aren't recompiled every time */
+	Regex *r = NULL;
+	try
+	{
+		r = regex_provider->Compile(expression);
+	}
+	catch (const RegexException &ex)
+	{
+		Log(LOG_DEBUG) << ex.GetReason();
+	}
+
+	regex_list.push_front(std::make_pair(expression, r));
+	regex_map[expression] = regex_list.begin();
+
+	if (regex_map.size() > MaxSize)
+	{
+		regex_map.erase(regex_list.back().first);
+		delete regex_list.back().second;
+		regex_list.pop_back();
+	}
+
+	return r;
+}
+
+size_t RegexCache::Size()
+{
+	return regex_map.size();
+}
+
+void RegexCache::Clear()
+{
+	for (RegexList::iterator it = regex_list.begin(); it != regex_list.end(); ++it)
+		delete it->second;
+	regex_list.clear();
+	regex_map.clear();
+
+	regex_provider = NULL;
+	regex_resolved = false;
+}
+
+uint64_t Anope::MicroTime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+bool Anope::Match(const Anope::string &str, const Anope::string &mask, bool case_sensitive, bool use_regex)
+{
+	size_t s = 0, m = 0, str_len = str.length(), mask_len = mask.length();
+
+	if (use_regex && mask_len >= 2 && mask[0] == '/' && mask[mask.length() - 1] == '/')
+	{
+		Regex *r = RegexCache::Get(mask.substr(1, mask_len - 2));
 
 		if (r != NULL && r->Matches(str))
 			return true;
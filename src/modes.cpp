@@ -17,8 +17,10 @@
 struct StackerInfo;
 
 /* List of pairs of user/channels and their stacker info */
-static std::map<User *, StackerInfo *> UserStackerObjects;
-static std::map<Channel *, StackerInfo *> ChannelStackerObjects;
+static TR1NS::unordered_map<User *, StackerInfo *> UserStackerObjects;
+static TR1NS::unordered_map<Channel *, StackerInfo *> ChannelStackerObjects;
+/* Stacker info which has been sent and can be reused */
+static std::vector<StackerInfo *> StackerPool;
 
 /* Array of all modes Anope knows about.*/
 static std::vector<ChannelMode *> ChannelModes;
@@ -39,12 +41,48 @@ static std::vector<ChannelModeStatus *> ChannelModesByStatus;
 /* Number of generic modes we support */
 unsigned ModeManager::GenericChannelModes = 0, ModeManager::GenericUserModes = 0;
 
+ModeStackerStats ModeManager::StackerStats;
+
+/* A mode and the param it is keyed by in the stacker. Param modes have one
+ * value at a time so are keyed without their param
+ */
+struct StackerKey
+{
+	Mode *mode;
+	Anope::string param;
+
+	StackerKey(Mode *m, const Anope::string &p) : mode(m), param(p) { }
+
+	bool operator==(const StackerKey &other) const
+	{
+		return this->mode == other.mode && this->param.equals_cs(other.param);
+	}
+};
+
+struct StackerKeyHash
+{
+	size_t operator()(const StackerKey &k) const
+	{
+		return Anope::hash_cs()(k.param) * 31 + reinterpret_cast<size_t>(k.mode);
+	}
+};
+
 struct StackerInfo
 {
-	/* Modes to be added */
-	std::list<std::pair<Mode *, Anope::string> > AddModes;
-	/* Modes to be deleted */
-	std::list<std::pair<Mode *, Anope::string> > DelModes;
+	struct Change
+	{
+		/* The mode, or NULL if this change was replaced or undone by a later one */
+		Mode *mode;
+		Anope::string param;
+		bool set;
+
+		Change(Mode *m, const Anope::string &p, bool s) : mode(m), param(p), set(s) { }
+	};
+
+	/* Mode changes in the order they were made */
+	std::vector<Change> changes;
+	/* Position in changes of the current change of each mode */
+	TR1NS::unordered_map<StackerKey, size_t, StackerKeyHash> index;
 	/* Bot this is sent from */
 	BotInfo *bi;
 
@@ -56,6 +94,11 @@ struct StackerInfo
 	 * @param param The param for the mode
 	 */
 	void AddMode(Mode *mode, bool set, const Anope::string &param);
+
+	/** Drop every change of a mode
+	 * @param mode The mode
+	 */
+	void DelMode(Mode *mode);
 };
 
 ChannelStatus::ChannelStatus()
@@ -261,53 +304,51 @@ bool ChannelModeNoone::CanSet(User *u) const
 
 void StackerInfo::AddMode(Mode *mode, bool set, const Anope::string &param)
 {
-	bool is_param = mode->type == MODE_PARAM;
+	++ModeManager::StackerStats.changes;
 
-	std::list<std::pair<Mode *, Anope::string> > *list, *otherlist;
-	if (set)
-	{
-		list = &AddModes;
-		otherlist = &DelModes;
-	}
-	else
-	{
-		list = &DelModes;
-		otherlist = &AddModes;
-	}
+	/* The param must match too (can have multiple status or list modes), but
+	 * if it is a param mode it can match no matter what the param is
+	 */
+	StackerKey key(mode, mode->type == MODE_PARAM ? "" : param);
 
-	/* Loop through the list and find if this mode is already on here */
-	std::list<std::pair<Mode *, Anope::string > >::iterator it, it_end;
-	for (it = list->begin(), it_end = list->end(); it != it_end; ++it)
+	TR1NS::unordered_map<StackerKey, size_t, StackerKeyHash>::iterator it = this->index.find(key);
+	if (it != this->index.end())
 	{
-		/* The param must match too (can have multiple status or list modes), but
-		 * if it is a param mode it can match no matter what the param is
-		 */
-		if (it->first == mode && (is_param || param.equals_cs(it->second)))
-		{
-			list->erase(it);
-			/* It can only be on this list once */
-			break;
-		}
-	}
-	/* If the mode is on the other list, remove it from there (eg, we don't want +o-o Adam Adam) */
-	for (it = otherlist->begin(), it_end = otherlist->end(); it != it_end; ++it)
-	{
-		/* The param must match too (can have multiple status or list modes), but
-		 * if it is a param mode it can match no matter what the param is
+		Change &old = this->changes[it->second];
+		bool old_set = old.set;
+
+		old.mode = NULL;
+		this->index.erase(it);
+		++ModeManager::StackerStats.coalesced;
+
+		/* Setting and unsetting the same mode within the same cycle makes no change
+		 * (eg, we don't want +o-o Adam Adam), so neither is sent. This causes no problems
+		 * with something like - + and -, because after the second mode change there is
+		 * nothing stacked, and the third mode change starts fresh.
 		 */
-		if (it->first == mode && (is_param || param.equals_cs(it->second)))
+		if (old_set != set)
 		{
-			otherlist->erase(it);
+			++ModeManager::StackerStats.coalesced;
 			return;
-			/* Note that we return here because this is like setting + and - on the same mode within the same
-			 * cycle, no change is made. This causes no problems with something like - + and -, because after the
-			 * second mode change the list is empty, and the third mode change starts fresh.
-			 */
 		}
 	}
 
 	/* Add this mode and its param to our list */
-	list->push_back(std::make_pair(mode, param));
+	this->index[key] = this->changes.size();
+	this->changes.push_back(Change(mode, param, set));
+}
+
+void StackerInfo::DelMode(Mode *mode)
+{
+	for (unsigned i = 0; i < this->changes.size(); ++i)
+	{
+		Change &change = this->changes[i];
+		if (change.mode != mode)
+			continue;
+
+		this->index.erase(StackerKey(mode, mode->type == MODE_PARAM ? "" : change.param));
+		change.mode = NULL;
+	}
 }
 
 static class ModePipe : public Pipe
@@ -326,69 +367,86 @@ static class ModePipe : public Pipe
 template<typename List, typename Object>
 static StackerInfo *GetInfo(List &l, Object *o)
 {
-	typename List::const_iterator it = l.find(o);
-	if (it != l.end())
-		return it->second;
+	StackerInfo *&s = l[o];
+	if (s != NULL)
+		return s;
 
-	StackerInfo *s = new StackerInfo();
-	l[o] = s;
+	if (!StackerPool.empty())
+	{
+		s = StackerPool.back();
+		StackerPool.pop_back();
+	}
+	else
+		s = new StackerInfo();
 	return s;
 }
 
-/** Build a list of mode strings to send to the IRCd from the mode stacker
+/** Return stacker info which has been sent to the pool
+ * @param info The stacker info
+ */
+static void ReleaseInfo(StackerInfo *info)
+{
+	/* Keep a few around with their storage to reuse, but don't hold on to the storage of a huge burst */
+	if (StackerPool.size() >= 64 || info->changes.capacity() > 512)
+	{
+		delete info;
+		return;
+	}
+
+	info->changes.clear();
+	info->index.clear();
+	info->bi = NULL;
+	StackerPool.push_back(info);
+}
+
+/** Build the mode strings to send to the IRCd from the mode stacker
  * @param info The stacker info for a channel or user
- * @return a list of strings
+ * @param ret Where to put the strings
  */
-static std::list<Anope::string> BuildModeStrings(StackerInfo *info)
+static void BuildModeStrings(StackerInfo *info, std::vector<Anope::string> &ret)
 {
-	std::list<Anope::string> ret;
-	std::list<std::pair<Mode *, Anope::string> >::iterator it, it_end;
-	Anope::string buf = "+", parambuf;
+	Anope::string buf, parambuf;
 	unsigned NModes = 0;
+	/* Leave room for command, channel, etc */
+	const size_t maxlen = IRCD->MaxLine - 100;
 
-	for (it = info->AddModes.begin(), it_end = info->AddModes.end(); it != it_end; ++it)
+	/* Modes being set go first, then modes being unset */
+	for (int pass = 0; pass < 2; ++pass)
 	{
-		if (++NModes > IRCD->MaxModes || (buf.length() + parambuf.length() > IRCD->MaxLine - 100)) // Leave room for command, channel, etc
+		bool set = !pass, sign = false;
+
+		for (unsigned i = 0; i < info->changes.size(); ++i)
 		{
-			ret.push_back(buf + parambuf);
-			buf = "+";
-			parambuf.clear();
-			NModes = 1;
-		}
+			const StackerInfo::Change &change = info->changes[i];
+			if (!change.mode || change.set != set)
+				continue;
 
-		buf += it->first->mchar;
+			size_t len = (sign ? 1 : 2) + (change.param.empty() ? 0 : change.param.length() + 1);
+			if (NModes && (NModes >= IRCD->MaxModes || buf.length() + parambuf.length() + len > maxlen))
+			{
+				ret.push_back(buf + parambuf);
+				buf.clear();
+				parambuf.clear();
+				NModes = 0;
+				sign = false;
+			}
 
-		if (!it->second.empty())
-			parambuf += " " + it->second;
-	}
+			if (!sign)
+			{
+				buf += set ? '+' : '-';
+				sign = true;
+			}
 
-	if (buf[buf.length() - 1] == '+')
-		buf.erase(buf.length() - 1);
+			buf += change.mode->mchar;
+			++NModes;
 
-	buf += "-";
-	for (it = info->DelModes.begin(), it_end = info->DelModes.end(); it != it_end; ++it)
-	{
-		if (++NModes > IRCD->MaxModes || (buf.length() + parambuf.length() > IRCD->MaxLine - 100)) // Leave room for command, channel, etc
-		{
-			ret.push_back(buf + parambuf);
-			buf = "-";
-			parambuf.clear();
-			NModes = 1;
+			if (!change.param.empty())
+				parambuf += " " + change.param;
 		}
-
-		buf += it->first->mchar;
-
-		if (!it->second.empty())
-			parambuf += " " + it->second;
 	}
 
-	if (buf[buf.length() - 1] == '-')
-		buf.erase(buf.length() - 1);
-
 	if (!buf.empty())
 		ret.push_back(buf + parambuf);
-
-	return ret;
 }
 
 bool ModeManager::AddUserMode(UserMode *um)
@@ -638,49 +696,57 @@ void ModeManager::StackerAdd(BotInfo *bi, User *u, UserMode *um, bool Set, const
 
 void ModeManager::ProcessModes()
 {
+	std::vector<Anope::string> ModeStrings;
+
 	if (!UserStackerObjects.empty())
 	{
-		for (std::map<User *, StackerInfo *>::const_iterator it = UserStackerObjects.begin(), it_end = UserStackerObjects.end(); it != it_end; ++it)
+		for (TR1NS::unordered_map<User *, StackerInfo *>::const_iterator it = UserStackerObjects.begin(), it_end = UserStackerObjects.end(); it != it_end; ++it)
 		{
 			User *u = it->first;
 			StackerInfo *s = it->second;
 
-			std::list<Anope::string> ModeStrings = BuildModeStrings(s);
-			for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
-				IRCD->SendMode(s->bi, u, "%s", lit->c_str());
-			delete it->second;
+			ModeStrings.clear();
+			BuildModeStrings(s, ModeStrings);
+			for (unsigned i = 0; i < ModeStrings.size(); ++i)
+				IRCD->SendMode(s->bi, u, "%s", ModeStrings[i].c_str());
+			StackerStats.lines += ModeStrings.size();
+			ReleaseInfo(s);
 		}
 		UserStackerObjects.clear();
 	}
 
 	if (!ChannelStackerObjects.empty())
 	{
-		for (std::map<Channel *, StackerInfo *>::const_iterator it = ChannelStackerObjects.begin(), it_end = ChannelStackerObjects.end(); it != it_end; ++it)
+		for (TR1NS::unordered_map<Channel *, StackerInfo *>::const_iterator it = ChannelStackerObjects.begin(), it_end = ChannelStackerObjects.end(); it != it_end; ++it)
 		{
 			Channel *c = it->first;
 			StackerInfo *s = it->second;
 
-			std::list<Anope::string> ModeStrings = BuildModeStrings(s);
-			for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
-				IRCD->SendMode(s->bi, c, "%s", lit->c_str());
-			delete it->second;
+			ModeStrings.clear();
+			BuildModeStrings(s, ModeStrings);
+			for (unsigned i = 0; i < ModeStrings.size(); ++i)
+				IRCD->SendMode(s->bi, c, "%s", ModeStrings[i].c_str());
+			StackerStats.lines += ModeStrings.size();
+			ReleaseInfo(s);
 		}
 		ChannelStackerObjects.clear();
 	}
 }
 
 template<typename T>
-static void StackerDel(std::map<T *, StackerInfo *> &map, T *obj)
+static void StackerDel(TR1NS::unordered_map<T *, StackerInfo *> &map, T *obj)
 {
-	typename std::map<T *, StackerInfo *>::iterator it = map.find(obj);
+	typename TR1NS::unordered_map<T *, StackerInfo *>::iterator it = map.find(obj);
 	if (it != map.end())
 	{
 		StackerInfo *si = it->second;
-		std::list<Anope::string> ModeStrings = BuildModeStrings(si);
-		for (std::list<Anope::string>::iterator lit = ModeStrings.begin(), lit_end = ModeStrings.end(); lit != lit_end; ++lit)
-			IRCD->SendMode(si->bi, obj, "%s", lit->c_str());
+		std::vector<Anope::string> ModeStrings;
+		BuildModeStrings(si, ModeStrings);
+		for (unsigned i = 0; i < ModeStrings.size(); ++i)
+			IRCD->SendMode(si->bi, obj, "%s", ModeStrings[i].c_str());
+		ModeManager::StackerStats.lines += ModeStrings.size();
 
-		delete si;
+		ReleaseInfo(si);
 		map.erase(it);
 	}
 }
@@ -697,49 +763,11 @@ void ModeManager::StackerDel(Channel *c)
 
 void ModeManager::StackerDel(Mode *m)
 {
-	for (std::map<User *, StackerInfo *>::const_iterator it = UserStackerObjects.begin(), it_end = UserStackerObjects.end(); it != it_end;)
-	{
-		StackerInfo *si = it->second;
-		++it;
-
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->AddModes.begin(), it2_end = si->AddModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->AddModes.erase(it2);
-			else
-				++it2;
-		}
-
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->DelModes.begin(), it2_end = si->DelModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->DelModes.erase(it2);
-			else
-				++it2;
-		}
-	}
-
-	for (std::map<Channel *, StackerInfo *>::const_iterator it = ChannelStackerObjects.begin(), it_end = ChannelStackerObjects.end(); it != it_end;)
-	{
-		StackerInfo *si = it->second;
-		++it;
-
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->AddModes.begin(), it2_end = si->AddModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->AddModes.erase(it2);
-			else
-				++it2;
-		}
+	for (TR1NS::unordered_map<User *, StackerInfo *>::const_iterator it = UserStackerObjects.begin(), it_end = UserStackerObjects.end(); it != it_end; ++it)
+		it->second->DelMode(m);
 
-		for (std::list<std::pair<Mode *, Anope::string> >::iterator it2 = si->DelModes.begin(), it2_end = si->DelModes.end(); it2 != it2_end;)
-		{
-			if (it2->first == m)
-				it2 = si->DelModes.erase(it2);
-			else
-				++it2;
-		}
-	}
+	for (TR1NS::unordered_map<Channel *, StackerInfo *>::const_iterator it = ChannelStackerObjects.begin(), it_end = ChannelStackerObjects.end(); it != it_end; ++it)
+		it->second->DelMode(m);
 }
 
 Entry::Entry(const Anope::string &m, const Anope::string &fh) : name(m), mask(fh), cidr_len(0), family(0)
@@ -31,6 +31,7 @@ NickAlias::NickAlias(const Anope::string &nickname, NickCore* nickcore) : Serial
 	this->nick = nickname;
 	this->nc = nickcore;
 	nickcore->aliases->push_back(this);
+	AccessCache::Invalidate(nickcore);
 
 	size_t old = NickAliasList->size();
 	(*NickAliasList)[this->nick] = this;
@@ -61,6 +62,7 @@ NickAlias::~NickAlias()
 		std::vector<NickAlias *>::iterator it = std::find(this->nc->aliases->begin(), this->nc->aliases->end(), this);
 		if (it != this->nc->aliases->end())
 			this->nc->aliases->erase(it);
+		AccessCache::Invalidate(this->nc);
 		if (this->nc->aliases->empty())
 		{
 			delete this->nc;
@@ -175,6 +177,7 @@ Serializable* NickAlias::Unserialize(Serializable *obj, Serialize::Data &data)
 		std::vector<NickAlias *>::iterator it = std::find(na->nc->aliases->begin(), na->nc->aliases->end(), na);
 		if (it != na->nc->aliases->end())
 			na->nc->aliases->erase(it);
+		AccessCache::Invalidate(na->nc);
 
 		if (na->nc->aliases->empty())
 			delete na->nc;
@@ -183,6 +186,7 @@ Serializable* NickAlias::Unserialize(Serializable *obj, Serialize::Data &data)
 
 		na->nc = core;
 		core->aliases->push_back(na);
+		AccessCache::Invalidate(core);
 	}
 
 	data["last_quit"] >> na->last_quit;
@@ -16,6 +16,68 @@
 #include "users.h"
 #include "regchannel.h"
 
+namespace
+{
+	/* The parsed form of a received line. One of these is kept for the life of
+	 * the process so that the strings and the parameter vector keep their storage
+	 * between lines instead of being reallocated for each one.
+	 */
+	struct ParsedMessage
+	{
+		Anope::map<Anope::string> tags;
+		Anope::string source, command;
+		std::vector<Anope::string> params;
+		bool in_use;
+
+		ParsedMessage() : in_use(false) { }
+	};
+
+	class ParsedMessageHolder
+	{
+		ParsedMessage *msg;
+	 public:
+		ParsedMessageHolder(ParsedMessage &m) : msg(&m) { msg->in_use = true; }
+		~ParsedMessageHolder() { msg->in_use = false; }
+	};
+
+	/* Maps command names to the protocol module's handlers. Every lookup, including
+	 * a miss, is remembered in a case insensitive hash map, and the whole table is
+	 * dropped whenever a service or alias is added or removed, which is what happens
+	 * when modules load or unload.
+	 */
+	class MessageDispatcher
+	{
+		Anope::hash_map<IRCDMessage *> handlers;
+		/* Prefix of the protocol module's message services, "name/" */
+		Anope::string prefix;
+		unsigned generation;
+		bool valid;
+
+	 public:
+		MessageDispatcher() : generation(0), valid(false) { }
+
+		IRCDMessage *Find(const Anope::string &command)
+		{
+			if (!this->valid || this->generation != Service::GetGeneration())
+			{
+				this->handlers.clear();
+				Module *proto = ModuleManager::FindFirstOf(PROTOCOL);
+				this->prefix = proto ? proto->name + "/" : "/";
+				this->generation = Service::GetGeneration();
+				this->valid = true;
+			}
+
+			Anope::hash_map<IRCDMessage *>::const_iterator it = this->handlers.find(command);
+			if (it != this->handlers.end())
+				return it->second;
+
+			IRCDMessage *m = static_cast<IRCDMessage *>(Service::FindService("IRCDMessage", this->prefix + command.lower()));
+			this->handlers[command] = m;
+			return m;
+		}
+	};
+}
+
 void Anope::Process(const Anope::string &buffer)
 {
 	/* If debugging, log the buffer */
@@ -24,9 +86,15 @@ void Anope::Process(const Anope::string &buffer)
 	if (buffer.empty())
 		return;
 
-	Anope::map<Anope::string> tags;
-	Anope::string source, command;
-	std::vector<Anope::string> params;
+	static ParsedMessage shared;
+	/* If a handler processes another line while we are still using the shared storage, give it its own */
+	ParsedMessage local;
+	ParsedMessage &msg = shared.in_use ? local : shared;
+	ParsedMessageHolder holder(msg);
+
+	Anope::map<Anope::string> &tags = msg.tags;
+	Anope::string &source = msg.source, &command = msg.command;
+	std::vector<Anope::string> &params = msg.params;
 
 	if (!IRCD->Parse(buffer, tags, source, command, params))
 		return;
@@ -49,8 +117,6 @@ void Anope::Process(const Anope::string &buffer)
 				Log() << "params " << i << ": " << params[i];
 	}
 
-	static const Anope::string proto_name = ModuleManager::FindFirstOf(PROTOCOL) ? ModuleManager::FindFirstOf(PROTOCOL)->name : "";
-
 	MessageSource src(source);
 
 	EventReturn MOD_RESULT;
@@ -58,7 +124,8 @@ void Anope::Process(const Anope::string &buffer)
 	if (MOD_RESULT == EVENT_STOP)
 		return;
 
-	ServiceReference<IRCDMessage> m("IRCDMessage", proto_name + "/" + command.lower());
+	static MessageDispatcher dispatcher;
+	IRCDMessage *m = dispatcher.Find(command);
 	if (!m)
 	{
 		Log(LOG_DEBUG) << "unknown message from server (" << buffer << ")";
@@ -80,25 +147,31 @@ bool IRCDProto::Parse(const Anope::string &buffer, Anope::map<Anope::string> &ta
 	MessageTokenizer tokens(buffer);
 
 	// This will always exist because of the check in Anope::Process.
-	Anope::string token;
+	Anope::string &token = command;
 	tokens.GetMiddle(token);
 
+	tags.clear();
 	if (token[0] == '@')
 	{
 		// The line begins with message tags.
-		sepstream tagstream(token.substr(1), ';');
-		while (tagstream.GetToken(token))
+		for (Anope::string::size_type start = 1, end; start < token.length(); start = end + 1)
 		{
-			const Anope::string::size_type valsep = token.find('=');
-			if (valsep == Anope::string::npos)
+			end = token.find(';', start);
+			if (end == Anope::string::npos)
+				end = token.length();
+			if (end == start)
+				continue;
+
+			const Anope::string::size_type valsep = token.find('=', start);
+			if (valsep == Anope::string::npos || valsep > end)
 			{
 				// Tag has no value.
-				tags[token];
+				tags[token.substr(start, end - start)];
 			}
 			else
 			{
 				// Tag has a value
-				tags[token.substr(0, valsep)] = token.substr(valsep + 1);
+				tags[token.substr(start, valsep - start)] = token.substr(valsep + 1, end - valsep - 1);
 			}
 		}
 
@@ -106,19 +179,26 @@ bool IRCDProto::Parse(const Anope::string &buffer, Anope::map<Anope::string> &ta
 			return false;
 	}
 
+	source.clear();
 	if (token[0] == ':')
 	{
-		source = token.substr(1);
+		source.assign(token, 1);
 		if (!tokens.GetMiddle(token))
 			return false;
 	}
 
-	// Store the command name.
-	command = token;
+	// The command name is left in token, which is command.
 
-	// Retrieve all of the parameters.
-	while (tokens.GetTrailing(token))
-		params.push_back(token);
+	// Retrieve all of the parameters, reusing the storage of any existing ones.
+	std::vector<Anope::string>::size_type count = 0;
+	for (;; ++count)
+	{
+		if (count == params.size())
+			params.push_back("");
+		if (!tokens.GetTrailing(params[count]))
+			break;
+	}
+	params.resize(count);
 
 	return true;
 }
@@ -150,12 +230,12 @@ bool MessageTokenizer::GetMiddle(Anope::string &token)
 	Anope::string::size_type separator = message.find(' ', position);
 	if (separator == Anope::string::npos)
 	{
-		token = message.substr(position);
+		token.assign(message, position);
 		position = message.length();
 		return true;
 	}
 
-	token = message.substr(position, separator - position);
+	token.assign(message, position, separator - position);
 	position = message.find_first_not_of(' ', separator);
 	return true;
 }
@@ -172,7 +252,7 @@ bool MessageTokenizer::GetTrailing(Anope::string &token)
 	// If this is true then we have a <trailing> token!
 	if (message[position] == ':')
 	{
-		token = message.substr(position + 1);
+		token.assign(message, position + 1);
 		position = message.length();
 		return true;
 	}
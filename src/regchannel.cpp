@@ -31,7 +31,10 @@ AutoKick::~AutoKick()
 	{
 		std::vector<AutoKick *>::iterator it = std::find(this->ci->akick->begin(), this->ci->akick->end(), this);
 		if (it != this->ci->akick->end())
+		{
 			this->ci->akick->erase(it);
+			++this->ci->akick_serial;
+		}
 
 		if (nc)
 			nc->RemoveChannelReference(this->ci);
@@ -73,6 +76,7 @@ Serializable* AutoKick::Unserialize(Serializable *obj, Serialize::Data &data)
 		data["mask"] >> ak->mask;
 		data["addtime"] >> ak->addtime;
 		data["last_used"] >> ak->last_used;
+		++ci->akick_serial;
 	}
 	else
 	{
@@ -96,7 +100,7 @@ Serializable* AutoKick::Unserialize(Serializable *obj, Serialize::Data &data)
 }
 
 ChannelInfo::ChannelInfo(const Anope::string &chname) : Serializable("ChannelInfo"),
-	access("ChanAccess"), akick("AutoKick")
+	access("ChanAccess"), akick("AutoKick"), akick_serial(0)
 {
 	if (chname.empty())
 		throw CoreException("Empty channel passed to ChannelInfo constructor");
@@ -121,6 +125,9 @@ ChannelInfo::ChannelInfo(const Anope::string &chname) : Serializable("ChannelInf
 	if (old == RegisteredChannelList->size())
 		Log(LOG_DEBUG) << "Duplicate channel " << this->name << " in registered channel table?";
 
+	/* Access entries may link to this channel by name */
+	AccessCache::Clear();
+
 	FOREACH_MOD(OnCreateChan, (this));
 }
 
@@ -134,6 +141,7 @@ ChannelInfo::ChannelInfo(const ChannelInfo &ci) : Serializable("ChannelInfo"),
 
 	this->access->clear();
 	this->akick->clear();
+	++this->akick_serial;
 
 	FOREACH_MOD(OnCreateChan, (this));
 }
@@ -163,6 +171,7 @@ ChannelInfo::~ChannelInfo()
 	}
 
 	RegisteredChannelList->erase(this->name);
+	AccessCache::Clear();
 
 	this->SetFounder(NULL);
 	this->SetSuccessor(NULL);
@@ -371,6 +380,7 @@ BotInfo *ChannelInfo::WhoSends() const
 void ChannelInfo::AddAccess(ChanAccess *taccess)
 {
 	this->access->push_back(taccess);
+	AccessCache::Invalidate(this);
 }
 
 ChanAccess *ChannelInfo::GetAccess(unsigned index) const
@@ -383,7 +393,7 @@ ChanAccess *ChannelInfo::GetAccess(unsigned index) const
 	return acc;
 }
 
-static void FindMatchesRecurse(ChannelInfo *ci, const User *u, const NickCore *account, unsigned int depth, std::vector<ChanAccess::Path> &paths, ChanAccess::Path &path)
+static void FindMatchesRecurse(ChannelInfo *ci, const User *u, const NickCore *account, unsigned int depth, std::vector<ChanAccess::Path> &paths, ChanAccess::Path &path, bool &linked)
 {
 	if (depth > ChanAccess::MAX_DEPTH)
 		return;
@@ -405,15 +415,83 @@ static void FindMatchesRecurse(ChannelInfo *ci, const User *u, const NickCore *a
 			ChanAccess::Path next_path = path;
 			next_path.push_back(a);
 
-			FindMatchesRecurse(next, u, account, depth + 1, paths, next_path);
+			linked = true;
+			FindMatchesRecurse(next, u, account, depth + 1, paths, next_path, linked);
 		}
 	}
 }
 
-static void FindMatches(AccessGroup &group, ChannelInfo *ci, const User *u, const NickCore *account)
+static bool FindMatches(AccessGroup &group, ChannelInfo *ci, const User *u, const NickCore *account)
 {
 	ChanAccess::Path path;
-	FindMatchesRecurse(ci, u, account, 0, group.paths, path);
+	bool linked = false;
+	FindMatchesRecurse(ci, u, account, 0, group.paths, path, linked);
+	return linked;
+}
+
+namespace
+{
+	struct CachedAccess
+	{
+		std::vector<ChanAccess::Path> paths;
+		/* If the paths went through the access list of another channel, the
+		 * value of link_serial when they were found. Changes to that list
+		 * don't invalidate this channel, so the serial is checked instead.
+		 */
+		bool linked;
+		unsigned long serial;
+	};
+
+	typedef std::map<std::pair<const ChannelInfo *, const User *>, CachedAccess> access_cache_map;
+	access_cache_map access_cache;
+	/* The channels each user has cached access on */
+	std::map<const User *, std::set<const ChannelInfo *> > access_cache_users;
+	/* Incremented whenever any access list changes */
+	unsigned long link_serial = 0;
+	/* The configuration the cache was filled with, as it affects how masks match */
+	const Configuration::Conf *access_cache_config = NULL;
+}
+
+unsigned long AccessCache::Hits = 0, AccessCache::Misses = 0;
+
+size_t AccessCache::Size()
+{
+	return access_cache.size();
+}
+
+void AccessCache::Invalidate(const ChannelInfo *ci)
+{
+	++link_serial;
+
+	access_cache_map::iterator first = access_cache.lower_bound(std::make_pair(ci, static_cast<const User *>(NULL)));
+	access_cache_map::iterator last = first;
+	while (last != access_cache.end() && last->first.first == ci)
+		++last;
+	access_cache.erase(first, last);
+}
+
+void AccessCache::Invalidate(const User *u)
+{
+	std::map<const User *, std::set<const ChannelInfo *> >::iterator it = access_cache_users.find(u);
+	if (it == access_cache_users.end())
+		return;
+
+	for (std::set<const ChannelInfo *>::iterator cit = it->second.begin(), cit_end = it->second.end(); cit != cit_end; ++cit)
+		access_cache.erase(std::make_pair(*cit, u));
+	access_cache_users.erase(it);
+}
+
+void AccessCache::Invalidate(const NickCore *nc)
+{
+	for (std::list<User *>::const_iterator it = nc->users.begin(), it_end = nc->users.end(); it != it_end; ++it)
+		Invalidate(*it);
+}
+
+void AccessCache::Clear()
+{
+	++link_serial;
+	access_cache.clear();
+	access_cache_users.clear();
 }
 
 AccessGroup ChannelInfo::AccessFor(const User *u, bool updateLastUsed)
@@ -436,7 +514,49 @@ AccessGroup ChannelInfo::AccessFor(const User *u, bool updateLastUsed)
 	group.ci = this;
 	group.nc = nc;
 
-	FindMatches(group, this, u, u->Account());
+	if (access_cache_config != Config)
+	{
+		AccessCache::Clear();
+		access_cache_config = Config;
+	}
+
+	/* Checking the access list lets database modules load any changes to it first */
+	if (!this->access->empty())
+	{
+		std::pair<const ChannelInfo *, const User *> key(this, u);
+		access_cache_map::iterator it = access_cache.find(key);
+
+		if (it != access_cache.end() && (!it->second.linked || it->second.serial == link_serial))
+		{
+			++AccessCache::Hits;
+			group.paths = it->second.paths;
+
+			for (unsigned i = 0; i < group.paths.size(); ++i)
+			{
+				ChanAccess::Path &p = group.paths[i];
+
+				for (unsigned int j = 0; j < p.size(); ++j)
+					p[j]->QueueUpdate();
+			}
+		}
+		else
+		{
+			++AccessCache::Misses;
+
+			unsigned long serial = link_serial;
+			bool linked = FindMatches(group, this, u, u->Account());
+
+			/* Don't cache anything if an access list changed while matching */
+			if (serial == link_serial)
+			{
+				CachedAccess &cached = access_cache[key];
+				cached.paths = group.paths;
+				cached.linked = linked;
+				cached.serial = serial;
+				access_cache_users[u].insert(this);
+			}
+		}
+	}
 
 	if (group.founder || !group.paths.empty())
 	{
@@ -516,6 +636,7 @@ ChanAccess *ChannelInfo::EraseAccess(unsigned index)
 
 	ChanAccess *ca = this->access->at(index);
 	this->access->erase(this->access->begin() + index);
+	AccessCache::Invalidate(this);
 	return ca;
 }
 
@@ -536,6 +657,7 @@ AutoKick *ChannelInfo::AddAkick(const Anope::string &user, NickCore *akicknc, co
 	autokick->last_used = lu;
 
 	this->akick->push_back(autokick);
+	++this->akick_serial;
 
 	akicknc->AddChannelReference(this);
 
@@ -554,6 +676,7 @@ AutoKick *ChannelInfo::AddAkick(const Anope::string &user, const Anope::string &
 	autokick->last_used = lu;
 
 	this->akick->push_back(autokick);
+	++this->akick_serial;
 
 	return autokick;
 }
@@ -587,6 +710,11 @@ void ChannelInfo::ClearAkick()
 		delete this->akick->back();
 }
 
+unsigned ChannelInfo::GetAkickSerial() const
+{
+	return this->akick_serial;
+}
+
 const Anope::map<int16_t> &ChannelInfo::GetLevelEntries()
 {
 	return this->levels;
@@ -251,6 +251,11 @@ void Server::Sync(bool sync_links)
 	if (this->IsSynced())
 		return;
 
+	/* Check the users who joined channels during the burst before they are synced,
+	 * so they are treated as they would have been when they joined
+	 */
+	Channel::ProcessBurstJoins(this, sync_links);
+
 	syncing = false;
 
 	Log(this, "sync") << "is done syncing";
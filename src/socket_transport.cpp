@@ -13,8 +13,82 @@
 #include "sockets.h"
 #include "socketengine.h"
 
-BufferedSocket::BufferedSocket()
+/* Write buffers which grew larger than this during a burst are released once drained */
+static const size_t MAX_IDLE_BUFSIZE = NET_BUFSIZE * 4;
+
+SocketBuffer::SocketBuffer() : buffer(NULL), head(0), tail(0), capacity(0)
+{
+}
+
+SocketBuffer::~SocketBuffer()
+{
+	delete [] this->buffer;
+}
+
+char *SocketBuffer::prepare(size_t sz)
+{
+	if (this->capacity - this->tail >= sz)
+		return this->buffer + this->tail;
+
+	size_t len = this->length();
+
+	if (this->capacity - len >= sz)
+	{
+		/* There is enough room if the pending data is moved to the front */
+		memmove(this->buffer, this->buffer + this->head, len);
+	}
+	else
+	{
+		size_t newcap = std::max(this->capacity * 2, len + sz);
+		char *newbuf = new char[newcap];
+		if (len)
+			memcpy(newbuf, this->buffer + this->head, len);
+		delete [] this->buffer;
+		this->buffer = newbuf;
+		this->capacity = newcap;
+	}
+
+	this->head = 0;
+	this->tail = len;
+	return this->buffer + this->tail;
+}
+
+void SocketBuffer::commit(size_t sz)
 {
+	this->tail += sz;
+}
+
+void SocketBuffer::append(const char *buf, size_t sz)
+{
+	if (!sz)
+		return;
+	memcpy(this->prepare(sz), buf, sz);
+	this->commit(sz);
+}
+
+void SocketBuffer::consume(size_t sz)
+{
+	this->head += std::min(sz, this->length());
+
+	if (this->head == this->tail)
+	{
+		if (this->capacity > MAX_IDLE_BUFSIZE)
+			this->clear();
+		else
+			this->head = this->tail = 0;
+	}
+}
+
+void SocketBuffer::clear()
+{
+	delete [] this->buffer;
+	this->buffer = NULL;
+	this->head = this->tail = this->capacity = 0;
+}
+
+BufferedSocket::BufferedSocket() : recv_len(0)
+{
+	this->flags[SF_DRAIN] = true;
 }
 
 BufferedSocket::~BufferedSocket()
@@ -23,32 +97,48 @@ BufferedSocket::~BufferedSocket()
 
 bool BufferedSocket::ProcessRead()
 {
-	char tbuffer[NET_BUFSIZE];
-
 	this->recv_len = 0;
+	this->flags[SF_READ_AGAIN] = false;
 
-	int len = this->io->Recv(this, tbuffer, sizeof(tbuffer) - 1);
-	if (len == 0)
-		return false;
-	if (len < 0)
-		return SocketEngine::IgnoreErrno();
-
-	tbuffer[len] = 0;
-	this->read_buffer.append(tbuffer);
-	this->recv_len = len;
+	/* An edge triggered socket engine won't tell us about data we leave unread,
+	 * so read until the socket would block */
+	for (unsigned reads = 0;; ++reads)
+	{
+		/* The socket may have stopped reading to let what it has read be dealt with first */
+		if (!this->flags[SF_READABLE])
+			break;
+
+		if (reads == SocketEngine::DrainReads)
+		{
+			this->flags[SF_READ_AGAIN] = true;
+			break;
+		}
+
+		int len = this->io->Recv(this, this->read_buffer.prepare(NET_BUFSIZE), NET_BUFSIZE);
+		if (len == 0)
+			return false;
+		if (len < 0)
+			return SocketEngine::IgnoreErrno();
+
+		this->read_buffer.commit(len);
+		this->recv_len += len;
+
+		if (!SocketEngine::EdgeTriggered)
+			break;
+	}
 
 	return true;
 }
 
 bool BufferedSocket::ProcessWrite()
 {
-	int count = this->io->Send(this, this->write_buffer);
+	int count = this->io->Send(this, this->write_buffer.data(), this->write_buffer.length());
 	if (count == 0)
 		return false;
 	if (count < 0)
 		return SocketEngine::IgnoreErrno();
 
-	this->write_buffer = this->write_buffer.substr(count);
+	this->write_buffer.consume(count);
 	if (this->write_buffer.empty())
 		SocketEngine::Change(this, false, SF_WRITABLE);
 
@@ -57,18 +147,28 @@ bool BufferedSocket::ProcessWrite()
 
 const Anope::string BufferedSocket::GetLine()
 {
-	size_t s = this->read_buffer.find('\n');
-	if (s == Anope::string::npos)
+	/* Skip over blank lines and the \r\n left behind by the previous line */
+	while (!this->read_buffer.empty() && (*this->read_buffer.data() == '\r' || *this->read_buffer.data() == '\n'))
+		this->read_buffer.consume(1);
+
+	const char *buf = this->read_buffer.data();
+	const char *nl = static_cast<const char *>(memchr(buf, '\n', this->read_buffer.length()));
+	if (nl == NULL)
 		return "";
-	Anope::string str = this->read_buffer.substr(0, s + 1);
-	this->read_buffer.erase(0, s + 1);
-	this->read_buffer.ltrim("\r\n");
-	return str.trim("\r\n");
+
+	size_t len = nl - buf;
+	while (len && buf[len - 1] == '\r')
+		--len;
+
+	Anope::string str(buf, len);
+	this->read_buffer.consume(nl - buf + 1);
+	return str;
 }
 
 void BufferedSocket::Write(const char *buffer, size_t l)
 {
-	this->write_buffer += buffer + Anope::string("\r\n");
+	this->write_buffer.append(buffer, l);
+	this->write_buffer.append("\r\n", 2);
 	SocketEngine::Change(this, true, SF_WRITABLE);
 }
 
@@ -84,7 +184,10 @@ void BufferedSocket::Write(const char *message, ...)
 	int len = vsnprintf(tbuffer, sizeof(tbuffer), message, vi);
 	va_end(vi);
 
-	this->Write(tbuffer, std::min(len, static_cast<int>(sizeof(tbuffer))));
+	if (len < 0)
+		return;
+
+	this->Write(tbuffer, std::min(len, static_cast<int>(sizeof(tbuffer) - 1)));
 }
 
 void BufferedSocket::Write(const Anope::string &message)
@@ -103,20 +206,9 @@ int BufferedSocket::WriteBufferLen() const
 }
 
 
-BinarySocket::DataBlock::DataBlock(const char *b, size_t l)
-{
-	this->orig = this->buf = new char[l];
-	memcpy(this->buf, b, l);
-	this->len = l;
-}
-
-BinarySocket::DataBlock::~DataBlock()
-{
-	delete [] this->orig;
-}
-
 BinarySocket::BinarySocket()
 {
+	this->flags[SF_DRAIN] = true;
 }
 
 BinarySocket::~BinarySocket()
@@ -127,11 +219,29 @@ bool BinarySocket::ProcessRead()
 {
 	char tbuffer[NET_BUFSIZE];
 
-	int len = this->io->Recv(this, tbuffer, sizeof(tbuffer));
-	if (len <= 0)
-		return false;
+	this->flags[SF_READ_AGAIN] = false;
+
+	for (unsigned reads = 0; reads < SocketEngine::DrainReads; ++reads)
+	{
+		/* See BufferedSocket::ProcessRead */
+		if (!this->flags[SF_READABLE])
+			return true;
+
+		int len = this->io->Recv(this, tbuffer, sizeof(tbuffer));
+		if (len < 0 && SocketEngine::IgnoreErrno())
+			return true;
+		if (len <= 0)
+			return false;
+
+		if (!this->Read(tbuffer, len))
+			return false;
+
+		if (!SocketEngine::EdgeTriggered || this->flags[SF_DEAD])
+			return true;
+	}
 
-	return this->Read(tbuffer, len);
+	this->flags[SF_READ_AGAIN] = true;
+	return true;
 }
 
 bool BinarySocket::ProcessWrite()
@@ -142,21 +252,11 @@ bool BinarySocket::ProcessWrite()
 		return true;
 	}
 
-	DataBlock *d = this->write_buffer.front();
-
-	int len = this->io->Send(this, d->buf, d->len);
+	int len = this->io->Send(this, this->write_buffer.data(), this->write_buffer.length());
 	if (len <= -1)
 		return false;
-	else if (static_cast<size_t>(len) == d->len)
-	{
-		delete d;
-		this->write_buffer.pop_front();
-	}
-	else
-	{
-		d->buf += len;
-		d->len -= len;
-	}
+
+	this->write_buffer.consume(len);
 
 	if (this->write_buffer.empty())
 		SocketEngine::Change(this, false, SF_WRITABLE);
@@ -168,7 +268,7 @@ void BinarySocket::Write(const char *buffer, size_t l)
 {
 	if (l == 0)
 		return;
-	this->write_buffer.push_back(new DataBlock(buffer, l));
+	this->write_buffer.append(buffer, l);
 	SocketEngine::Change(this, true, SF_WRITABLE);
 }
 
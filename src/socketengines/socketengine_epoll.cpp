@@ -14,6 +14,7 @@
 #include "sockets.h"
 #include "socketengine.h"
 #include "config.h"
+#include "logger.h"
 
 #include <sys/epoll.h>
 #include <ulimit.h>
@@ -21,6 +22,33 @@
 
 static int EngineHandle;
 static std::vector<epoll_event> events;
+/* Whether each fd is registered as edge triggered */
+static std::vector<bool> edge_triggered;
+/* Sockets which stopped reading before they would block */
+static std::vector<int> read_again;
+
+static void Register(Socket *s, int mod)
+{
+	int fd = s->GetFD();
+	bool edge = SocketEngine::EdgeTriggered && s->flags[SF_DRAIN];
+
+	epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+
+	ev.events = (s->flags[SF_READABLE] ? EPOLLIN : 0) | (s->flags[SF_WRITABLE] ? EPOLLOUT : 0) | (edge ? EPOLLET : 0);
+	ev.data.fd = fd;
+
+	if (epoll_ctl(EngineHandle, mod, fd, &ev) == -1)
+		 throw SocketException("Unable to epoll_ctl() fd " + stringify(fd) + " to epoll: " + Anope::LastError());
+
+	if (fd >= 0)
+	{
+		if (static_cast<size_t>(fd) >= edge_triggered.size())
+			edge_triggered.resize(std::max(static_cast<size_t>(fd) + 1, edge_triggered.size() * 2));
+		edge_triggered[fd] = edge && mod != EPOLL_CTL_DEL;
+	}
+}
 
 void SocketEngine::Init()
 {
@@ -49,33 +77,66 @@ void SocketEngine::Change(Socket *s, bool set, SocketFlag flag)
 
 	bool now_registered = s->flags[SF_READABLE] || s->flags[SF_WRITABLE];
 
-	epoll_event ev;
-
-	memset(&ev, 0, sizeof(ev));
-
-	ev.events = (s->flags[SF_READABLE] ? EPOLLIN : 0) | (s->flags[SF_WRITABLE] ? EPOLLOUT : 0);
-	ev.data.fd = s->GetFD();
-
-	int mod;
 	if (!before_registered && now_registered)
-		mod = EPOLL_CTL_ADD;
+		Register(s, EPOLL_CTL_ADD);
 	else if (before_registered && !now_registered)
-		mod = EPOLL_CTL_DEL;
+		Register(s, EPOLL_CTL_DEL);
 	else if (before_registered && now_registered)
-		mod = EPOLL_CTL_MOD;
-	else
-		return;
+		Register(s, EPOLL_CTL_MOD);
+}
 
-	if (epoll_ctl(EngineHandle, mod, ev.data.fd, &ev) == -1)
-		 throw SocketException("Unable to epoll_ctl() fd " + stringify(ev.data.fd) + " to epoll: " + Anope::LastError());
+/* Handle a socket being ready, returns false if it was deleted */
+static bool ProcessSocket(Socket *s, bool readable, bool writable)
+{
+	if (!s->Process())
+	{
+		if (s->flags[SF_DEAD])
+		{
+			delete s;
+			return false;
+		}
+		return true;
+	}
+
+	if (readable && !s->ProcessRead())
+		s->flags[SF_DEAD] = true;
+
+	if (writable && !s->ProcessWrite())
+		s->flags[SF_DEAD] = true;
+
+	if (s->flags[SF_DEAD])
+	{
+		delete s;
+		return false;
+	}
+
+	if (s->flags[SF_READ_AGAIN])
+		read_again.push_back(s->GetFD());
+
+	return true;
 }
 
 void SocketEngine::Process()
 {
-	if (Sockets.size() > events.size())
+	/* Edge triggering can be turned on by a rehash, but turning it off again would leave
+	 * sockets registered as edge triggered which no longer drain themselves
+	 */
+	if (Config->EdgeTriggered && !EdgeTriggered)
+	{
+		Log(LOG_DEBUG) << "epoll: switching to edge triggered mode";
+		EdgeTriggered = true;
+	}
+
+	if (Sockets.size() > events.size() && (!Config->MaxEvents || events.size() < Config->MaxEvents))
 		events.resize(events.size() * 2);
 
-	int total = epoll_wait(EngineHandle, &events.front(), events.size(), Config->ReadTimeout * 1000);
+	int maxevents = events.size();
+	if (Config->MaxEvents && Config->MaxEvents < events.size())
+		maxevents = Config->MaxEvents;
+
+	/* Don't wait if there are sockets with data left to read */
+	int timeout = read_again.empty() ? Config->ReadTimeout * 1000 : 0;
+	int total = epoll_wait(EngineHandle, &events.front(), maxevents, timeout);
 	Anope::CurTime = time(NULL);
 
 	/* EINTR can be given if the read timeout expires */
@@ -86,14 +147,27 @@ void SocketEngine::Process()
 		return;
 	}
 
+	if (!read_again.empty())
+	{
+		std::vector<int> pending;
+		pending.swap(read_again);
+
+		for (unsigned i = 0; i < pending.size(); ++i)
+		{
+			/* The socket may have gone away, been read from already, or stopped reading */
+			Socket *s = FindSocket(pending[i]);
+			if (s != NULL && s->flags[SF_READ_AGAIN] && s->flags[SF_READABLE])
+				ProcessSocket(s, true, false);
+		}
+	}
+
 	for (int i = 0; i < total; ++i)
 	{
 		epoll_event &ev = events[i];
 
-		std::map<int, Socket *>::iterator it = Sockets.find(ev.data.fd);
-		if (it == Sockets.end())
+		Socket *s = FindSocket(ev.data.fd);
+		if (s == NULL)
 			continue;
-		Socket *s = it->second;
 
 		if (ev.events & (EPOLLHUP | EPOLLERR))
 		{
@@ -102,20 +176,13 @@ void SocketEngine::Process()
 			continue;
 		}
 
-		if (!s->Process())
-		{
-			if (s->flags[SF_DEAD])
-				delete s;
+		if (!ProcessSocket(s, ev.events & EPOLLIN, ev.events & EPOLLOUT))
 			continue;
-		}
-
-		if ((ev.events & EPOLLIN) && !s->ProcessRead())
-			s->flags[SF_DEAD] = true;
 
-		if ((ev.events & EPOLLOUT) && !s->ProcessWrite())
-			s->flags[SF_DEAD] = true;
-
-		if (s->flags[SF_DEAD])
-			delete s;
+		/* Sockets are registered before they are known to drain, so switch them
+		 * to edge triggered the first time they are ready
+		 */
+		if (EdgeTriggered && s->flags[SF_DRAIN] && (s->flags[SF_READABLE] || s->flags[SF_WRITABLE]) && !edge_triggered[ev.data.fd])
+			Register(s, EPOLL_CTL_MOD);
 	}
 }
@@ -93,10 +93,9 @@ void SocketEngine::Process()
 		if (event.flags & EV_ERROR)
 			continue;
 
-		std::map<int, Socket *>::iterator it = Sockets.find(event.ident);
-		if (it == Sockets.end())
+		Socket *s = FindSocket(event.ident);
+		if (s == NULL)
 			continue;
-		Socket *s = it->second;
 
 		if (event.flags & EV_EOF)
 		{
@@ -117,10 +117,9 @@ void SocketEngine::Process()
 		if (ev->revents != 0)
 			++processed;
 
-		std::map<int, Socket *>::iterator it = Sockets.find(ev->fd);
-		if (it == Sockets.end())
+		Socket *s = FindSocket(ev->fd);
+		if (s == NULL)
 			continue;
-		Socket *s = it->second;
 
 		if (ev->revents & (POLLERR | POLLRDHUP))
 		{
@@ -21,6 +21,8 @@
 #endif
 
 std::map<int, Socket *> SocketEngine::Sockets;
+std::vector<Socket *> SocketEngine::SocketsByFD;
+bool SocketEngine::EdgeTriggered = false;
 
 uint32_t TotalRead = 0;
 uint32_t TotalWritten = 0;
@@ -497,7 +499,7 @@ Socket::Socket(int s, bool i, int type)
 	else
 		this->sock = s;
 	this->SetBlocking(false);
-	SocketEngine::Sockets[this->sock] = this;
+	SocketEngine::AddSocket(this);
 	SocketEngine::Change(this, true, SF_READABLE);
 }
 
@@ -507,7 +509,7 @@ Socket::~Socket()
 	SocketEngine::Change(this, false, SF_WRITABLE);
 	anope_close(this->sock);
 	this->io->Destroy();
-	SocketEngine::Sockets.erase(this->sock);
+	SocketEngine::DelSocket(this);
 }
 
 int Socket::GetFD() const
@@ -584,6 +586,30 @@ bool ListenSocket::ProcessRead()
 	return true;
 }
 
+void SocketEngine::AddSocket(Socket *s)
+{
+	int fd = s->GetFD();
+
+	Sockets[fd] = s;
+
+	if (fd >= 0 && fd < MaxTableSize)
+	{
+		if (static_cast<size_t>(fd) >= SocketsByFD.size())
+			SocketsByFD.resize(std::max(static_cast<size_t>(fd) + 1, SocketsByFD.size() * 2));
+		SocketsByFD[fd] = s;
+	}
+}
+
+void SocketEngine::DelSocket(Socket *s)
+{
+	int fd = s->GetFD();
+
+	Sockets.erase(fd);
+
+	if (fd >= 0 && static_cast<size_t>(fd) < SocketsByFD.size() && SocketsByFD[fd] == s)
+		SocketsByFD[fd] = NULL;
+}
+
 int SocketEngine::GetLastError()
 {
 #ifndef _WIN32
@@ -9,7 +9,34 @@
 #include "services.h"
 #include "timers.h"
 
-std::multimap<time_t, Timer *> TimerManager::Timers;
+Timer *TimerManager::Wheel[TimerManager::WheelSize];
+time_t TimerManager::WheelTime = 0;
+
+namespace
+{
+	struct SlotCursor;
+	/* The innermost slot being walked */
+	SlotCursor *cursors = NULL;
+
+	/* Walks the timers of a slot. Ticking or deleting a timer can delete others,
+	 * so DelTimer moves any cursor about to visit a timer past it.
+	 */
+	struct SlotCursor
+	{
+		Timer *next;
+		SlotCursor *outer;
+
+		SlotCursor(Timer *first) : next(first), outer(cursors)
+		{
+			cursors = this;
+		}
+
+		~SlotCursor()
+		{
+			cursors = outer;
+		}
+	};
+}
 
 Timer::Timer(long time_from_now, time_t now, bool repeating)
 {
@@ -80,31 +107,47 @@ Module *Timer::GetOwner() const
 
 void TimerManager::AddTimer(Timer *t)
 {
-	Timers.insert(std::make_pair(t->GetTimer(), t));
+	/* Timers which are already due go in the next slot to be ticked */
+	time_t when = t->GetTimer() > WheelTime ? t->GetTimer() : WheelTime + 1;
+
+	t->wheel_slot = when % WheelSize;
+	t->wheel_prev = NULL;
+	t->wheel_next = Wheel[t->wheel_slot];
+	if (t->wheel_next)
+		t->wheel_next->wheel_prev = t;
+	Wheel[t->wheel_slot] = t;
 }
 
 void TimerManager::DelTimer(Timer *t)
 {
-	std::pair<std::multimap<time_t, Timer *>::iterator, std::multimap<time_t, Timer *>::iterator> itpair = Timers.equal_range(t->GetTimer());
-	for (std::multimap<time_t, Timer *>::iterator i = itpair.first; i != itpair.second; ++i)
-	{
-		if (i->second == t)
-		{
-			Timers.erase(i);
-			break;
-		}
-	}
+	for (SlotCursor *c = cursors; c != NULL; c = c->outer)
+		if (c->next == t)
+			c->next = t->wheel_next;
+
+	if (t->wheel_prev)
+		t->wheel_prev->wheel_next = t->wheel_next;
+	else if (Wheel[t->wheel_slot] == t)
+		Wheel[t->wheel_slot] = t->wheel_next;
+	else
+		return;
+
+	if (t->wheel_next)
+		t->wheel_next->wheel_prev = t->wheel_prev;
+
+	t->wheel_prev = t->wheel_next = NULL;
 }
 
-void TimerManager::TickTimers(time_t ctime)
+void TimerManager::TickSlot(unsigned slot, time_t ctime)
 {
-	while (!Timers.empty())
+	SlotCursor cursor(Wheel[slot]);
+	while (cursor.next != NULL)
 	{
-		std::multimap<time_t, Timer *>::iterator it = Timers.begin();
-		Timer *t = it->second;
+		Timer *t = cursor.next;
+		cursor.next = t->wheel_next;
 
+		/* Timers a whole turn of the wheel or more away share the slot */
 		if (t->GetTimer() > ctime)
-			break;
+			continue;
 
 		t->Tick(ctime);
 
@@ -115,12 +158,42 @@ void TimerManager::TickTimers(time_t ctime)
 	}
 }
 
+void TimerManager::TickTimers(time_t ctime)
+{
+	/* If the clock went backwards, carry on from the new time */
+	if (ctime < WheelTime)
+		WheelTime = ctime;
+	if (ctime == WheelTime)
+		return;
+
+	if (ctime - WheelTime >= static_cast<time_t>(WheelSize))
+	{
+		/* Every slot has come around at least once */
+		WheelTime = ctime;
+		for (unsigned i = 0; i < WheelSize; ++i)
+			TickSlot(i, ctime);
+		return;
+	}
+
+	while (WheelTime < ctime)
+	{
+		++WheelTime;
+		TickSlot(WheelTime % WheelSize, WheelTime);
+	}
+}
+
 void TimerManager::DeleteTimersFor(Module *m)
 {
-	for (std::multimap<time_t, Timer *>::iterator it = Timers.begin(), it_next = it; it != Timers.end(); it = it_next)
+	for (unsigned i = 0; i < WheelSize; ++i)
 	{
-		++it_next;
-		if (it->second->GetOwner() == m)
-			delete it->second;
+		SlotCursor cursor(Wheel[i]);
+		while (cursor.next != NULL)
+		{
+			Timer *t = cursor.next;
+			cursor.next = t->wheel_next;
+
+			if (t->GetOwner() == m)
+				delete t;
+		}
 	}
 }
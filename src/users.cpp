@@ -143,6 +143,7 @@ void User::ChangeNick(const Anope::string &newnick, time_t ts)
 		throw CoreException("User::ChangeNick() got a bad argument");
 
 	this->super_admin = false;
+	AccessCache::Invalidate(this);
 	Log(this, "nick") << "(" << this->realname << ") changed nick to " << newnick;
 
 	Anope::string old = this->nick;
@@ -303,6 +304,7 @@ User::~User()
 
 	ModeManager::StackerDel(this);
 	this->Logout();
+	AccessCache::Invalidate(this);
 
 	if (this->HasMode("OPER"))
 		--OperCount;
@@ -417,6 +419,7 @@ void User::Logout()
 		this->nc->users.erase(it);
 
 	this->nc = NULL;
+	AccessCache::Invalidate(this);
 }
 
 NickCore *User::Account() const
@@ -493,6 +496,9 @@ bool User::HasPriv(const Anope::string &priv)
 
 void User::UpdateHost()
 {
+	/* This is called whenever the ident, host or account changes */
+	AccessCache::Invalidate(this);
+
 	if (this->host.empty())
 		return;
 
@@ -23,8 +23,375 @@
 std::list<XLineManager *> XLineManager::XLineManagers;
 Serialize::Checker<std::multimap<Anope::string, XLine *, ci::less> > XLineManager::XLinesByUID("XLine");
 
+/* Finds which XLines of an XLineManager can possibly match a user, so only those
+ * have to be checked. Exact masks are kept in a hash map, masks of the form
+ * literal* and *literal in tries, and CIDR ranges in a binary radix tree over
+ * the address bits. Anything else is kept in a list which is always checked.
+ * Every XLine is numbered in the order it was added, so the candidates can be
+ * checked in the same order as the XLineManager's list.
+ */
+class XLineIndex
+{
+	typedef std::pair<unsigned long, XLine *> Entry;
+	typedef std::vector<Entry> EntryList;
+
+	enum Kind
+	{
+		KIND_ALL,
+		KIND_EXACT,
+		KIND_PREFIX,
+		KIND_SUFFIX,
+		KIND_CIDR
+	};
+
+	/* Where an XLine is stored, so it can be removed even if its mask changes */
+	struct Location
+	{
+		unsigned long serial;
+		Kind kind;
+		Anope::string key;
+	};
+
+	struct TrieNode
+	{
+		std::map<unsigned char, TrieNode *> children;
+		EntryList entries;
+
+		~TrieNode()
+		{
+			for (std::map<unsigned char, TrieNode *>::iterator it = children.begin(); it != children.end(); ++it)
+				delete it->second;
+		}
+	};
+
+	struct RadixNode
+	{
+		RadixNode *children[2];
+		EntryList entries;
+
+		RadixNode() { children[0] = children[1] = NULL; }
+
+		~RadixNode()
+		{
+			delete children[0];
+			delete children[1];
+		}
+	};
+
+	XLineIndexField field;
+	unsigned long next_serial;
+	std::map<XLine *, Location> locations;
+
+	std::map<unsigned long, XLine *> all;
+	Anope::hash_map<EntryList> exact;
+	TrieNode prefixes, suffixes;
+	RadixNode cidr4, cidr6;
+
+	static bool HasWildcards(const Anope::string &str, size_t start, size_t end)
+	{
+		for (size_t i = start; i < end; ++i)
+			if (str[i] == '*' || str[i] == '?')
+				return true;
+		return false;
+	}
+
+	static void Erase(EntryList &list, unsigned long serial)
+	{
+		for (EntryList::iterator it = list.begin(); it != list.end(); ++it)
+			if (it->first == serial)
+			{
+				list.erase(it);
+				break;
+			}
+	}
+
+	static void Collect(const EntryList &list, EntryList &out)
+	{
+		out.insert(out.end(), list.begin(), list.end());
+	}
+
+	/* Gets the trie node for a key, walking it backwards for suffixes */
+	static TrieNode *GetNode(TrieNode *node, const Anope::string &key, bool reverse, bool create)
+	{
+		for (size_t i = 0; i < key.length() && node; ++i)
+		{
+			unsigned char c = Anope::tolower(key[reverse ? key.length() - i - 1 : i]);
+			std::map<unsigned char, TrieNode *>::iterator it = node->children.find(c);
+			if (it != node->children.end())
+				node = it->second;
+			else if (create)
+				node = node->children[c] = new TrieNode();
+			else
+				node = NULL;
+		}
+		return node;
+	}
+
+	/* Collects the entries of every key in the trie which is a prefix (or suffix) of str */
+	static void Search(const TrieNode *node, const Anope::string &str, bool reverse, EntryList &out)
+	{
+		for (size_t i = 0; i < str.length(); ++i)
+		{
+			unsigned char c = Anope::tolower(str[reverse ? str.length() - i - 1 : i]);
+			std::map<unsigned char, TrieNode *>::const_iterator it = node->children.find(c);
+			if (it == node->children.end())
+				return;
+			node = it->second;
+			Collect(node->entries, out);
+		}
+	}
+
+	/* Gets the address bytes of an IP, returning the number of bits, or 0 if it isn't an IP */
+	static unsigned GetAddress(const sockaddrs &addr, const unsigned char *&bytes)
+	{
+		if (addr.sa.sa_family == AF_INET)
+		{
+			bytes = reinterpret_cast<const unsigned char *>(&addr.sa4.sin_addr);
+			return 32;
+		}
+		else if (addr.sa.sa_family == AF_INET6)
+		{
+			bytes = reinterpret_cast<const unsigned char *>(&addr.sa6.sin6_addr);
+			return 128;
+		}
+		return 0;
+	}
+
+	/* Gets the radix tree node for a CIDR range written as ip/len */
+	RadixNode *GetRange(const Anope::string &range, bool create)
+	{
+		size_t sl = range.find('/');
+		if (sl == Anope::string::npos)
+			return NULL;
+
+		sockaddrs addr;
+		unsigned len;
+		try
+		{
+			addr.pton(range.find(':') != Anope::string::npos ? AF_INET6 : AF_INET, range.substr(0, sl));
+			len = convertTo<unsigned>(range.substr(sl + 1));
+		}
+		catch (const CoreException &)
+		{
+			return NULL;
+		}
+
+		const unsigned char *bytes;
+		unsigned bits = GetAddress(addr, bytes);
+		if (len > bits)
+			return NULL;
+
+		RadixNode *node = bits == 32 ? &cidr4 : &cidr6;
+		for (unsigned i = 0; i < len && node; ++i)
+		{
+			int bit = (bytes[i / 8] >> (7 - i % 8)) & 1;
+			if (!node->children[bit] && create)
+				node->children[bit] = new RadixNode();
+			node = node->children[bit];
+		}
+		return node;
+	}
+
+	void SearchRanges(const sockaddrs &addr, EntryList &out) const
+	{
+		const unsigned char *bytes;
+		unsigned bits = GetAddress(addr, bytes);
+		if (!bits)
+			return;
+
+		const RadixNode *node = bits == 32 ? &cidr4 : &cidr6;
+		Collect(node->entries, out);
+		for (unsigned i = 0; i < bits; ++i)
+		{
+			node = node->children[(bytes[i / 8] >> (7 - i % 8)) & 1];
+			if (!node)
+				break;
+			Collect(node->entries, out);
+		}
+	}
+
+	void SearchString(const Anope::string &str, EntryList &out) const
+	{
+		Anope::hash_map<EntryList>::const_iterator it = exact.find(str);
+		if (it != exact.end())
+			Collect(it->second, out);
+		Search(&prefixes, str, false, out);
+		Search(&suffixes, str, true, out);
+	}
+
+	EntryList *GetList(const Location &loc, bool create)
+	{
+		switch (loc.kind)
+		{
+			case KIND_EXACT:
+			{
+				if (create)
+					return &exact[loc.key];
+				Anope::hash_map<EntryList>::iterator it = exact.find(loc.key);
+				return it != exact.end() ? &it->second : NULL;
+			}
+			case KIND_PREFIX:
+			case KIND_SUFFIX:
+			{
+				TrieNode *node = GetNode(loc.kind == KIND_PREFIX ? &prefixes : &suffixes, loc.key, loc.kind == KIND_SUFFIX, create);
+				return node ? &node->entries : NULL;
+			}
+			case KIND_CIDR:
+			{
+				RadixNode *node = GetRange(loc.key, create);
+				return node ? &node->entries : NULL;
+			}
+			default:
+				return NULL;
+		}
+	}
+
+	/* Works out where to store an XLine */
+	void Classify(const XLine *x, Location &loc) const
+	{
+		loc.kind = KIND_ALL;
+
+		if (x->regex || x->IsRegex())
+			return;
+
+		if (field == XLINE_INDEX_HOST)
+		{
+			if (x->c)
+			{
+				loc.kind = KIND_CIDR;
+				loc.key = x->GetHost();
+				return;
+			}
+			loc.key = x->GetHost();
+		}
+		else
+			loc.key = x->mask;
+
+		const Anope::string &key = loc.key;
+		size_t len = key.length();
+		if (len == 0)
+			return;
+
+		if (!HasWildcards(key, 0, len))
+			loc.kind = KIND_EXACT;
+		else if (len > 1 && key[len - 1] == '*' && !HasWildcards(key, 0, len - 1))
+		{
+			loc.kind = KIND_PREFIX;
+			loc.key = key.substr(0, len - 1);
+		}
+		else if (len > 1 && key[0] == '*' && !HasWildcards(key, 1, len))
+		{
+			loc.kind = KIND_SUFFIX;
+			loc.key = key.substr(1);
+		}
+	}
+
+	/* Stores an XLine with the given place in the order */
+	void Insert(XLine *x, unsigned long serial)
+	{
+		Location &loc = locations[x];
+		loc.serial = serial;
+		Classify(x, loc);
+
+		EntryList *list = GetList(loc, true);
+		if (list)
+			list->push_back(std::make_pair(loc.serial, x));
+		else
+		{
+			loc.kind = KIND_ALL;
+			all[loc.serial] = x;
+		}
+	}
+
+ public:
+	XLineIndex(XLineIndexField f) : field(f), next_serial(0) { }
+
+	void Add(XLine *x)
+	{
+		if (locations.count(x))
+			return;
+
+		this->Insert(x, next_serial++);
+	}
+
+	/* Moves an XLine whose mask has changed, keeping its place in the order */
+	void Update(XLine *x)
+	{
+		std::map<XLine *, Location>::iterator it = locations.find(x);
+		if (it == locations.end())
+			return;
+
+		unsigned long serial = it->second.serial;
+		this->Remove(x);
+		this->Insert(x, serial);
+	}
+
+	void Remove(XLine *x)
+	{
+		std::map<XLine *, Location>::iterator it = locations.find(x);
+		if (it == locations.end())
+			return;
+
+		const Location &loc = it->second;
+		if (loc.kind == KIND_ALL)
+			all.erase(loc.serial);
+		else
+		{
+			EntryList *list = GetList(loc, false);
+			if (list)
+				Erase(*list, loc.serial);
+			if (loc.kind == KIND_EXACT && list && list->empty())
+				exact.erase(loc.key);
+		}
+
+		locations.erase(it);
+	}
+
+	/* Finds the XLines which may match a user, newest first */
+	void Find(User *u, std::vector<XLine *> &candidates) const
+	{
+		EntryList found;
+
+		for (std::map<unsigned long, XLine *>::const_iterator it = all.begin(); it != all.end(); ++it)
+			found.push_back(*it);
+
+		switch (field)
+		{
+			case XLINE_INDEX_HOST:
+				SearchString(u->host, found);
+				SearchString(u->ip.addr(), found);
+				SearchRanges(u->ip, found);
+				break;
+			case XLINE_INDEX_NICK:
+				SearchString(u->nick, found);
+				break;
+			case XLINE_INDEX_REALNAME:
+				SearchString(u->realname, found);
+				break;
+			default:
+				break;
+		}
+
+		std::sort(found.begin(), found.end());
+		found.erase(std::unique(found.begin(), found.end()), found.end());
+
+		candidates.reserve(found.size());
+		for (EntryList::reverse_iterator it = found.rbegin(); it != found.rend(); ++it)
+			candidates.push_back(it->second);
+	}
+};
+
 void XLine::Init()
 {
+	delete this->regex;
+	this->regex = NULL;
+	delete this->c;
+	this->c = NULL;
+	this->nick.clear();
+	this->user.clear();
+	this->host.clear();
+	this->real.clear();
+
 	if (this->mask.length() >= 2 && this->mask[0] == '/' && this->mask[this->mask.length() - 1] == '/' && !Config->GetBlock("options")->Get<const Anope::string>("regexengine").empty())
 	{
 		Anope::string stripped_mask = this->mask.substr(1, this->mask.length() - 2);
@@ -177,11 +544,20 @@ Serializable* XLine::Unserialize(Serializable *obj, Serialize::Data &data)
 	if (obj)
 	{
 		xl = anope_dynamic_static_cast<XLine *>(obj);
+		Anope::string old_mask = xl->mask;
 		data["mask"] >> xl->mask;
 		data["by"] >> xl->by;
 		data["reason"] >> xl->reason;
 		data["uid"] >> xl->id;
 
+		/* The parts of the mask and where the line is indexed both come from the mask */
+		if (xl->mask != old_mask)
+		{
+			xl->Init();
+			if (xl->manager && *xlm == xl->manager)
+				xl->manager->UpdateXLine(xl);
+		}
+
 		if (xlm != xl->manager)
 		{
 			xl->manager->DelXLine(xl);
@@ -261,13 +637,14 @@ Anope::string XLineManager::GenerateUID()
 	return id;
 }
 
-XLineManager::XLineManager(Module *creator, const Anope::string &xname, char t) : Service(creator, "XLineManager", xname), type(t), xlines("XLine")
+XLineManager::XLineManager(Module *creator, const Anope::string &xname, char t) : Service(creator, "XLineManager", xname), type(t), xlines("XLine"), match_index(NULL), next_expire(0)
 {
 }
 
 XLineManager::~XLineManager()
 {
 	this->Clear();
+	delete this->match_index;
 }
 
 const char &XLineManager::Type()
@@ -291,6 +668,11 @@ void XLineManager::AddXLine(XLine *x)
 		XLinesByUID->insert(std::make_pair(x->id, x));
 	this->xlines->push_back(x);
 	x->manager = this;
+
+	if (this->match_index)
+		this->match_index->Add(x);
+	if (x->expires && (!this->next_expire || x->expires < this->next_expire))
+		this->next_expire = x->expires;
 }
 
 void XLineManager::RemoveXLine(XLine *x)
@@ -315,6 +697,15 @@ void XLineManager::RemoveXLine(XLine *x)
 		this->SendDel(x);
 		this->xlines->erase(it);
 	}
+
+	if (this->match_index)
+		this->match_index->Remove(x);
+}
+
+void XLineManager::UpdateXLine(XLine *x)
+{
+	if (this->match_index)
+		this->match_index->Update(x);
 }
 
 bool XLineManager::DelXLine(XLine *x)
@@ -336,6 +727,9 @@ bool XLineManager::DelXLine(XLine *x)
 	{
 		this->SendDel(x);
 
+		if (this->match_index)
+			this->match_index->Remove(x);
+
 		x->manager = NULL; // Don't call remove
 		delete x;
 		this->xlines->erase(it);
@@ -361,6 +755,10 @@ void XLineManager::Clear()
 	std::vector<XLine *> xl;
 	this->xlines->swap(xl);
 
+	delete this->match_index;
+	this->match_index = NULL;
+	this->next_expire = 0;
+
 	for (unsigned i = 0; i < xl.size(); ++i)
 	{
 		XLine *x = xl[i];
@@ -441,12 +839,56 @@ XLine* XLineManager::HasEntry(const Anope::string &mask)
 	return NULL;
 }
 
-XLine *XLineManager::CheckAllXLines(User *u)
+void XLineManager::ExpireXLines()
 {
+	if (!this->next_expire || this->next_expire >= Anope::CurTime)
+		return;
+
+	this->next_expire = 0;
 	for (unsigned i = this->xlines->size(); i > 0; --i)
 	{
 		XLine *x = this->xlines->at(i - 1);
 
+		if (!x->expires)
+			continue;
+
+		if (x->expires < Anope::CurTime)
+		{
+			this->OnExpire(x);
+			this->DelXLine(x);
+		}
+		else if (!this->next_expire || x->expires < this->next_expire)
+			this->next_expire = x->expires;
+	}
+}
+
+XLine *XLineManager::CheckAllXLines(User *u)
+{
+	uint64_t start = Anope::MicroTime();
+
+	this->ExpireXLines();
+
+	std::vector<XLine *> candidates;
+	if (this->GetIndexField() != XLINE_INDEX_NONE)
+	{
+		if (!this->match_index)
+		{
+			this->match_index = new XLineIndex(this->GetIndexField());
+			for (unsigned i = 0; i < this->xlines->size(); ++i)
+				this->match_index->Add(this->xlines->at(i));
+		}
+
+		this->match_index->Find(u, candidates);
+	}
+	else
+		candidates.assign(this->xlines->rbegin(), this->xlines->rend());
+
+	XLine *match = NULL;
+	unsigned long checked = 0;
+	for (unsigned i = 0; i < candidates.size(); ++i)
+	{
+		XLine *x = candidates[i];
+
 		if (x->expires && x->expires < Anope::CurTime)
 		{
 			this->OnExpire(x);
@@ -454,14 +896,35 @@ XLine *XLineManager::CheckAllXLines(User *u)
 			continue;
 		}
 
+		++checked;
 		if (this->Check(u, x))
 		{
-			this->OnMatch(u, x);
-			return x;
+			match = x;
+			break;
 		}
 	}
 
-	return NULL;
+	uint64_t elapsed = Anope::MicroTime() - start;
+	++this->stats.lookups;
+	this->stats.checked += checked;
+	this->stats.total_time += elapsed;
+	if (elapsed > this->stats.max_time)
+		this->stats.max_time = elapsed;
+
+	if (match)
+		this->OnMatch(u, match);
+
+	return match;
+}
+
+const XLineCheckStats &XLineManager::GetCheckStats() const
+{
+	return this->stats;
+}
+
+XLineIndexField XLineManager::GetIndexField() const
+{
+	return XLINE_INDEX_NONE;
 }
 
 void XLineManager::OnExpire(const XLine *x)